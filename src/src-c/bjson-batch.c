@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2017 by Kemu Studio (visit ke.mu)
+ *
+ * Author(s): Sylwester Wysocki <sw@ke.mu>,
+ *            Roman Pietrzak <rp@ke.mu>
+ *
+ * This file is a part of the KEMU Binary JSON library.
+ * See http://bjson.org for more.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "bjson-batch.h"
+#include "bjson-common.h"
+#include "bjson-debug.h"
+#include "bjson-decode.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * Worker threads run on pthreads. Available on POSIX systems only,
+ * elsewhere batch decoder can't be created. Define BJSON_BATCH_SUPPORTED
+ * to 0 to build library without it.
+ */
+
+#ifndef BJSON_BATCH_SUPPORTED
+# if defined(_WIN32) || defined(WIN32)
+#  define BJSON_BATCH_SUPPORTED 0
+# else
+#  define BJSON_BATCH_SUPPORTED 1
+# endif
+#endif
+
+#if BJSON_BATCH_SUPPORTED
+# include <pthread.h>
+#endif
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+
+/*
+ * Number of document portions per worker in one batch. Workers claim
+ * documents in portions to keep locking rare, but portions are small
+ * enough to balance load when documents differ in size.
+ */
+
+#define BJSON_BATCH_PORTIONS_PER_WORKER 8
+
+#if BJSON_BATCH_SUPPORTED
+
+/*
+ * ----------------------------------------------------------------------------
+ *                        Private structs and typedefs
+ * ----------------------------------------------------------------------------
+ */
+
+typedef struct
+{
+  pthread_t thread;
+
+  /* Decoder context owned by this worker. Reused over all documents. */
+  bjson_decodeCtx_t *decodeCtx;
+
+  /* Parent batch decoder. */
+  struct bjson_batchDecodeCtx *batchCtx;
+}
+bjson_batchWorker_t;
+
+typedef struct bjson_batchDecodeCtx
+{
+  /*
+   * Worker threads. Each one owns its own decoder context.
+   */
+
+  bjson_batchWorker_t *workers;
+  int numWorkers;
+
+  /*
+   * Current batch. Fields below are protected by mutex.
+   */
+
+  pthread_mutex_t mutex;
+  pthread_cond_t  batchStarted;
+  pthread_cond_t  batchFinished;
+
+  const bjson_batchDocument_t *docs;
+  bjson_batchResult_t *results;
+
+  size_t numDocs;
+  size_t nextDocIdx;
+  size_t portionSize;
+
+  unsigned int batchId;
+  int numBusyWorkers;
+  int shutdown;
+} bjson_batchDecodeCtx_t;
+
+/*
+ * ----------------------------------------------------------------------------
+ *                              Internal helpers
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Decode one complete document using worker's own decoder context.
+ */
+
+static void _decodeDocument(bjson_decodeCtx_t *decodeCtx,
+                            const bjson_batchDocument_t *doc,
+                            bjson_batchResult_t *result)
+{
+  bjson_status_t statusCode = bjson_status_ok;
+
+  bjson_decoderReset(decodeCtx);
+  bjson_decoderSetCallerCtx(decodeCtx, doc->callerCtx);
+
+  statusCode = bjson_decoderParse(decodeCtx, doc->data, doc->size);
+
+  if (statusCode == bjson_status_ok)
+  {
+    statusCode = bjson_decoderComplete(decodeCtx);
+  }
+
+  result->statusCode = statusCode;
+}
+
+/*
+ * Worker thread entry point. Wait for next batch, then claim and decode
+ * documents portion by portion until nothing left.
+ */
+
+static void *_workerMain(void *arg)
+{
+  bjson_batchWorker_t *worker = (bjson_batchWorker_t *)arg;
+  bjson_batchDecodeCtx_t *ctx = worker->batchCtx;
+
+  unsigned int lastBatchId = 0;
+
+  pthread_mutex_lock(&ctx->mutex);
+
+  for (;;)
+  {
+    /*
+     * Wait until next batch started or pool is going to shut down.
+     */
+
+    while (!ctx->shutdown && ctx->batchId == lastBatchId)
+    {
+      pthread_cond_wait(&ctx->batchStarted, &ctx->mutex);
+    }
+
+    if (ctx->shutdown)
+    {
+      break;
+    }
+
+    lastBatchId = ctx->batchId;
+
+    /*
+     * Claim next portion of documents until whole batch is done.
+     */
+
+    while (ctx->nextDocIdx < ctx->numDocs)
+    {
+      size_t firstIdx = ctx->nextDocIdx;
+      size_t lastIdx  = MIN(firstIdx + ctx->portionSize, ctx->numDocs);
+      size_t i        = 0;
+
+      ctx->nextDocIdx = lastIdx;
+
+      pthread_mutex_unlock(&ctx->mutex);
+
+      for (i = firstIdx; i < lastIdx; i++)
+      {
+        _decodeDocument(worker->decodeCtx, &ctx->docs[i], &ctx->results[i]);
+      }
+
+      pthread_mutex_lock(&ctx->mutex);
+    }
+
+    /*
+     * Nothing left to claim. Tell caller if we're the last one.
+     */
+
+    ctx->numBusyWorkers--;
+
+    if (ctx->numBusyWorkers == 0)
+    {
+      pthread_cond_signal(&ctx->batchFinished);
+    }
+  }
+
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return NULL;
+}
+
+/*
+ * Stop and join all already started workers, then free all resources.
+ */
+
+static void _destroyWorkers(bjson_batchDecodeCtx_t *ctx, int numStarted)
+{
+  int i = 0;
+
+  pthread_mutex_lock(&ctx->mutex);
+  ctx->shutdown = 1;
+  pthread_cond_broadcast(&ctx->batchStarted);
+  pthread_mutex_unlock(&ctx->mutex);
+
+  for (i = 0; i < numStarted; i++)
+  {
+    pthread_join(ctx->workers[i].thread, NULL);
+  }
+
+  for (i = 0; i < ctx->numWorkers; i++)
+  {
+    bjson_decoderDestroy(ctx->workers[i].decodeCtx);
+  }
+}
+
+#endif /* BJSON_BATCH_SUPPORTED */
+
+/*
+ * ----------------------------------------------------------------------------
+ *                                 Public API
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Create new batch decoder context together with its pool of worker
+ * threads.
+ *
+ * numThreads       - number of worker threads to start. Values lower
+ *                    than 1 are treated as 1 (IN).
+ *
+ * decoderCallbacks - struct containing pointer to callback functions
+ *                    called when next token (integer, string etc.)
+ *                    was sucessfully decoded. Callbacks are called from
+ *                    worker threads (IN).
+ *
+ * memoryFunctions  - optional struct containing pointers to custom
+ *                    malloc/free/realloc functions. Set to NULL if
+ *                    not needed (IN/OPT).
+ *
+ * memoryCtx        - optional caller specified context passed to memory
+ *                    functions. Set to NULL if not needed (IN/OPT).
+ *
+ * TIP: Available on POSIX systems only. NULL is returned elsewhere or
+ *      if library was built with BJSON_BATCH_SUPPORTED set to 0.
+ *
+ * WARNING! Returned context *MUST* be freed by caller using
+ *          bjson_batchDecoderDestroy() function.
+ *
+ * RETURNS: Pointer to new allocated batch decoder context if success,
+ *          NULL if error.
+ */
+
+BJSON_API bjson_batchDecodeCtx_t *bjson_batchDecoderCreate(
+                                 int numThreads,
+                                 bjson_decoderCallbacks_t *decoderCallbacks,
+                                 bjson_memoryFunctions_t *memoryFunctions,
+                                 void *memoryCtx)
+{
+  #if BJSON_BATCH_SUPPORTED
+  bjson_batchDecodeCtx_t *ctx = calloc(sizeof(bjson_batchDecodeCtx_t), 1);
+
+  int numStarted = 0;
+  int i          = 0;
+
+  if (ctx == NULL)
+  {
+    return NULL;
+  }
+
+  ctx->numWorkers = MAX(numThreads, 1);
+  ctx->workers    = calloc(sizeof(bjson_batchWorker_t), ctx->numWorkers);
+
+  if (ctx->workers == NULL)
+  {
+    free(ctx);
+
+    return NULL;
+  }
+
+  pthread_mutex_init(&ctx->mutex, NULL);
+  pthread_cond_init(&ctx->batchStarted, NULL);
+  pthread_cond_init(&ctx->batchFinished, NULL);
+
+  /*
+   * Create decoder context for each worker, then start threads.
+   */
+
+  for (i = 0; i < ctx->numWorkers; i++)
+  {
+    ctx->workers[i].batchCtx  = ctx;
+    ctx->workers[i].decodeCtx = bjson_decoderCreate(decoderCallbacks,
+                                                    memoryFunctions,
+                                                    memoryCtx);
+  }
+
+  for (i = 0; i < ctx->numWorkers; i++)
+  {
+    if (ctx->workers[i].decodeCtx == NULL ||
+        pthread_create(&ctx->workers[i].thread, NULL,
+                       _workerMain, &ctx->workers[i]) != 0)
+    {
+      break;
+    }
+
+    numStarted++;
+  }
+
+  if (numStarted < ctx->numWorkers)
+  {
+    /*
+     * Error - can't start all workers. Roll back.
+     */
+
+    BJSON_DEBUG("batch: can't start worker [%d]", numStarted);
+
+    _destroyWorkers(ctx, numStarted);
+
+    pthread_cond_destroy(&ctx->batchFinished);
+    pthread_cond_destroy(&ctx->batchStarted);
+    pthread_mutex_destroy(&ctx->mutex);
+
+    free(ctx->workers);
+    free(ctx);
+
+    ctx = NULL;
+  }
+
+  return ctx;
+  #else
+  (void)numThreads;
+  (void)decoderCallbacks;
+  (void)memoryFunctions;
+  (void)memoryCtx;
+
+  return NULL;
+  #endif
+}
+
+/*
+ * Stop worker threads and free batch decoder context.
+ *
+ * ctx - batch decoder context created by bjson_batchDecoderCreate()
+ *       before (IN).
+ */
+
+BJSON_API void bjson_batchDecoderDestroy(bjson_batchDecodeCtx_t *ctx)
+{
+  #if BJSON_BATCH_SUPPORTED
+  if (ctx)
+  {
+    _destroyWorkers(ctx, ctx->numWorkers);
+
+    pthread_cond_destroy(&ctx->batchFinished);
+    pthread_cond_destroy(&ctx->batchStarted);
+    pthread_mutex_destroy(&ctx->mutex);
+
+    free(ctx->workers);
+    free(ctx);
+  }
+  #else
+  (void)ctx;
+  #endif
+}
+
+/*
+ * Decode many independent, complete BJSON documents in parallel.
+ *
+ * TIP#1: Decoder callbacks get docs[i].callerCtx as their context
+ *        parameter, so caller can tell which document token belongs to.
+ *
+ * TIP#2: Function is *NOT* reentrant. Don't run two batches on the same
+ *        context at the same time.
+ *
+ * ctx     - batch decoder context created by bjson_batchDecoderCreate()
+ *           before (IN),
+ * docs    - array of documents to decode (IN),
+ * numDocs - number of items in docs[] array (IN),
+ * results - array of at least numDocs items to receive decode status
+ *           of each document (OUT).
+ *
+ * RETURNS: bjson_status_ok if whole batch was processed. Check results[]
+ *          array for status of each document.
+ *          bjson_status_error_notImplemented if batch decoder is not
+ *          supported.
+ */
+
+BJSON_API bjson_status_t bjson_batchDecode(bjson_batchDecodeCtx_t *ctx,
+                                           const bjson_batchDocument_t *docs,
+                                           size_t numDocs,
+                                           bjson_batchResult_t *results)
+{
+  #if BJSON_BATCH_SUPPORTED
+  size_t numPortions = (size_t)ctx->numWorkers * BJSON_BATCH_PORTIONS_PER_WORKER;
+
+  if (numDocs == 0)
+  {
+    return bjson_status_ok;
+  }
+
+  pthread_mutex_lock(&ctx->mutex);
+
+  ctx->docs           = docs;
+  ctx->results        = results;
+  ctx->numDocs        = numDocs;
+  ctx->nextDocIdx     = 0;
+  ctx->portionSize    = MAX(numDocs / numPortions, 1);
+  ctx->numBusyWorkers = ctx->numWorkers;
+  ctx->batchId++;
+
+  BJSON_DEBUG("batch: started batch [%u] with [%u] documents, portion size [%u]",
+              ctx->batchId, numDocs, ctx->portionSize);
+
+  pthread_cond_broadcast(&ctx->batchStarted);
+
+  while (ctx->numBusyWorkers > 0)
+  {
+    pthread_cond_wait(&ctx->batchFinished, &ctx->mutex);
+  }
+
+  ctx->docs    = NULL;
+  ctx->results = NULL;
+  ctx->numDocs = 0;
+
+  pthread_mutex_unlock(&ctx->mutex);
+
+  return bjson_status_ok;
+  #else
+  (void)ctx;
+  (void)docs;
+  (void)numDocs;
+  (void)results;
+
+  return bjson_status_error_notImplemented;
+  #endif
+}
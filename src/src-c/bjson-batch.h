@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2017 by Kemu Studio (visit ke.mu)
+ *
+ * Author(s): Sylwester Wysocki <sw@ke.mu>,
+ *            Roman Pietrzak <rp@ke.mu>
+ *
+ * This file is a part of the KEMU Binary JSON library.
+ * See http://bjson.org for more.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _BJSON_BATCH_H_
+#define _BJSON_BATCH_H_
+
+#include "bjson-common.h"
+#include "bjson-decode.h"
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Structs and data types.
+ */
+
+typedef struct
+{
+  /* Complete BJSON document to decode. */
+  const void *data;
+  size_t size;
+
+  /* Optional caller context passed to decoder callbacks for this document. */
+  void *callerCtx;
+}
+bjson_batchDocument_t;
+
+typedef struct
+{
+  /* Final decoder status for one document. */
+  bjson_status_t statusCode;
+}
+bjson_batchResult_t;
+
+typedef struct bjson_batchDecodeCtx bjson_batchDecodeCtx_t;
+
+/*
+ * Functions to create/destroy batch decoder context.
+ * Batch decoder owns a pool of worker threads. Each worker keeps its own
+ * decoder context, which is reused over all documents and all batches.
+ *
+ * TIP#1: Each call to bjson_batchDecoderCreate() *MUST* be followed by
+ *        bjson_batchDecoderDestroy() call.
+ *
+ * TIP#2: Typical usage is:
+ *
+ *        ctx = bjson_batchDecoderCreate(numThreads, callbacks, ...)
+ *
+ *          bjson_batchDecode(ctx, docs, numDocs, results)
+ *          bjson_batchDecode(ctx, docs, numDocs, results)
+ *          ...
+ *
+ *        bjson_batchDecoderDestroy(ctx)
+ *
+ * TIP#3: Callbacks are called from worker threads. Documents are decoded
+ *        in parallel, so callbacks and memory functions *MUST* be thread
+ *        safe. Tokens from one document are always passed in order and
+ *        from one thread.
+ */
+
+BJSON_API bjson_batchDecodeCtx_t *
+  bjson_batchDecoderCreate(int numThreads,
+                           bjson_decoderCallbacks_t *decoderCallbacks,
+                           bjson_memoryFunctions_t *memoryFunctions,
+                           void *memoryCtx);
+
+BJSON_API void
+  bjson_batchDecoderDestroy(bjson_batchDecodeCtx_t *ctx);
+
+/*
+ * Decode many independent BJSON documents at once.
+ * Function returns when all documents are decoded.
+ */
+
+BJSON_API bjson_status_t
+  bjson_batchDecode(bjson_batchDecodeCtx_t *ctx,
+                    const bjson_batchDocument_t *docs,
+                    size_t numDocs,
+                    bjson_batchResult_t *results);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _BJSON_BATCH_H_ */
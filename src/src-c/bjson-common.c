@@ -22,11 +22,17 @@
 
 #include "bjson-common.h"
 #include "bjson-constants.h"
-#include <stdio.h>
 
-#define BJSON_VERSION_TEXT_SIZE 32
+/*
+ * Version text is rendered at compilation time. There is no shared mutable
+ * state, so bjson_getVersionAsText() is safe to call from many threads.
+ */
 
-static char g_versionText[BJSON_VERSION_TEXT_SIZE] = {0};
+#define BJSON_STRINGIFY_(x) #x
+#define BJSON_STRINGIFY(x) BJSON_STRINGIFY_(x)
+
+#define BJSON_VERSION_TEXT \
+  BJSON_STRINGIFY(BJSON_MAJOR) "." BJSON_STRINGIFY(BJSON_MINOR) "." BJSON_STRINGIFY(BJSON_MICRO)
 
 BJSON_API const char *bjson_getStatusAsText(bjson_status_t statusCode)
 {
@@ -57,6 +63,19 @@ BJSON_API const char *bjson_getStatusAsText(bjson_status_t statusCode)
     {bjson_status_error_closeMapAtRootLevel,     "going to close map at root level"},
     {bjson_status_error_closeArrayAtRootLevel,   "going to close array at root level"},
     {bjson_status_error_negativeSize,            "going to encode negative size value"},
+    {bjson_status_error_unknownOption,           "unknown option"},
+    {bjson_status_error_valueTooLong,            "string or binary longer than allowed"},
+    {bjson_status_error_cacheLimitExceeded,      "cache size limit exceeded"},
+    {bjson_status_error_cacheInUse,              "cache in use by fragmented token"},
+    {bjson_status_error_containerSizeMismatch,   "container size differs from declared one"},
+    {bjson_status_error_measurePassMismatch,     "encode calls differ from measure pass"},
+    {bjson_status_error_bufferFull,              "output buffer full"},
+    {bjson_status_error_keyNotExpected,          "object key outside of key position"},
+    {bjson_status_error_invalidTemplate,         "template not compiled or malformed"},
+    {bjson_status_error_sinkFailed,              "sink failed to write output"},
+    {bjson_status_error_streamedValueOpen,       "streamed string or binary not ended"},
+    {bjson_status_error_streamedValueNotOpen,    "no streamed string or binary open"},
+    {bjson_status_error_invalidSavepoint,        "savepoint no longer valid"},
 
     /* Array terminator. */
     {0, NULL}
@@ -159,17 +178,7 @@ BJSON_API const char *bjson_getTokenName(uint8_t tokenId)
 
 BJSON_API const char *bjson_getVersionAsText()
 {
-  if (g_versionText[0] == 0)
-  {
-    /*
-     * First time call - render version to static buffer.
-     */
-
-    snprintf(g_versionText, BJSON_VERSION_TEXT_SIZE - 1,
-             "%d.%d.%d", BJSON_MAJOR, BJSON_MINOR, BJSON_MICRO);
-  }
-
-  return g_versionText;
+  return BJSON_VERSION_TEXT;
 }
 
 BJSON_API unsigned int bjson_getVersion()
@@ -94,7 +94,20 @@ typedef enum
   bjson_status_error_closeArrayButMapOpen,
   bjson_status_error_closeMapAtRootLevel,
   bjson_status_error_closeArrayAtRootLevel,
-  bjson_status_error_negativeSize
+  bjson_status_error_negativeSize,
+  bjson_status_error_unknownOption,
+  bjson_status_error_valueTooLong,
+  bjson_status_error_cacheLimitExceeded,
+  bjson_status_error_cacheInUse,
+  bjson_status_error_containerSizeMismatch,
+  bjson_status_error_measurePassMismatch,
+  bjson_status_error_bufferFull,
+  bjson_status_error_keyNotExpected,
+  bjson_status_error_invalidTemplate,
+  bjson_status_error_sinkFailed,
+  bjson_status_error_streamedValueOpen,
+  bjson_status_error_streamedValueNotOpen,
+  bjson_status_error_invalidSavepoint
 }
 bjson_status_t;
 
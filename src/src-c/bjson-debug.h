@@ -26,6 +26,16 @@
 #define BJSON_DEBUG_LEVEL 0
 #define BJSON_DEBUG_DUMP_BUFFERS 0
 
+/*
+ * Statistics collected by decoder and encoder. Enabled by default, each update
+ * is a single increment of context field. Define BJSON_STATS_ENABLED to 0
+ * to compile them out.
+ */
+
+#ifndef BJSON_STATS_ENABLED
+  #define BJSON_STATS_ENABLED 1
+#endif
+
 /*
  * Dump buffers to log.
  */
@@ -68,4 +78,24 @@
   #define BJSON_DEBU1(_fmt_, ...)
 #endif
 
+/*
+ * Statistics.
+ */
+
+#if BJSON_STATS_ENABLED > 0
+  #define BJSON_STATS_ADD(_stats_, _field_, _value_) ((_stats_)._field_ += (_value_))
+  #define BJSON_STATS_INC(_stats_, _field_) ((_stats_)._field_++)
+  #define BJSON_STATS_PEAK(_stats_, _field_, _value_)  \
+    {                                                  \
+      if ((_stats_)._field_ < (_value_))               \
+      {                                                \
+        (_stats_)._field_ = (_value_);                 \
+      }                                                \
+    }
+#else
+  #define BJSON_STATS_ADD(_stats_, _field_, _value_)
+  #define BJSON_STATS_INC(_stats_, _field_)
+  #define BJSON_STATS_PEAK(_stats_, _field_, _value_)
+#endif
+
 #endif /* _BJSON_DEBUG_H_ */
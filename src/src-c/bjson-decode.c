@@ -26,6 +26,7 @@
 #include "bjson-debug.h"
 
 #include <assert.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -55,6 +56,8 @@
   {                                                                                         \
     if (_ctx_->callbacks->_cb_)                                                             \
     {                                                                                       \
+      BJSON_STATS_INC(_ctx_->stats, callbacksInvoked);                                      \
+                                                                                            \
       if (_ctx_->callbacks->_cb_(_ctx_->callerCtx) != bjson_decoderCallbackResult_Continue) \
       {                                                                                     \
         _setErrorState(_ctx_, bjson_status_canceledByClient);                               \
@@ -66,6 +69,8 @@
   {                                                                                                      \
     if (_ctx_->callbacks->_cb_)                                                                          \
     {                                                                                                    \
+      BJSON_STATS_INC(_ctx_->stats, callbacksInvoked);                                                   \
+                                                                                                         \
       if (_ctx_->callbacks->_cb_(_ctx_->callerCtx, __VA_ARGS__) != bjson_decoderCallbackResult_Continue) \
       {                                                                                                  \
         _setErrorState(_ctx_, bjson_status_canceledByClient);                                            \
@@ -154,6 +159,27 @@ typedef struct bjson_decodeCtx
   size_t cacheIdx;
   size_t cacheBytesMissing;
 
+  /*
+   * Cache limits set by caller. Optional arena is caller owned buffer
+   * used as cache as long as token fits into it.
+   */
+
+  size_t maxStringSize;
+  size_t maxCacheSize;
+  size_t cacheWatermark;
+
+  void *arena;
+  size_t arenaSize;
+
+  /*
+   * Inline buffer to join type size field (stage II) fragmented over
+   * chunks. It's at most 8 bytes long, so no cache or recursive decode
+   * is needed.
+   */
+
+  uint8_t header[8];
+  size_t headerIdx;
+
   /*
    * User defined callbacks, executed each time when one of bjson
    * token (integer, double, string etc.) was successfuly decoded.
@@ -161,6 +187,18 @@ typedef struct bjson_decodeCtx
 
   bjson_decoderCallbacks_t *callbacks;
 
+  /*
+   * Optional batched delivery. If batchCallback is set, then decoded
+   * tokens are collected in events[] buffer and passed to caller in
+   * portions instead of calling per-token callbacks above.
+   */
+
+  bjson_decoderBatchCallback_t batchCallback;
+
+  bjson_decoderEvent_t *events;
+  size_t eventsCapacity;
+  size_t numEvents;
+
   /*
    * User defined functions used as replacement for standard
    * malloc/realloc/free. These callbacks are options. If NULL
@@ -170,11 +208,19 @@ typedef struct bjson_decodeCtx
   bjson_memoryFunctions_t *memoryFunctions;
 
   /*
-   * Optional user defined callback passed to all callbacks above if
-   * set.
+   * Optional user defined context passed to all callbacks above if
+   * set. Memory functions get the context passed at create time, while
+   * decoder callbacks get the current one (see bjson_decoderSetCallerCtx).
    */
 
   void *callerCtx;
+  void *memoryCtx;
+
+  /*
+   * Statistics collected since context was created.
+   */
+
+  bjson_decoderStats_t stats;
 } bjson_decodeCtx_t;
 
 /*
@@ -197,6 +243,55 @@ static void _setErrorState(bjson_decodeCtx_t *ctx, bjson_status_t statusCode)
   ctx->stage      = bjson_decodeStage_error;
 }
 
+/*
+ * Pass all collected events to caller in one bjson_batch call.
+ */
+
+static void _flushEvents(bjson_decodeCtx_t *ctx)
+{
+  if (ctx->numEvents > 0)
+  {
+    size_t numEvents = ctx->numEvents;
+
+    ctx->numEvents = 0;
+
+    BJSON_STATS_INC(ctx->stats, callbacksInvoked);
+
+    if (ctx->batchCallback(ctx->callerCtx, ctx->events, numEvents) !=
+        bjson_decoderCallbackResult_Continue)
+    {
+      _setErrorState(ctx, bjson_status_canceledByClient);
+    }
+  }
+}
+
+/*
+ * Reserve next slot in event buffer. Buffer is flushed first if full.
+ */
+
+static bjson_decoderEvent_t *_pushEvent(bjson_decodeCtx_t *ctx,
+                                        bjson_decoderEventType_t type,
+                                        int depth)
+{
+  bjson_decoderEvent_t *event = NULL;
+
+  BJSON_STATS_INC(ctx->stats, tokens[type]);
+
+  if (ctx->numEvents == ctx->eventsCapacity)
+  {
+    _flushEvents(ctx);
+  }
+
+  event = &ctx->events[ctx->numEvents];
+
+  event->type  = type;
+  event->depth = depth;
+
+  ctx->numEvents++;
+
+  return event;
+}
+
 static void _enterMapOrArray(bjson_decodeCtx_t *ctx)
 {
   if (ctx->deepIdx == BJSON_MAX_DEPTH)
@@ -217,9 +312,19 @@ static void _enterMapOrArray(bjson_decodeCtx_t *ctx)
     ctx->blockMapTurn[ctx->deepIdx] = 0;
     ctx->stage = bjson_decodeStage_dataType;
 
+    BJSON_STATS_PEAK(ctx->stats, maxDepth, ctx->deepIdx);
+
     if (ctx->dataTypeBase == BJSON_DATATYPE_ARRAY_BASE)
     {
-      PASS_TOKEN0(ctx, bjson_start_array);
+      if (ctx->batchCallback)
+      {
+        _pushEvent(ctx, bjson_decoderEvent_startArray, ctx->deepIdx - 1);
+      }
+      else
+      {
+        BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_startArray]);
+        PASS_TOKEN0(ctx, bjson_start_array);
+      }
 
       BJSON_DEBUG("decoder: entered array type [%d], deep [%d], bodyIdx [%u], endIdx [%u]",
                   ctx->dataType,
@@ -229,7 +334,15 @@ static void _enterMapOrArray(bjson_decodeCtx_t *ctx)
     }
     else
     {
-      PASS_TOKEN0(ctx, bjson_start_map);
+      if (ctx->batchCallback)
+      {
+        _pushEvent(ctx, bjson_decoderEvent_startMap, ctx->deepIdx - 1);
+      }
+      else
+      {
+        BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_startMap]);
+        PASS_TOKEN0(ctx, bjson_start_map);
+      }
 
       BJSON_DEBUG("decoder: entered map type [%d], deep [%d], bodyIdx [%u], endIdx [%u]",
                   ctx->dataType,
@@ -296,9 +409,19 @@ static void _tryLeaveMapOrArray(bjson_decodeCtx_t *ctx)
            * Close nearsest array.
            */
 
-          if (ctx->callbacks->bjson_end_array)
+          if (ctx->batchCallback)
+          {
+            _pushEvent(ctx, bjson_decoderEvent_endArray, ctx->deepIdx - 1);
+          }
+          else
           {
-            ctx->callbacks->bjson_end_array(ctx->callerCtx);
+            BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_endArray]);
+
+            if (ctx->callbacks->bjson_end_array)
+            {
+              BJSON_STATS_INC(ctx->stats, callbacksInvoked);
+              ctx->callbacks->bjson_end_array(ctx->callerCtx);
+            }
           }
 
           BJSON_DEBUG("decoder: leaved array type [%d], deep [%d], dataIdx [%u]",
@@ -326,9 +449,19 @@ static void _tryLeaveMapOrArray(bjson_decodeCtx_t *ctx)
              * Close nearest map.
              */
 
-            if (ctx->callbacks->bjson_end_map)
+            if (ctx->batchCallback)
+            {
+              _pushEvent(ctx, bjson_decoderEvent_endMap, ctx->deepIdx - 1);
+            }
+            else
             {
-              ctx->callbacks->bjson_end_map(ctx->callerCtx);
+              BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_endMap]);
+
+              if (ctx->callbacks->bjson_end_map)
+              {
+                BJSON_STATS_INC(ctx->stats, callbacksInvoked);
+                ctx->callbacks->bjson_end_map(ctx->callerCtx);
+              }
             }
 
             BJSON_DEBUG("decoder: leaved map type [%d], deep [%d], dataIdx [%u]",
@@ -361,22 +494,65 @@ static void _tryLeaveMapOrArray(bjson_decodeCtx_t *ctx)
 
 static void _passNull(bjson_decodeCtx_t *ctx)
 {
-  PASS_TOKEN0(ctx, bjson_null);
+  if (ctx->batchCallback)
+  {
+    _pushEvent(ctx, bjson_decoderEvent_null, ctx->deepIdx);
+  }
+  else
+  {
+    BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_null]);
+    PASS_TOKEN0(ctx, bjson_null);
+  }
 }
 
 static void _passBoolean(bjson_decodeCtx_t *ctx, int value)
 {
-  PASS_TOKEN(ctx, bjson_boolean, value);
+  if (ctx->batchCallback)
+  {
+    _pushEvent(ctx, bjson_decoderEvent_boolean, ctx->deepIdx)->value.valueBoolean = value;
+  }
+  else
+  {
+    BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_boolean]);
+    PASS_TOKEN(ctx, bjson_boolean, value);
+  }
 }
 
 static void _passInteger(bjson_decodeCtx_t *ctx, int64_t value)
 {
-  PASS_TOKEN(ctx, bjson_integer, value);
+  if (ctx->batchCallback)
+  {
+    _pushEvent(ctx, bjson_decoderEvent_integer, ctx->deepIdx)->value.valueInteger = value;
+  }
+  else
+  {
+    BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_integer]);
+    PASS_TOKEN(ctx, bjson_integer, value);
+  }
 }
 
 static void _passDouble(bjson_decodeCtx_t *ctx, double value)
 {
-  PASS_TOKEN(ctx, bjson_double, value);
+  if (ctx->batchCallback)
+  {
+    _pushEvent(ctx, bjson_decoderEvent_double, ctx->deepIdx)->value.valueDouble = value;
+  }
+  else
+  {
+    BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_double]);
+    PASS_TOKEN(ctx, bjson_double, value);
+  }
+}
+
+static void _passSpan(bjson_decodeCtx_t *ctx,
+                      bjson_decoderEventType_t type,
+                      const void *buf,
+                      size_t bufLen)
+{
+  bjson_decoderEvent_t *event = _pushEvent(ctx, type, ctx->deepIdx);
+
+  event->value.span.buf    = buf;
+  event->value.span.bufLen = bufLen;
 }
 
 static void _passString(bjson_decodeCtx_t *ctx,
@@ -385,17 +561,41 @@ static void _passString(bjson_decodeCtx_t *ctx,
 {
   if (_isKeyTurn(ctx))
   {
-    PASS_TOKEN(ctx, bjson_map_key, buf, bufLen);
+    if (ctx->batchCallback)
+    {
+      _passSpan(ctx, bjson_decoderEvent_mapKey, buf, bufLen);
+    }
+    else
+    {
+      BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_mapKey]);
+      PASS_TOKEN(ctx, bjson_map_key, buf, bufLen);
+    }
   }
   else
   {
-    PASS_TOKEN(ctx, bjson_string, buf, bufLen);
+    if (ctx->batchCallback)
+    {
+      _passSpan(ctx, bjson_decoderEvent_string, buf, bufLen);
+    }
+    else
+    {
+      BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_string]);
+      PASS_TOKEN(ctx, bjson_string, buf, bufLen);
+    }
   }
 }
 
 static void _passBinary(bjson_decodeCtx_t *ctx, const void *buf, size_t bufLen)
 {
-  PASS_TOKEN(ctx, bjson_binary, buf, bufLen);
+  if (ctx->batchCallback)
+  {
+    _passSpan(ctx, bjson_decoderEvent_binary, buf, bufLen);
+  }
+  else
+  {
+    BJSON_STATS_INC(ctx->stats, tokens[bjson_decoderEvent_binary]);
+    PASS_TOKEN(ctx, bjson_binary, buf, bufLen);
+  }
 }
 
 /*
@@ -410,7 +610,7 @@ static void *bjson_malloc(bjson_decodeCtx_t *ctx, size_t size)
 
   if (ctx->memoryFunctions)
   {
-    rv = ctx->memoryFunctions->malloc(ctx->callerCtx, size);
+    rv = ctx->memoryFunctions->malloc(ctx->memoryCtx, size);
   }
   else
   {
@@ -424,7 +624,7 @@ static void bjson_free(bjson_decodeCtx_t *ctx, void *ptr)
 {
   if (ctx->memoryFunctions)
   {
-    ctx->memoryFunctions->free(ctx->callerCtx, ptr);
+    ctx->memoryFunctions->free(ctx->memoryCtx, ptr);
   }
   else
   {
@@ -443,7 +643,7 @@ static void *bjson_realloc(bjson_decodeCtx_t *ctx, void *ptr, size_t newSize)
 
   if (ctx->memoryFunctions)
   {
-    rv = ctx->memoryFunctions->realloc(ctx->callerCtx, ptr, newSize);
+    rv = ctx->memoryFunctions->realloc(ctx->memoryCtx, ptr, newSize);
   }
   else
   {
@@ -465,58 +665,74 @@ static void *bjson_realloc(bjson_decodeCtx_t *ctx, void *ptr, size_t newSize)
  * ----------------------------------------------------------------------------
  */
 
-static void _cacheBegin(bjson_decodeCtx_t *ctx, size_t bytesNeeded)
+/*
+ * Make sure cache buffer can hold at least <bytesNeeded> bytes.
+ * Buffer grows geometrically, but never over total number of bytes
+ * expected for current token nor over maxCacheSize limit.
+ * Caller supplied arena is used as long as it's big enough.
+ */
+
+static void _cacheReserve(bjson_decodeCtx_t *ctx, size_t bytesNeeded)
 {
-  void *newCache = NULL;
+  size_t bytesTotal  = ctx->cacheIdx + ctx->cacheBytesMissing;
+  size_t newCapacity = 0;
+  void *newCache     = NULL;
 
-  if (ctx->cache == NULL)
+  if (bytesNeeded <= ctx->cacheCapacity)
   {
     /*
-     * Cache used first time. There is no buffer allocated yet.
-     * Allocate new one.
+     * Nothing to do, reuse existing cache buffer.
      */
 
-    newCache = bjson_malloc(ctx, bytesNeeded);
+    return;
+  }
 
-    if (newCache)
-    {
-      ctx->cache         = newCache;
-      ctx->cacheCapacity = bytesNeeded;
-      BJSON_DEBUG("decoder: allocated new cache buffer with [%u] bytes", bytesNeeded);
-    }
+  if (bytesNeeded > ctx->maxCacheSize)
+  {
+    /* Error - cache would exceed limit set by caller. */
+    _setErrorState(ctx, bjson_status_error_cacheLimitExceeded);
+
+    return;
   }
-  else if (ctx->cacheCapacity < bytesNeeded)
+
+  newCapacity = MAX(ctx->cacheCapacity * 2, bytesNeeded);
+  newCapacity = MIN(newCapacity, bytesTotal);
+  newCapacity = MIN(newCapacity, ctx->maxCacheSize);
+
+  if (ctx->cache == NULL || ctx->cache == ctx->arena)
   {
     /*
-     * Cache buffer already allocated, but it's too small to handle
-     * all missing bytes.
+     * There is no heap buffer allocated yet. Allocate new one and move
+     * already fetched bytes from arena if any.
      */
 
-    newCache = bjson_realloc(ctx, ctx->cache, bytesNeeded);
+    newCache = bjson_malloc(ctx, newCapacity);
 
-    if (newCache)
+    if (newCache && ctx->cacheIdx > 0)
     {
-      ctx->cache         = newCache;
-      ctx->cacheCapacity = bytesNeeded;
-
-      BJSON_DEBUG("decoder: increased cache buffer to [%u] bytes", bytesNeeded);
+      memcpy(newCache, ctx->cache, ctx->cacheIdx);
     }
+
+    BJSON_DEBUG("decoder: allocated new cache buffer with [%u] bytes", newCapacity);
   }
   else
   {
     /*
-     * Nothing to do, reuse existing cache buffer.
+     * Heap buffer already allocated, but it's too small.
      */
 
-    newCache = ctx->cache;
-  }
+    newCache = bjson_realloc(ctx, ctx->cache, newCapacity);
 
-  ctx->cacheBytesMissing = bytesNeeded;
-  ctx->cacheIdx          = 0;
+    BJSON_DEBUG("decoder: increased cache buffer to [%u] bytes", newCapacity);
+  }
 
   if (newCache)
   {
-    BJSON_DEBUG("decoder: cache started, waiting for [%u] bytes", bytesNeeded);
+    ctx->cache         = newCache;
+    ctx->cacheCapacity = newCapacity;
+
+    BJSON_STATS_INC(ctx->stats, cacheReallocs);
+    BJSON_STATS_PEAK(ctx->stats, peakCacheCapacity, ctx->cacheCapacity);
   }
   else
   {
@@ -524,15 +740,64 @@ static void _cacheBegin(bjson_decodeCtx_t *ctx, size_t bytesNeeded)
   }
 }
 
+static void _cacheBegin(bjson_decodeCtx_t *ctx, size_t bytesNeeded)
+{
+  /*
+   * Collected events may point into the cache buffer, which is going
+   * to be overwritten. Pass them to caller first.
+   */
+
+  if (ctx->batchCallback)
+  {
+    _flushEvents(ctx);
+  }
+
+  if (bytesNeeded > ctx->maxCacheSize)
+  {
+    /*
+     * Error - token can't fit into cache. Fail before any byte is
+     * fetched, declared size may be corrupted.
+     */
+
+    _setErrorState(ctx, bjson_status_error_cacheLimitExceeded);
+
+    return;
+  }
+
+  if (ctx->cache == NULL && ctx->arena)
+  {
+    /*
+     * Cache used first time and caller supplied own arena. Use it.
+     */
+
+    ctx->cache         = ctx->arena;
+    ctx->cacheCapacity = ctx->arenaSize;
+  }
+
+  /*
+   * Buffer is not resized here. It grows while incoming bytes arrive,
+   * so corrupted size doesn't cause huge allocation up front.
+   */
+
+  ctx->cacheBytesMissing = bytesNeeded;
+  ctx->cacheIdx          = 0;
+
+  BJSON_STATS_INC(ctx->stats, cacheActivations);
+
+  BJSON_DEBUG("decoder: cache started, waiting for [%u] bytes", bytesNeeded);
+}
+
 static void _cacheFetch(bjson_decodeCtx_t *ctx,
                         uint8_t **inData,
                         size_t *inDataSize)
 {
-  if (_isOk(ctx) && ctx->cache)
+  size_t bytesToLoad = MIN(ctx->cacheBytesMissing, *inDataSize);
+
+  if (_isOk(ctx) && bytesToLoad > 0)
   {
-    size_t bytesToLoad = MIN(ctx->cacheBytesMissing, *inDataSize);
+    _cacheReserve(ctx, ctx->cacheIdx + bytesToLoad);
 
-    if (bytesToLoad > 0)
+    if (_isOk(ctx))
     {
       /* Avoid false clang-tidy warning:
        * error: Use of memory after it is freed [clang-analyzer-unix.Malloc,-warnings-as-errors]
@@ -545,6 +810,8 @@ static void _cacheFetch(bjson_decodeCtx_t *ctx,
       ctx->cacheIdx          += bytesToLoad;
       ctx->cacheBytesMissing -= bytesToLoad;
 
+      BJSON_STATS_ADD(ctx->stats, cacheBytesCopied, bytesToLoad);
+
       *inDataSize -= bytesToLoad;
       *inData     += bytesToLoad;
 
@@ -554,6 +821,47 @@ static void _cacheFetch(bjson_decodeCtx_t *ctx,
   }
 }
 
+/*
+ * Called when cached token was passed to decoder. Give back memory held
+ * by oversized token if cache grew over the watermark set by caller or
+ * over caller arena.
+ */
+
+static void _cacheEnd(bjson_decodeCtx_t *ctx)
+{
+  if (ctx->cache != ctx->arena &&
+      (ctx->arena || ctx->cacheCapacity > ctx->cacheWatermark))
+  {
+    if (ctx->arena || ctx->cacheWatermark == 0)
+    {
+      /*
+       * Drop heap buffer. Go back to arena if any.
+       */
+
+      bjson_free(ctx, ctx->cache);
+
+      ctx->cache         = ctx->arena;
+      ctx->cacheCapacity = ctx->arenaSize;
+    }
+    else
+    {
+      /*
+       * Shrink heap buffer to the watermark.
+       */
+
+      void *newCache = bjson_realloc(ctx, ctx->cache, ctx->cacheWatermark);
+
+      if (newCache)
+      {
+        ctx->cache         = newCache;
+        ctx->cacheCapacity = ctx->cacheWatermark;
+      }
+    }
+
+    BJSON_DEBUG("decoder: cache shrunk to [%u] bytes", ctx->cacheCapacity);
+  }
+}
+
 /*
  * ----------------------------------------------------------------------------
  *                                 Public API
@@ -577,6 +885,16 @@ bjson_status_t bjson_decoderParse(bjson_decodeCtx_t *ctx,
 {
   uint8_t *inData = (uint8_t *)inDataRaw;
 
+  /*
+   * Count caller bytes only. Cached bytes were already counted when
+   * passed by caller first time.
+   */
+
+  if (inDataRaw != ctx->cache)
+  {
+    BJSON_STATS_ADD(ctx->stats, bytesConsumed, inDataSize);
+  }
+
   /*
    * Try finish fetching missing bytes to complete fragmented token first.
    * This scenario occurs, when last stage could not be finished
@@ -602,6 +920,8 @@ bjson_status_t bjson_decoderParse(bjson_decodeCtx_t *ctx,
       BJSON_DEBUG("decoder: %s", "cache completed, going to restart decode");
       BJSON_DEBUG_DUMP(ctx->cache, ctx->cacheIdx);
       bjson_decoderParse(ctx, ctx->cache, ctx->cacheIdx);
+
+      _cacheEnd(ctx);
     }
   }
 
@@ -728,135 +1048,162 @@ bjson_status_t bjson_decoderParse(bjson_decodeCtx_t *ctx,
          * value (integer/float).
          */
 
-        if (inDataSize < ctx->dataTypeSize)
+        const uint8_t *sizeField = inData;
+
+        if (ctx->headerIdx > 0 || inDataSize < ctx->dataTypeSize)
         {
           /*
            * Fragmented input detected at stage II (bodySizeOrImmValue).
-           * Start fetching incoming data in the working cache and
-           * stop decode process until complete portion of data
-           * arrived.
+           * Join incoming bytes in the inline header buffer and stop
+           * decode process until whole field arrived.
            */
 
-          BJSON_DEBUG("decoder: %s", "fragmented buffer detected on stage II"
-                      " (bodySizeOrImmValue), going to start cache");
+          size_t bytesToLoad = MIN(ctx->dataTypeSize - ctx->headerIdx, inDataSize);
 
-          _cacheBegin(ctx, ctx->dataTypeSize);
-          _cacheFetch(ctx, &inData, &inDataSize);
-        }
-        else
-        {
-          /*
-           * We have all data needed to finish stage. Go on.
-           */
+          memcpy(ctx->header + ctx->headerIdx, inData, bytesToLoad);
+
+          ctx->headerIdx += bytesToLoad;
+          ctx->dataIdx   += bytesToLoad;
+          inData         += bytesToLoad;
+          inDataSize     -= bytesToLoad;
 
-          ctx->bodySizeOrImmValue.valueInteger = 0;
+          if (ctx->headerIdx < ctx->dataTypeSize)
+          {
+            BJSON_DEBUG("decoder: fragmented buffer detected on stage II"
+                        " (bodySizeOrImmValue), [%u] bytes still needed",
+                        ctx->dataTypeSize - ctx->headerIdx);
+
+            BJSON_STATS_INC(ctx->stats, headerFragments);
 
-          memcpy(&(ctx->bodySizeOrImmValue), inData, ctx->dataTypeSize);
+            break;
+          }
 
+          sizeField      = ctx->header;
+          ctx->headerIdx = 0;
+        }
+        else
+        {
           ctx->dataIdx += ctx->dataTypeSize;
           inData       += ctx->dataTypeSize;
           inDataSize   -= ctx->dataTypeSize;
+        }
 
-          switch (ctx->dataTypeBase)
-          {
-            /*
-             * Positive_integerxx (8/16/32/64).
-             */
+        /*
+         * We have all data needed to finish stage. Go on.
+         */
 
-            case BJSON_DATATYPE_POSITIVE_INTEGER_BASE:
-            {
-              BJSON_DEBUG("decoder: decoded positive integer%d [%lld]",
-                          ctx->dataTypeSize * 8,
-                          ctx->bodySizeOrImmValue.valueInteger);
+        ctx->bodySizeOrImmValue.valueInteger = 0;
 
-              _passInteger(ctx, ctx->bodySizeOrImmValue.valueInteger);
+        memcpy(&(ctx->bodySizeOrImmValue), sizeField, ctx->dataTypeSize);
 
-              ctx->stage = bjson_decodeStage_dataType;
+        switch (ctx->dataTypeBase)
+        {
+          /*
+           * Positive_integerxx (8/16/32/64).
+           */
 
-              break;
-            }
+          case BJSON_DATATYPE_POSITIVE_INTEGER_BASE:
+          {
+            BJSON_DEBUG("decoder: decoded positive integer%d [%lld]",
+                        ctx->dataTypeSize * 8,
+                        ctx->bodySizeOrImmValue.valueInteger);
 
-            /*
-             * Negative_integerxx (8/16/32/64).
-             */
+            _passInteger(ctx, ctx->bodySizeOrImmValue.valueInteger);
 
-            case BJSON_DATATYPE_NEGATIVE_INTEGER_BASE:
-            {
-              BJSON_DEBUG("decoder: decoded negative integer%d [%lld]",
-                          ctx->dataTypeSize * 8,
-                          -ctx->bodySizeOrImmValue.valueInteger);
+            ctx->stage = bjson_decodeStage_dataType;
 
-              _passInteger(ctx, -ctx->bodySizeOrImmValue.valueInteger);
+            break;
+          }
 
-              ctx->stage = bjson_decodeStage_dataType;
+          /*
+           * Negative_integerxx (8/16/32/64).
+           */
 
-              break;
-            }
+          case BJSON_DATATYPE_NEGATIVE_INTEGER_BASE:
+          {
+            BJSON_DEBUG("decoder: decoded negative integer%d [%lld]",
+                        ctx->dataTypeSize * 8,
+                        -ctx->bodySizeOrImmValue.valueInteger);
 
-            /*
-             * Floating point number.
-             */
+            _passInteger(ctx, -ctx->bodySizeOrImmValue.valueInteger);
+
+            ctx->stage = bjson_decodeStage_dataType;
+
+            break;
+          }
 
-            case BJSON_DATATYPE_FLOAT_BASE:
+          /*
+           * Floating point number.
+           */
+
+          case BJSON_DATATYPE_FLOAT_BASE:
+          {
+            switch (ctx->dataType)
             {
-              switch (ctx->dataType)
+              case BJSON_DATATYPE_FLOAT32:
               {
-                case BJSON_DATATYPE_FLOAT32:
-                {
-                  /*
-                   * Float32 (single precision number).
-                   */
+                /*
+                 * Float32 (single precision number).
+                 */
 
-                  BJSON_DEBUG("decoder: decoded float32 [%f]",
-                              ctx->bodySizeOrImmValue.valueFloat);
+                BJSON_DEBUG("decoder: decoded float32 [%f]",
+                            ctx->bodySizeOrImmValue.valueFloat);
 
-                  _passDouble(ctx, ctx->bodySizeOrImmValue.valueFloat);
+                _passDouble(ctx, ctx->bodySizeOrImmValue.valueFloat);
 
-                  break;
-                }
+                break;
+              }
 
-                case BJSON_DATATYPE_FLOAT64:
-                {
-                  /*
-                   * Float64 (double precision number)
-                   */
+              case BJSON_DATATYPE_FLOAT64:
+              {
+                /*
+                 * Float64 (double precision number)
+                 */
 
-                  BJSON_DEBUG("decoder: decoded float64 [%lf]",
-                              ctx->bodySizeOrImmValue.valueDouble);
+                BJSON_DEBUG("decoder: decoded float64 [%lf]",
+                            ctx->bodySizeOrImmValue.valueDouble);
 
-                  _passDouble(ctx, ctx->bodySizeOrImmValue.valueDouble);
+                _passDouble(ctx, ctx->bodySizeOrImmValue.valueDouble);
 
-                  break;
-                }
+                break;
               }
+            }
 
-              ctx->stage = bjson_decodeStage_dataType;
+            ctx->stage = bjson_decodeStage_dataType;
 
-              break;
-            }
+            break;
+          }
 
-            /*
-             * Stringxx (8/16/32/64).
-             */
+          /*
+           * Stringxx and binaryxx (8/16/32/64).
+           */
 
-            case BJSON_DATATYPE_STRING_BASE:
+          case BJSON_DATATYPE_STRING_BASE:
+          case BJSON_DATATYPE_BINARY_BASE:
+          {
+            if (ctx->bodySizeOrImmValue.bodySize > ctx->maxStringSize)
+            {
+              /* Error - value longer than limit set by caller. */
+              _setErrorState(ctx, bjson_status_error_valueTooLong);
+            }
+            else
             {
               ctx->stage = bjson_decodeStage_stringOrBinaryBody;
-
-              break;
             }
 
-            /*
-             * Arrayxx and mapxx.
-             */
+            break;
+          }
 
-            case BJSON_DATATYPE_ARRAY_BASE:
-            case BJSON_DATATYPE_MAP_BASE:
-            {
-              _enterMapOrArray(ctx);
+          /*
+           * Arrayxx and mapxx.
+           */
 
-              break;
-            }
+          case BJSON_DATATYPE_ARRAY_BASE:
+          case BJSON_DATATYPE_MAP_BASE:
+          {
+            _enterMapOrArray(ctx);
+
+            break;
           }
         }
 
@@ -948,6 +1295,16 @@ bjson_status_t bjson_decoderParse(bjson_decodeCtx_t *ctx,
     }
   }
 
+  /*
+   * Pass collected events to caller. Events may point into the input
+   * chunk, which is valid only until we return.
+   */
+
+  if (ctx->batchCallback)
+  {
+    _flushEvents(ctx);
+  }
+
   return ctx->statusCode;
 }
 
@@ -1047,10 +1404,192 @@ BJSON_API bjson_decodeCtx_t *bjson_decoderCreate(
   ctx->callbacks       = decoderCallbacks;
   ctx->memoryFunctions = memoryFunctions;
   ctx->callerCtx       = callerCtx;
+  ctx->memoryCtx       = callerCtx;
+
+  ctx->maxStringSize  = SIZE_MAX;
+  ctx->maxCacheSize   = SIZE_MAX;
+  ctx->cacheWatermark = SIZE_MAX;
 
   return ctx;
 }
 
+/*
+ * Set up decoder option. See bjson_decoderOption_t for list of available
+ * options and type of value expected for each one.
+ *
+ * ctx    - decoder context created by bjson_decoderCreate() before (IN),
+ * option - option to set (IN),
+ * ...    - new option value (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_decoderConfig(bjson_decodeCtx_t *ctx,
+                                             bjson_decoderOption_t option, ...)
+{
+  bjson_status_t statusCode = bjson_status_ok;
+
+  size_t newEventsCapacity = ctx->eventsCapacity;
+
+  bjson_decoderBatchCallback_t newBatchCallback = ctx->batchCallback;
+
+  va_list args;
+  va_start(args, option);
+
+  switch (option)
+  {
+    case bjson_decoderOption_batchCallback:
+    {
+      newBatchCallback = va_arg(args, bjson_decoderBatchCallback_t);
+
+      if (newEventsCapacity == 0)
+      {
+        newEventsCapacity = BJSON_DEFAULT_BATCH_SIZE;
+      }
+
+      break;
+    }
+
+    case bjson_decoderOption_batchSize:
+    {
+      newEventsCapacity = MAX(va_arg(args, size_t), 1);
+
+      break;
+    }
+
+    case bjson_decoderOption_maxStringSize:
+    {
+      ctx->maxStringSize = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_decoderOption_maxCacheSize:
+    {
+      ctx->maxCacheSize = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_decoderOption_cacheWatermark:
+    {
+      ctx->cacheWatermark = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_decoderOption_cacheArena:
+    {
+      void *arena      = va_arg(args, void *);
+      size_t arenaSize = va_arg(args, size_t);
+
+      if (ctx->cacheIdx > 0 || ctx->cacheBytesMissing > 0)
+      {
+        /* Error - can't swap cache in the middle of fragmented token. */
+        statusCode = bjson_status_error_cacheInUse;
+      }
+      else
+      {
+        if (ctx->cache && ctx->cache != ctx->arena)
+        {
+          bjson_free(ctx, ctx->cache);
+        }
+
+        ctx->arena         = arena;
+        ctx->arenaSize     = arena ? arenaSize : 0;
+        ctx->cache         = ctx->arena;
+        ctx->cacheCapacity = ctx->arenaSize;
+      }
+
+      break;
+    }
+
+    default:
+    {
+      statusCode = bjson_status_error_unknownOption;
+    }
+  }
+
+  va_end(args);
+
+  /*
+   * Resize event buffer if needed.
+   */
+
+  if (newEventsCapacity != ctx->eventsCapacity)
+  {
+    void *newEvents = bjson_realloc(ctx, ctx->events,
+                                    newEventsCapacity * sizeof(bjson_decoderEvent_t));
+
+    if (newEvents)
+    {
+      ctx->events         = newEvents;
+      ctx->eventsCapacity = newEventsCapacity;
+      ctx->numEvents      = MIN(ctx->numEvents, newEventsCapacity);
+    }
+    else
+    {
+      statusCode = bjson_status_error_outOfMemory;
+    }
+  }
+
+  /*
+   * Switch to batched events only if event buffer is there. Otherwise
+   * tokens are still passed to ordinary callbacks.
+   */
+
+  if (statusCode == bjson_status_ok)
+  {
+    ctx->batchCallback = newBatchCallback;
+  }
+
+  return statusCode;
+}
+
+/*
+ * Reset decoder context to the initial state, so it can be reused to
+ * decode next, independent BJSON document. Internal cache buffer is kept
+ * to avoid extra allocations.
+ *
+ * ctx - decoder context created by bjson_decoderCreate() before (IN).
+ */
+
+BJSON_API void bjson_decoderReset(bjson_decodeCtx_t *ctx)
+{
+  ctx->statusCode = bjson_status_ok;
+  ctx->stage      = bjson_decodeStage_dataType;
+
+  ctx->dataIdx      = 0;
+  ctx->dataType     = 0;
+  ctx->dataTypeBase = 0;
+  ctx->dataTypeSize = 0;
+
+  ctx->bodySizeOrImmValue.valueInteger = 0;
+
+  ctx->deepIdx = 0;
+
+  ctx->cacheIdx          = 0;
+  ctx->cacheBytesMissing = 0;
+
+  ctx->headerIdx = 0;
+
+  ctx->numEvents = 0;
+}
+
+/*
+ * Change caller context passed to decoder callbacks. Memory functions
+ * still get the context passed to bjson_decoderCreate().
+ *
+ * ctx       - decoder context created by bjson_decoderCreate() before (IN),
+ * callerCtx - new caller specified context passed to decoder callbacks (IN).
+ */
+
+BJSON_API void bjson_decoderSetCallerCtx(bjson_decodeCtx_t *ctx, void *callerCtx)
+{
+  ctx->callerCtx = callerCtx;
+}
+
 /*
  * Free decoder context.
  *
@@ -1061,15 +1600,43 @@ BJSON_API void bjson_decoderDestroy(bjson_decodeCtx_t *ctx)
 {
   if (ctx)
   {
-    if (ctx->cache)
+    if (ctx->cache && ctx->cache != ctx->arena)
     {
       bjson_free(ctx, ctx->cache);
     }
 
+    if (ctx->events)
+    {
+      bjson_free(ctx, ctx->events);
+    }
+
     free(ctx);
   }
 }
 
+/*
+ * Retrieve statistics collected by decoder since context was created.
+ *
+ * ctx   - decoder context created by bjson_decoderCreate() before (IN),
+ * stats - structure to receive collected statistics (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_notImplemented if library was built without
+ *          statistics support.
+ */
+
+BJSON_API bjson_status_t bjson_decoderGetStats(bjson_decodeCtx_t *ctx,
+                                               bjson_decoderStats_t *stats)
+{
+  *stats = ctx->stats;
+
+#if BJSON_STATS_ENABLED > 0
+  return bjson_status_ok;
+#else
+  return bjson_status_error_notImplemented;
+#endif
+}
+
 /*
  * Create human readable error message coresponding to current decoder
  * state.
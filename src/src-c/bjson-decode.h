@@ -68,6 +68,166 @@ bjson_decoderCallbacks_t;
 
 typedef struct bjson_decodeCtx bjson_decodeCtx_t;
 
+/*
+ * Batched delivery of decoded tokens.
+ * Decoder may collect decoded tokens into event buffer and pass many
+ * of them to one bjson_batch callback instead of calling one callback
+ * per token (see bjson_decoderOption_batchCallback).
+ */
+
+typedef enum
+{
+  bjson_decoderEvent_null,
+  bjson_decoderEvent_boolean,
+  bjson_decoderEvent_integer,
+  bjson_decoderEvent_double,
+  bjson_decoderEvent_string,
+  bjson_decoderEvent_mapKey,
+  bjson_decoderEvent_binary,
+  bjson_decoderEvent_startMap,
+  bjson_decoderEvent_endMap,
+  bjson_decoderEvent_startArray,
+  bjson_decoderEvent_endArray,
+
+  /* Number of event types. Keep it at the end. */
+  bjson_decoderEvent_count
+}
+bjson_decoderEventType_t;
+
+typedef struct
+{
+  /* Token type. */
+  bjson_decoderEventType_t type;
+
+  /* Nesting level of the token. Root value is at depth 0. */
+  int depth;
+
+  /*
+   * Token value if any. Span points to decoder input or internal cache
+   * and is valid only inside bjson_batch callback.
+   */
+
+  union
+  {
+    int     valueBoolean;
+    int64_t valueInteger;
+    double  valueDouble;
+
+    struct
+    {
+      const void *buf;
+      size_t bufLen;
+    }
+    span;
+  }
+  value;
+}
+bjson_decoderEvent_t;
+
+typedef bjson_decoderCallbackResult_t (*bjson_decoderBatchCallback_t)(
+                                          void *ctx,
+                                          const bjson_decoderEvent_t *events,
+                                          size_t numEvents);
+
+/*
+ * Decoder statistics collected since context was created
+ * (see bjson_decoderGetStats()).
+ */
+
+typedef struct
+{
+  /* Number of decoded tokens, indexed by bjson_decoderEventType_t. */
+  uint64_t tokens[bjson_decoderEvent_count];
+
+  /* Number of input bytes passed to bjson_decoderParse(). */
+  uint64_t bytesConsumed;
+
+  /* Number of tokens fragmented over chunks and joined in internal cache. */
+  uint64_t cacheActivations;
+
+  /* Number of bytes copied into internal cache. */
+  uint64_t cacheBytesCopied;
+
+  /* Number of internal cache (re)allocations. */
+  uint64_t cacheReallocs;
+
+  /* Number of size/value fields fragmented over chunks (no cache used). */
+  uint64_t headerFragments;
+
+  /* The biggest internal cache capacity in bytes. */
+  size_t peakCacheCapacity;
+
+  /* The deepest containers nesting level reached. */
+  int maxDepth;
+
+  /* Number of caller callbacks invoked (including bjson_batch ones). */
+  uint64_t callbacksInvoked;
+}
+bjson_decoderStats_t;
+
+/*
+ * Options to tune decoder behavior (see bjson_decoderConfig()).
+ */
+
+typedef enum
+{
+  /*
+   * bjson_decoderBatchCallback_t, default NULL.
+   * If set, decoded tokens are collected into event buffer and passed
+   * to this callback instead of per-token callbacks. Buffer is flushed
+   * when full and always at the end of each bjson_decoderParse() call.
+   */
+
+  bjson_decoderOption_batchCallback,
+
+  /*
+   * size_t, default BJSON_DEFAULT_BATCH_SIZE.
+   * Maximum number of events passed in one bjson_batch callback.
+   */
+
+  bjson_decoderOption_batchSize,
+
+  /*
+   * size_t, default SIZE_MAX (no limit).
+   * Maximum size of string or binary value in bytes. Longer values are
+   * rejected with bjson_status_error_valueTooLong as soon as their size
+   * is decoded.
+   */
+
+  bjson_decoderOption_maxStringSize,
+
+  /*
+   * size_t, default SIZE_MAX (no limit).
+   * Maximum size of internal cache used to join tokens fragmented over
+   * many chunks. Bigger tokens are rejected with
+   * bjson_status_error_cacheLimitExceeded before any byte is cached.
+   */
+
+  bjson_decoderOption_maxCacheSize,
+
+  /*
+   * size_t, default SIZE_MAX (never shrink).
+   * If internal cache grew over this size to hold oversized token, then
+   * it's shrunk back to this size as soon as the token is decoded.
+   * Not used with bjson_decoderOption_cacheArena.
+   */
+
+  bjson_decoderOption_cacheWatermark,
+
+  /*
+   * void *arena, size_t arenaSize, default NULL (use heap only).
+   * Caller owned buffer used as internal cache. Heap is used only for
+   * tokens bigger than arena and it's freed as soon as such token is
+   * decoded. Arena *MUST* be valid until decoder is destroyed or another
+   * arena is set.
+   */
+
+  bjson_decoderOption_cacheArena
+}
+bjson_decoderOption_t;
+
+#define BJSON_DEFAULT_BATCH_SIZE 64
+
 
 /*
  * Functions to create/destroy decoder context.
@@ -103,6 +263,33 @@ BJSON_API bjson_decodeCtx_t *
 BJSON_API void
   bjson_decoderDestroy(bjson_decodeCtx_t *ctx);
 
+/*
+ * Functions to reuse the same decoder context over many BJSON documents.
+ *
+ * TIP#1: Use bjson_decoderReset() before passing first chunk of the next
+ *        document. Internal cache buffer is kept.
+ *
+ * TIP#2: Use bjson_decoderSetCallerCtx() to change context passed to
+ *        decoder callbacks e.g. per document.
+ */
+
+BJSON_API void
+  bjson_decoderReset(bjson_decodeCtx_t *ctx);
+
+BJSON_API void
+  bjson_decoderSetCallerCtx(bjson_decodeCtx_t *ctx, void *callerCtx);
+
+/*
+ * Function to set up decoder options. Use it before passing first chunk.
+ *
+ * Example:
+ *   bjson_decoderConfig(ctx, bjson_decoderOption_batchCallback, myBatchCallback);
+ *   bjson_decoderConfig(ctx, bjson_decoderOption_batchSize, (size_t) 256);
+ */
+
+BJSON_API bjson_status_t
+  bjson_decoderConfig(bjson_decodeCtx_t *ctx, bjson_decoderOption_t option, ...);
+
 /*
  * Functions to parse bjson stream chunk-by-chunk.
  *
@@ -119,6 +306,15 @@ bjson_decoderParse(bjson_decodeCtx_t *ctx,
 BJSON_API bjson_status_t
   bjson_decoderComplete(bjson_decodeCtx_t *ctx);
 
+/*
+ * Statistics useful to diagnose performance e.g. to tell if input
+ * stream is too fragmented. Compiled in unless library was built with
+ * BJSON_STATS_ENABLED set to 0.
+ */
+
+BJSON_API bjson_status_t
+  bjson_decoderGetStats(bjson_decodeCtx_t *ctx, bjson_decoderStats_t *stats);
+
 /*
  * Error handling.
  *
@@ -20,39 +20,298 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * Spilled output buffer needs POSIX ftruncate() and mkstemp(), which are
+ * hidden by strict -std=c99/c11 modes without feature test macro.
+ */
+
+#if !defined(_WIN32) && !defined(WIN32) && !defined(_POSIX_C_SOURCE)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "bjson-encode.h"
 #include "bjson-common.h"
 #include "bjson-constants.h"
 #include "bjson-debug.h"
 
+#include <math.h>
+#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * Spilled output buffer is memory mapped temporary file
+ * (see bjson_encoderCreateSpill()). Available on POSIX systems only.
+ */
+
+#if defined(_WIN32) || defined(WIN32)
+# define BJSON_SPILL_SUPPORTED 0
+#else
+# define BJSON_SPILL_SUPPORTED 1
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+
 #define MIN(a, b) (((a) < (b)) ? (a) : (b))
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
 #define MAX_VALUE_UINT8  0xff
-#define MAX_VALUE_UINT16 0xffff
-#define MAX_VALUE_UINT32 0xffffffff
+
+/*
+ * Count leading zero bits in 64-bit value. Value must be non zero.
+ */
+
+#if defined(__GNUC__)
+# define BJSON_CLZ64(x) __builtin_clzll(x)
+#else
+# define BJSON_CLZ64(x) _clz64(x)
+
+static int _clz64(uint64_t x)
+{
+  int rv = 0;
+
+  while ((x & (1ULL << 63)) == 0)
+  {
+    x <<= 1;
+    rv++;
+  }
+
+  return rv;
+}
+#endif
+
+/*
+ * Header and value can be written with one 64-bit store on little endian
+ * hosts only.
+ */
+
+#if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__)
+# define BJSON_LITTLE_ENDIAN (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+#elif defined(_M_IX86) || defined(_M_X64) || defined(_M_ARM64)
+# define BJSON_LITTLE_ENDIAN 1
+#else
+# define BJSON_LITTLE_ENDIAN 0
+#endif
 
 #define BJSON_DEFAULT_ARRAY_HEADER_SIZE (sizeof(uint32_t) + 1)
 
+/*
+ * Bodies up to this size are moved right after container is closed if
+ * there are no gaps inside. It's cheaper than tracking the gap for small
+ * containers and total bytes moved is still linear.
+ */
+
+#define BJSON_INLINE_COMPACT_LIMIT 256
+
+/*
+ * Minimal capacity of spilled output buffer. File is mapped once again
+ * each time it grows.
+ */
+
+#define BJSON_SPILL_MIN_GROW (1024 * 1024)
+
+/*
+ * Minimal output buffer growth in percent of its capacity. Lower growth
+ * would make reallocs nearly linear and copying quadratic.
+ */
+
+#define BJSON_MIN_GROWTH_PERCENT 25
+
+/*
+ * Initial number of entries on block stack. Stack grows with nesting
+ * depth of encoded document.
+ */
+
+#define BJSON_DEFAULT_BLOCKS_CAPACITY 16
+
 /*
  * ----------------------------------------------------------------------------
  *                        Private structs and typedefs
  * ----------------------------------------------------------------------------
  */
 
+/*
+ * Unused part of container header placeholder. Gaps are left in outData
+ * when container is closed and removed later in one pass.
+ */
+
+typedef struct
+{
+  /* Offset of container header placeholder in outData. */
+  size_t headerIdx;
+
+  /* Number of unused placeholder bytes right after real header. */
+  size_t gapSize;
+
+  /*
+   * Header with QWORD size field doesn't fit into placeholder. Its first
+   * bytes are in placeholder, the rest is kept here and put right after
+   * placeholder, when output is written out.
+   */
+
+  uint8_t isWide;
+  uint8_t wideTail[1 + sizeof(uint64_t) - BJSON_DEFAULT_ARRAY_HEADER_SIZE];
+}
+bjson_encodeGap_t;
+
+/*
+ * Payload referenced in place instead of being copied into outData
+ * (see bjson_encoderOption_referenceThreshold). It belongs right before
+ * outData[outIdx].
+ */
+
+typedef struct
+{
+  size_t outIdx;
+
+  const void *buf;
+  size_t bufLen;
+}
+bjson_encodeRef_t;
+
+/*
+ * State of one open block i.e. map, array or string/binary streamed
+ * piece by piece (see bjson_encodeStringBegin()). Entry 0 is root level.
+ */
+
+typedef struct
+{
+  /* Data type base of the block e.g. BJSON_DATATYPE_MAP_BASE. */
+  uint8_t dataTypeBase;
+
+  /* Map only: set if key was written and value is expected now. */
+  uint8_t mapTurn;
+
+  /*
+   * Block open with known body size. Header is already written and idx
+   * points to the body. Size is verified when closed.
+   */
+
+  uint8_t isSized;
+  size_t bodySize;
+
+  /* Offset of header placeholder (unsized) or body (sized, measured). */
+  size_t idx;
+
+  /*
+   * Gap entry of header placeholder and number of gap bytes inside
+   * body, so final (compacted) body size is known without moving any
+   * data.
+   */
+
+  size_t gapIdx;
+  size_t slack;
+
+  /* Measure pass only: slot in measuredSizes[] for body size. */
+  size_t measuredIdx;
+
+  /*
+   * First payload referenced in place inside body and number of
+   * referenced bytes, they're a part of body size, but not of outData.
+   */
+
+  size_t refIdx;
+  size_t refBytes;
+}
+bjson_encodeBlock_t;
+
+/*
+ * Encoder modes. Measure and write modes are two passes over the same
+ * sequence of bjson_encodeXxx() calls.
+ */
+
+typedef enum
+{
+  /* Write tokens, fix up container headers when closed. */
+  bjson_encodeMode_default,
+
+  /* Don't write anything, only measure container and total sizes. */
+  bjson_encodeMode_measure,
+
+  /* Write tokens with container sizes known from measure pass. */
+  bjson_encodeMode_write
+}
+bjson_encodeMode_t;
+
+/*
+ * The way double value is written (see bjson_encoderOption_compactNumbers).
+ */
+
+typedef enum
+{
+  bjson_encodeDoubleForm_float64,
+  bjson_encodeDoubleForm_float32,
+  bjson_encodeDoubleForm_integer
+}
+bjson_encodeDoubleForm_t;
+
 typedef struct bjson_encodeCtx
 {
   bjson_status_t statusCode;
 
+  bjson_encodeMode_t mode;
+
   uint8_t *outData;
   size_t outDataIdx;
   size_t outDataCapacity;
 
+  /*
+   * Output buffer owned by caller (see bjson_encoderCreateStatic()).
+   * It's never reallocated. When it's full, encoder goes on counting
+   * bytes only, so caller knows how big buffer is needed.
+   */
+
+  int isStaticBuffer;
+  size_t bytesNeeded;
+
+  /*
+   * Output buffer is memory mapped temporary file, so it's bounded by
+   * disk space, not RAM (see bjson_encoderCreateSpill()).
+   */
+
+  int isSpilled;
+  int spillFd;
+
+  /*
+   * Output buffer is kept over bjson_encoderClear() calls, but shrunk
+   * to this size if it grew bigger.
+   */
+
+  size_t trimCapacity;
+
+  /*
+   * Output buffer growth policy. The first allocation is at least
+   * initialCapacity bytes, then buffer grows by growthPercent of its
+   * capacity. See bjson_encoderOption_initialCapacity and
+   * bjson_encoderOption_growthPercent.
+   */
+
+  size_t initialCapacity;
+  size_t growthPercent;
+
+  /*
+   * Write doubles using the smallest exact form (integer or float32).
+   * See bjson_encoderOption_compactNumbers.
+   */
+
+  int compactNumbers;
+
+  /*
+   * Check structure of pre-encoded values passed to bjson_encodeRaw().
+   * See bjson_encoderOption_validateRaw.
+   */
+
+  int validateRaw;
+
+  /*
+   * Strings and binaries of at least this size are not copied, but
+   * referenced in place. See bjson_encoderOption_referenceThreshold.
+   */
+
+  size_t referenceThreshold;
+
   /*
    * User defined functions used as replacement for standard
    * malloc/realloc/free. These callbacks are options. If NULL
@@ -64,15 +323,187 @@ typedef struct bjson_encodeCtx
   bjson_memoryFunctions_t *memoryFunctions;
 
   /*
-   * Track nested arrays/maps state.
+   * Track nested arrays/maps state. Besides maps and arrays, string or
+   * binary value streamed piece by piece is open as a block too, so its
+   * header is patched the same way as container's one. Stack grows with
+   * nesting depth, blocks[deepIdx] is the innermost open block. Streamed
+   * value is not a container and can take one slot above BJSON_MAX_DEPTH.
    */
 
   int deepIdx;
-  size_t blockIdx[BJSON_MAX_DEPTH + 1];
-  uint8_t blockIsMap[BJSON_MAX_DEPTH + 1];
-  uint8_t blockMapTurn[BJSON_MAX_DEPTH + 1];
+
+  bjson_encodeBlock_t *blocks;
+  int blocksCapacity;
+
+  /*
+   * Header gaps left by closed containers. Entry is added when container
+   * is open, so gaps[] is always sorted by offset.
+   */
+
+  bjson_encodeGap_t *gaps;
+  size_t numGaps;
+  size_t gapsCapacity;
+
+  /*
+   * Container body sizes collected in measure pass (in open order) and
+   * consumed in write pass.
+   */
+
+  size_t *measuredSizes;
+  size_t numMeasured;
+  size_t measuredCapacity;
+  size_t nextMeasuredIdx;
+  size_t measuredTotal;
+
+  /*
+   * Container body sizes of template being rendered
+   * (see bjson_templateRender()).
+   */
+
+  size_t *templateSizes;
+  size_t templateSizesCapacity;
+
+  /*
+   * Payloads referenced in place, sorted by offset.
+   */
+
+  bjson_encodeRef_t *refs;
+  size_t numRefs;
+  size_t refsCapacity;
+  size_t refBytes;
+
+  /*
+   * Output pieces returned by bjson_encoderGetChunks().
+   */
+
+  bjson_encoderChunk_t *chunks;
+  size_t chunksCapacity;
+
+  /*
+   * Caller sink receiving each root document as soon as it's complete.
+   * See bjson_encoderSetSink().
+   */
+
+  bjson_encoderSink_t sink;
+  void *sinkCtx;
+
+  /*
+   * Bumped each time data before current position may be moved or
+   * dropped e.g. compacted or flushed. Savepoints taken before are
+   * no longer valid (see bjson_encoderSavepoint()).
+   */
+
+  size_t savepointEpoch;
+
+  /*
+   * Statistics (see bjson_encoderGetStats()). bytesWritten counts only
+   * output already gone i.e. passed to sink, detached or cleared.
+   */
+
+  bjson_encoderStats_t stats;
 } bjson_encodeCtx_t;
 
+/*
+ * Map key encoded once. Data contains complete string token i.e. data
+ * type, size field and utf8 bytes.
+ */
+
+struct bjson_preparedKey
+{
+  /* Allocator used for this key, also used to free it. */
+  bjson_memoryFunctions_t *memoryFunctions;
+  void *callerCtx;
+
+  size_t size;
+
+  uint8_t data[];
+};
+
+/*
+ * Template operations. Constant bytes of all const ops are stored one
+ * after another in constData, so op keeps only their number. Slot
+ * values and body sizes of open ops are consumed in order too.
+ */
+
+typedef enum
+{
+  bjson_templateOp_const,
+  bjson_templateOp_slot,
+  bjson_templateOp_open,
+  bjson_templateOp_close
+}
+bjson_templateOpCode_t;
+
+typedef struct
+{
+  uint8_t code;
+
+  /* Slot type for slot op, data type base for open op. */
+  uint8_t arg;
+
+  /* Open op only: body size is known at compile time. */
+  uint8_t isFixed;
+
+  /* Number of constant bytes or known body size for open op. */
+  size_t size;
+}
+bjson_templateOp_t;
+
+/*
+ * Recording state of one open container. Entry 0 is root level.
+ */
+
+typedef struct
+{
+  uint8_t isMap;
+
+  /* Map only: set if key is expected now. */
+  uint8_t mapTurn;
+}
+bjson_templateBlock_t;
+
+struct bjson_template
+{
+  /* Custom malloc/free/realloc used for all template memory. */
+  bjson_memoryFunctions_t *memoryFunctions;
+  void *callerCtx;
+
+  bjson_status_t statusCode;
+
+  int isCompiled;
+
+  bjson_templateOp_t *ops;
+  size_t numOps;
+  size_t opsCapacity;
+
+  uint8_t *constData;
+  size_t constSize;
+  size_t constCapacity;
+
+  /*
+   * Filled by bjson_templateCompile(). Containers with fixed body size
+   * are turned into constant bytes, only the rest is sized at render.
+   */
+
+  size_t numSlots;
+  size_t numOpens;
+  int maxOpenDepth;
+
+  int isFixed;
+  size_t fixedSize;
+
+  /*
+   * Shape being recorded.
+   */
+
+  int hasRoot;
+  int deepIdx;
+  int maxDepth;
+
+  bjson_templateBlock_t *blocks;
+  int blocksCapacity;
+};
+
 /*
  * ----------------------------------------------------------------------------
  *                    Support for user defined memory functions
@@ -145,787 +576,5100 @@ static int _isOk(bjson_encodeCtx_t *ctx)
   return (ctx->statusCode == bjson_status_ok);
 }
 
+/*
+ * Full static buffer is not fatal. Encoder goes on and counts bytes
+ * needed to finish the document.
+ */
+
+static int _canGoOn(bjson_encodeCtx_t *ctx)
+{
+  return (ctx->statusCode == bjson_status_ok ||
+          ctx->statusCode == bjson_status_error_bufferFull);
+}
+
+static int _isCountingOnly(bjson_encodeCtx_t *ctx)
+{
+  return (ctx->mode == bjson_encodeMode_measure ||
+          ctx->statusCode == bjson_status_error_bufferFull);
+}
+
 static int _isKeyTurn(bjson_encodeCtx_t *ctx)
 {
-  return ((ctx->deepIdx > 0) && (ctx->blockMapTurn[ctx->deepIdx]));
+  return ((ctx->deepIdx > 0) && (ctx->blocks[ctx->deepIdx].mapTurn));
+}
+
+static int _isMapOpen(bjson_encodeCtx_t *ctx)
+{
+  return ctx->blocks[ctx->deepIdx].dataTypeBase == BJSON_DATATYPE_MAP_BASE;
 }
 
 static void _rotateMapTurn(bjson_encodeCtx_t *ctx)
 {
-  if ((ctx->deepIdx > 0) && (ctx->blockIsMap[ctx->deepIdx]))
+  if ((ctx->deepIdx > 0) && _isMapOpen(ctx))
   {
-    ctx->blockMapTurn[ctx->deepIdx] = !ctx->blockMapTurn[ctx->deepIdx];
+    ctx->blocks[ctx->deepIdx].mapTurn = !ctx->blocks[ctx->deepIdx].mapTurn;
   }
 }
 
+/*
+ * Streamed string or binary value is open as a block on top of the
+ * stack (see bjson_encodeStringBegin()). Nothing else can be encoded
+ * until it's ended.
+ */
+
+static int _isStreamOpen(bjson_encodeCtx_t *ctx)
+{
+  return (ctx->deepIdx > 0 &&
+          (ctx->blocks[ctx->deepIdx].dataTypeBase == BJSON_DATATYPE_STRING_BASE ||
+           ctx->blocks[ctx->deepIdx].dataTypeBase == BJSON_DATATYPE_BINARY_BASE));
+}
+
 static void _setErrorStateIfKeyTurn(bjson_encodeCtx_t *ctx)
 {
-  if (_isOk(ctx))
+  if (_canGoOn(ctx))
   {
-    if (_isKeyTurn(ctx))
+    if (_isStreamOpen(ctx))
+    {
+      _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+    }
+    else if (_isKeyTurn(ctx))
     {
       _setErrorState(ctx, bjson_status_error_invalidObjectKey);
     }
   }
 }
 
-static void _prepareOutDataBuffer(bjson_encodeCtx_t *ctx,
-                                  size_t numberOfExtraBytesNeeded)
+/*
+ * Count pushed tokens. Measure pass is not counted, so two-pass encoder
+ * reports the same numbers as one-pass one.
+ */
+
+static void _countTokens(bjson_encodeCtx_t *ctx, uint64_t *counter, size_t n)
 {
-  if (_isOk(ctx) && ctx->outDataCapacity - ctx->outDataIdx < numberOfExtraBytesNeeded)
+#if BJSON_STATS_ENABLED > 0
+  if (ctx->mode != bjson_encodeMode_measure)
   {
-    /*
-     * Not enough space - resize buffer.
-     */
+    *counter += n;
+  }
+#else
+  (void)ctx;
+  (void)counter;
+  (void)n;
+#endif
+}
 
-    size_t newCapacity = MAX(ctx->outDataCapacity * 2,
-                             ctx->outDataCapacity + numberOfExtraBytesNeeded);
+/*
+ * Resize output buffer to given capacity. Spilled buffer is a file
+ * mapping, so file is resized and mapped once again. Data is kept in
+ * the file meanwhile. Old mapping is dropped only when new one is
+ * there, so encoded data is still at hand if remap failed.
+ */
 
-    ctx->outData         = bjson_realloc(ctx, ctx->outData, newCapacity);
-    ctx->outDataCapacity = newCapacity;
+static void _resizeOutData(bjson_encodeCtx_t *ctx, size_t newCapacity)
+{
+  uint8_t *newOutData = NULL;
+
+  if (ctx->isSpilled)
+  {
+    #if BJSON_SPILL_SUPPORTED
+    void *newMap = MAP_FAILED;
 
-    if (ctx->outData)
+    if (ftruncate(ctx->spillFd, (off_t) newCapacity) == 0)
     {
-      BJSON_DEBUG2("encoder: resized outData buffer to [%d] bytes", newCapacity);
+      newMap = mmap(NULL, newCapacity, PROT_READ | PROT_WRITE,
+                    MAP_SHARED, ctx->spillFd, 0);
+
+      if (newMap == MAP_FAILED && ctx->outData)
+      {
+        /* Keep file as big as old mapping. */
+        if (ftruncate(ctx->spillFd, (off_t) ctx->outDataCapacity) != 0)
+        {
+          BJSON_DEBUG("encoder: can't restore spill file size [%d]", ctx->spillFd);
+        }
+      }
     }
-    else
+
+    if (newMap != MAP_FAILED)
     {
-      _setErrorState(ctx, bjson_status_error_outOfMemory);
+      if (ctx->outData)
+      {
+        munmap(ctx->outData, ctx->outDataCapacity);
+      }
+
+      newOutData = newMap;
     }
+    #endif
   }
-}
-
-static void _putRaw_BLOB(bjson_encodeCtx_t *ctx,
-                         const void *buf, size_t bufSize)
-{
-  _prepareOutDataBuffer(ctx, bufSize);
-
-  if (_isOk(ctx))
+  else
   {
-    memcpy(ctx->outData + ctx->outDataIdx, buf, bufSize);
+    newOutData = bjson_realloc(ctx, ctx->outData, newCapacity);
+  }
 
-    ctx->outDataIdx += bufSize;
-  }
-}
+  if (newOutData)
+  {
+    /*
+     * Count copied bytes only if realloc had to move the buffer.
+     * Remapped spill file is never copied.
+     */
 
-static void _putRaw_BYTE(bjson_encodeCtx_t *ctx, uint8_t value)
-{
-  BJSON_DEBUG3("encoder: going to put byte [%d] at offset [%d]",
-               value, ctx->outDataIdx);
+    BJSON_STATS_INC(ctx->stats, numReallocs);
+
+    if (!ctx->isSpilled && ctx->outData != newOutData)
+    {
+      BJSON_STATS_ADD(ctx->stats, reallocBytesCopied, MIN(ctx->outDataIdx, newCapacity));
+    }
 
-  _prepareOutDataBuffer(ctx, 1);
+    ctx->outData         = newOutData;
+    ctx->outDataCapacity = newCapacity;
 
-  if (_isOk(ctx))
+    BJSON_DEBUG2("encoder: resized outData buffer to [%d] bytes", newCapacity);
+  }
+  else
   {
-    ctx->outData[ctx->outDataIdx] = value;
-    ctx->outDataIdx++;
+    _setErrorState(ctx, bjson_status_error_outOfMemory);
   }
 }
 
-static void _putRaw_WORD(bjson_encodeCtx_t *ctx, uint16_t value)
+static void _prepareOutDataBuffer(bjson_encodeCtx_t *ctx,
+                                  size_t numberOfExtraBytesNeeded)
 {
-  BJSON_DEBUG3("encoder: going to put word [%d] at offset [%d]",
-               value, ctx->outDataIdx);
+  size_t capacity    = ctx->outDataCapacity;
+  size_t growth      = 0;
+  size_t newCapacity = 0;
 
-  _putRaw_BLOB(ctx, &value, sizeof(value));
-}
+  if (_isOk(ctx) && ctx->outDataCapacity - ctx->outDataIdx < numberOfExtraBytesNeeded)
+  {
+    if (ctx->isStaticBuffer)
+    {
+      /*
+       * Not enough space in caller buffer. Don't realloc it, but
+       * count bytes needed from now.
+       */
 
-static void _putRaw_DWORD(bjson_encodeCtx_t *ctx, uint32_t value)
-{
-  BJSON_DEBUG3("encoder: going to put dword [%d] at offset [%d]",
-               value, ctx->outDataIdx);
+      _setErrorState(ctx, bjson_status_error_bufferFull);
 
-  _putRaw_BLOB(ctx, &value, sizeof(value));
-}
+      return;
+    }
 
-static void _putRaw_QWORD(bjson_encodeCtx_t *ctx, uint64_t value)
-{
-  BJSON_DEBUG3("encoder: going to put qword [%d] at offset [%d]",
-               value, ctx->outDataIdx);
+    /*
+     * Not enough space - resize buffer.
+     */
+
+    growth = capacity / 100 * ctx->growthPercent
+           + capacity % 100 * ctx->growthPercent / 100;
+
+    newCapacity = MAX(capacity + growth, capacity + numberOfExtraBytesNeeded);
+    newCapacity = MAX(newCapacity, ctx->initialCapacity);
+
+    if (ctx->isSpilled)
+    {
+      /* Don't remap file for every few bytes. */
+      newCapacity = MAX(newCapacity, BJSON_SPILL_MIN_GROW);
+    }
 
-  _putRaw_BLOB(ctx, &value, sizeof(value));
+    _resizeOutData(ctx, newCapacity);
+  }
 }
 
-static void _putRaw_FLOAT64(bjson_encodeCtx_t *ctx, double value)
+/*
+ * Get pointer to write next size bytes at. Buffer is grown if needed.
+ * Returns NULL if nothing should be written i.e. we're only counting
+ * bytes (measure pass or full static buffer) or error occured.
+ */
+
+static uint8_t *_reserveOutData(bjson_encodeCtx_t *ctx, size_t size)
 {
-  BJSON_DEBUG3("encoder: going to put float64 [%lf] at offset [%d]",
-               value, ctx->outDataIdx);
+  if (_isCountingOnly(ctx))
+  {
+    return NULL;
+  }
 
-  _putRaw_BLOB(ctx, &value, sizeof(value));
+  if (ctx->outDataCapacity - ctx->outDataIdx < size)
+  {
+    _prepareOutDataBuffer(ctx, size);
+
+    if (!_isOk(ctx))
+    {
+      return NULL;
+    }
+  }
+
+  return ctx->outData + ctx->outDataIdx;
 }
 
-static void _encodeSizedDataType(bjson_encodeCtx_t *ctx,
-                                 uint8_t dataTypeBase, uint64_t size)
-{
-  BJSON_DEBUG3("encoder: going to encode sized data type base [%d], size [%d]",
-               dataTypeBase, size);
+/*
+ * Account bytes, which were not written, because _reserveOutData()
+ * returned NULL.
+ */
 
-  if (size < 0)
+static void _countOutData(bjson_encodeCtx_t *ctx, size_t size)
+{
+  if (_isCountingOnly(ctx))
   {
-    _setErrorState(ctx, bjson_status_error_negativeSize);
+    ctx->outDataIdx += size;
+    ctx->bytesNeeded = MAX(ctx->bytesNeeded, ctx->outDataIdx);
   }
-  else if (size <= MAX_VALUE_UINT8)
+}
+
+static void _putRaw_BLOB(bjson_encodeCtx_t *ctx,
+                         const void *buf, size_t bufSize)
+{
+  uint8_t *out = _reserveOutData(ctx, bufSize);
+
+  if (out)
   {
-    /*
-     * Compact to single byte (uint8).
-     */
+    memcpy(out, buf, bufSize);
 
-    _putRaw_BYTE(ctx, dataTypeBase | BJSON_DATASIZE_BYTE);
-    _putRaw_BYTE(ctx, size);
+    ctx->outDataIdx += bufSize;
   }
-  else if (size <= MAX_VALUE_UINT16)
+  else
   {
-    /*
-     * Compact to single word (uint16).
-     */
-
-    _putRaw_BYTE(ctx, dataTypeBase | BJSON_DATASIZE_WORD);
-    _putRaw_WORD(ctx, size);
+    _countOutData(ctx, bufSize);
   }
-  else if (size <= MAX_VALUE_UINT32)
+}
+
+static void _putRaw_BYTE(bjson_encodeCtx_t *ctx, uint8_t value)
+{
+  uint8_t *out = _reserveOutData(ctx, 1);
+
+  BJSON_DEBUG3("encoder: going to put byte [%d] at offset [%d]",
+               value, ctx->outDataIdx);
+
+  if (out)
   {
-    /*
-     * Compact to double word (uint32).
-     */
+    out[0] = value;
 
-    _putRaw_BYTE(ctx, dataTypeBase | BJSON_DATASIZE_DWORD);
-    _putRaw_DWORD(ctx, size);
+    ctx->outDataIdx++;
   }
   else
   {
-    /*
-     * Last try - use quad word (uint64).
-     */
-
-    _putRaw_BYTE(ctx, dataTypeBase | BJSON_DATASIZE_QWORD);
-    _putRaw_QWORD(ctx, size);
+    _countOutData(ctx, 1);
   }
 }
 
-static void _enterMapOrArray(bjson_encodeCtx_t *ctx, int isMap)
+/*
+ * Put payload referenced in place. Only offset is remembered, bytes are
+ * inserted by _flattenRefs() or returned as separate chunk.
+ */
+
+static void _putRef(bjson_encodeCtx_t *ctx, const void *buf, size_t bufLen)
 {
-  if (ctx->deepIdx == BJSON_MAX_DEPTH)
+  if (_isCountingOnly(ctx))
   {
-    /* Error - too many nested containers (maps/arrays). */
-    _setErrorState(ctx, bjson_status_error_tooManyNestedContainers);
+    _countOutData(ctx, bufLen);
+
+    return;
   }
-  else
+
+  if (ctx->numRefs == ctx->refsCapacity)
   {
     /*
-     * We don't know data size yet, so we reserve room for
-     * pesimistic 32-bit size scenario. We'll compact it at the
-     * last step if possible.
+     * Not enough space for next reference - resize refs array.
      */
 
-    _rotateMapTurn(ctx);
+    size_t newCapacity = MAX(ctx->refsCapacity * 2, 16);
 
-    static uint8_t arrayHeaderFiller[] =
-    {
-      MAX_VALUE_UINT8,
-      MAX_VALUE_UINT8,
-      MAX_VALUE_UINT8,
-      MAX_VALUE_UINT8,
-      MAX_VALUE_UINT8
-    };
+    bjson_encodeRef_t *newRefs = bjson_realloc(ctx, ctx->refs,
+                                               newCapacity * sizeof(bjson_encodeRef_t));
 
-    ctx->deepIdx++;
-    ctx->blockIsMap[ctx->deepIdx]   = isMap;
-    ctx->blockIdx[ctx->deepIdx]     = ctx->outDataIdx;
-    ctx->blockMapTurn[ctx->deepIdx] = 0;
+    if (newRefs == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
 
-    _putRaw_BLOB(ctx, arrayHeaderFiller, sizeof(arrayHeaderFiller));
+      return;
+    }
 
-    BJSON_DEBUG("encoder: entered '%s', deep [%d], dataIdx [%d]",
-                isMap ? "map" : "array",
-                ctx->deepIdx,
-                ctx->outDataIdx);
+    ctx->refs         = newRefs;
+    ctx->refsCapacity = newCapacity;
   }
+
+  ctx->refs[ctx->numRefs].outIdx = ctx->outDataIdx;
+  ctx->refs[ctx->numRefs].buf    = buf;
+  ctx->refs[ctx->numRefs].bufLen = bufLen;
+
+  ctx->numRefs++;
+  ctx->refBytes += bufLen;
+
+  ctx->blocks[ctx->deepIdx].refBytes += bufLen;
 }
 
-static void _leaveMapOrArray(bjson_encodeCtx_t *ctx, int isMap)
+/*
+ * Check should payload of given size be referenced instead of copied.
+ */
+
+static int _isReferenced(bjson_encodeCtx_t *ctx, size_t bufLen)
+{
+  return (bufLen >= ctx->referenceThreshold &&
+          !ctx->isStaticBuffer &&
+          ctx->mode != bjson_encodeMode_measure);
+}
+
+static void _clearRefs(bjson_encodeCtx_t *ctx)
+{
+  ctx->numRefs  = 0;
+  ctx->refBytes = 0;
+
+  ctx->blocks[0].refBytes = 0;
+}
+
+/*
+ * Select the smallest BJSON_DATASIZE_XXX able to hold given value.
+ * Table is indexed by number of significant bytes in value minus one.
+ */
+
+static unsigned int _dataSizeOf(uint64_t value)
+{
+  static const uint8_t dataSizeByBytes[8] =
+  {
+    BJSON_DATASIZE_BYTE,
+    BJSON_DATASIZE_WORD,
+    BJSON_DATASIZE_DWORD,
+    BJSON_DATASIZE_DWORD,
+    BJSON_DATASIZE_QWORD,
+    BJSON_DATASIZE_QWORD,
+    BJSON_DATASIZE_QWORD,
+    BJSON_DATASIZE_QWORD
+  };
+
+  return dataSizeByBytes[(63 - BJSON_CLZ64(value | 1)) >> 3];
+}
+
+/*
+ * Write data type byte followed by value stored on dataSize bytes.
+ * Up to room bytes at out[] may be overwritten.
+ *
+ * RETURNS: Number of bytes written.
+ */
+
+static size_t _writeSizedDataType(uint8_t *out, size_t room,
+                                  uint8_t dataTypeBase, unsigned int dataSize,
+                                  uint64_t value)
 {
-  if (ctx->deepIdx < 1)
+  size_t headerSize = 1 + ((size_t) 1 << dataSize);
+
+  #if BJSON_LITTLE_ENDIAN
+  if (dataSize < BJSON_DATASIZE_QWORD && room >= sizeof(uint64_t))
   {
     /*
-     * Error - neither map nor array open.
+     * Data type and value fit into one 64-bit word. Store it at once,
+     * bytes above header are overwritten by next token.
      */
 
-    if (isMap)
+    uint64_t word = (dataTypeBase | dataSize) | (value << 8);
+
+    memcpy(out, &word, sizeof(word));
+
+    return headerSize;
+  }
+  #else
+  (void)room;
+  #endif
+
+  out[0] = dataTypeBase | dataSize;
+
+  switch (dataSize)
+  {
+    case BJSON_DATASIZE_BYTE:
     {
-      _setErrorState(ctx, bjson_status_error_closeMapAtRootLevel);
+      out[1] = (uint8_t) value;
+      break;
     }
-    else
+
+    case BJSON_DATASIZE_WORD:
     {
-      _setErrorState(ctx, bjson_status_error_closeArrayAtRootLevel);
+      uint16_t value16 = (uint16_t) value;
+      memcpy(out + 1, &value16, sizeof(value16));
+      break;
     }
 
-  }
-  else if (ctx->blockIsMap[ctx->deepIdx] != isMap)
-  {
-    /*
-     * Error - type mismatch while closing i.e. map closed, but
-     * array open or vice versa.
-     */
-
-    if (isMap)
+    case BJSON_DATASIZE_DWORD:
     {
-      _setErrorState(ctx, bjson_status_error_closeMapButArrayOpen);
+      uint32_t value32 = (uint32_t) value;
+      memcpy(out + 1, &value32, sizeof(value32));
+      break;
     }
-    else
+
+    default:
     {
-      _setErrorState(ctx, bjson_status_error_closeArrayButMapOpen);
+      memcpy(out + 1, &value, sizeof(value));
+      break;
     }
   }
-  else
-  {
-    /*
-     * Calculate real body size.
-     */
-
-    size_t headerIdx  = ctx->blockIdx[ctx->deepIdx];
-    size_t headerSize = 0;
-    size_t bodySize   = ctx->outDataIdx - headerIdx - BJSON_DEFAULT_ARRAY_HEADER_SIZE;
 
-    BJSON_DEBUG2("encoder: calculated array/map size is [%d] bytes", bodySize);
+  return headerSize;
+}
 
-    /*
-     * Fill up header padded at enterXxx() call.
-     */
+/*
+ * Put sized data type header optionally followed by body bytes
+ * (string or binary). Output buffer is checked only once per token.
+ */
 
-    ctx->outDataIdx = headerIdx;
+static void _putSizedDataType(bjson_encodeCtx_t *ctx,
+                              uint8_t dataTypeBase, uint64_t value,
+                              const void *body, size_t bodySize)
+{
+  unsigned int dataSize = _dataSizeOf(value);
 
-    if (ctx->blockIsMap[ctx->deepIdx])
-    {
-      _encodeSizedDataType(ctx, BJSON_DATATYPE_MAP_BASE, bodySize);
-    }
-    else
-    {
-      _encodeSizedDataType(ctx, BJSON_DATATYPE_ARRAY_BASE, bodySize);
-    }
+  size_t headerSize = 1 + ((size_t) 1 << dataSize);
 
-    /*
-     * Move body backward if header is less than 32-bit.
-     */
+  uint8_t *out = _reserveOutData(ctx, headerSize + bodySize);
 
-    headerSize = ctx->outDataIdx - headerIdx;
+  BJSON_DEBUG3("encoder: going to encode sized data type base [%d], size [%d]",
+               dataTypeBase, value);
 
-    if (headerSize < BJSON_DEFAULT_ARRAY_HEADER_SIZE)
-    {
-      uint8_t *newBody = ctx->outData + headerIdx + headerSize;
-      uint8_t *oldBody = ctx->outData + headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+  if (out == NULL)
+  {
+    _countOutData(ctx, headerSize + bodySize);
 
-      memmove(newBody, oldBody, bodySize);
-    }
+    return;
+  }
 
-    ctx->outDataIdx = headerIdx + headerSize + bodySize;
-    ctx->deepIdx--;
+  _writeSizedDataType(out, ctx->outDataCapacity - ctx->outDataIdx,
+                      dataTypeBase, dataSize, value);
 
-    BJSON_DEBUG("encoder: leaved '%s', deep [%d], dataIdx [%d]",
-                isMap ? "map" : "array",
-                ctx->deepIdx + 1,
-                ctx->outDataIdx);
+  if (bodySize > 0)
+  {
+    memcpy(out + headerSize, body, bodySize);
   }
+
+  ctx->outDataIdx += headerSize + bodySize;
 }
 
 /*
- * ----------------------------------------------------------------------------
- *                                 Public API
- * ----------------------------------------------------------------------------
+ * Number of bytes needed to encode sized data type header i.e. data type
+ * byte followed by the smallest possible size field.
  */
 
+static size_t _sizedDataTypeHeaderSize(uint64_t size)
+{
+  return 1 + ((size_t) 1 << _dataSizeOf(size));
+}
+
 /*
- * Create new encoder context. All other bjson_encodeXxx() functions
- * need this context to work.
- *
- * memoryFunctions  - optional struct containing pointers to custom
- *                    malloc/free/realloc functions. Set to NULL if
- *                    not needed (IN/OPT).
- *
- * callerCtx        - optional caller specified context passed to all
- *                    user memory callbacks. Set to NULL if not
- *                    needed (IN/OPT).
- *
- * WARNING! Returned context *MUST* be freed by caller using
- *          bjson_encoderDestroy() function.
- *
- * RETURNS: Pointer to new allocated encoder context if success,
- *          NULL if error.
+ * Empty string is encoded as single EMPTY_STRING byte, not as string
+ * of zero size. Keep streamed strings the same as bjson_encodeString().
  */
 
-BJSON_API bjson_encodeCtx_t *bjson_encoderCreate(
-                                 bjson_memoryFunctions_t *memoryFunctions,
-                                 void *callerCtx)
+static int _isEmptyString(uint8_t dataTypeBase, uint64_t size)
 {
-  bjson_encodeCtx_t *ctx = calloc(sizeof(bjson_encodeCtx_t), 1);
-
-  ctx->memoryFunctions = memoryFunctions;
-  ctx->callerCtx       = callerCtx;
-
-  return ctx;
+  return (dataTypeBase == BJSON_DATATYPE_STRING_BASE && size == 0);
 }
 
 /*
- * Free encoder context.
- *
- * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ * Number of bytes needed to encode header of block (container or
+ * streamed value) with given body size.
  */
 
-BJSON_API void bjson_encoderDestroy(bjson_encodeCtx_t *ctx)
+static size_t _blockHeaderSize(uint8_t dataTypeBase, uint64_t bodySize)
 {
-  if (ctx)
+  if (_isEmptyString(dataTypeBase, bodySize))
   {
-    if (ctx->outData)
-    {
-      bjson_free(ctx, ctx->outData);
-    }
-
-    free(ctx);
+    return 1;
   }
-}
 
-/*
- * Get pointer to output buffer containing encoded raw BJSON bytes.
- *
- * TIP#1: This call returns pointer to internal allocated buffer.
- *        Caller *MUST NOT* free it by own.
- *
- * TIP#2: Output buffer is freed when bjson_encoderDestroy() is called.
- *
- * ctx     - encoder context created by bjson_encoderCreate() before (IN),
- * buf     - pointer to internal buffer containing encoded BJSON data (OUT).
- * bufSize - number of bytes stored in returned buf[] buffer (OUT).
- *
- * RETURNS: bjson_status_ok if success,
- *          one of bjson_status_error_xxx codes otherwise.
- */
+  return _sizedDataTypeHeaderSize(bodySize);
+}
 
-BJSON_API bjson_status_t bjson_encoderGetResult(bjson_encodeCtx_t *ctx,
-                                                void **buf, size_t *bufSize)
+#if BJSON_DEBUG_LEVEL > 0
+static const char *_blockName(uint8_t dataTypeBase)
 {
-  if (_isOk(ctx))
+  switch (dataTypeBase)
   {
-    *buf     = ctx->outData;
-    *bufSize = ctx->outDataIdx;
+    case BJSON_DATATYPE_MAP_BASE:    return "map";
+    case BJSON_DATATYPE_STRING_BASE: return "string";
+    case BJSON_DATATYPE_BINARY_BASE: return "binary";
   }
 
-  return ctx->statusCode;
+  return "array";
 }
+#endif
 
 /*
- * Not implemented.
+ * Number of bytes needed to encode integer value.
  */
 
-BJSON_API bjson_status_t bjson_encoderClear(bjson_encodeCtx_t *ctx)
+static size_t _integerSize(int64_t value)
 {
-  _setErrorState(ctx, bjson_status_error_notImplemented);
+  uint64_t valueAbs = value < 0 ? 0 - (uint64_t) value : (uint64_t) value;
 
-  return ctx->statusCode;
+  return ((uint64_t) value <= 1) ? 1 : _sizedDataTypeHeaderSize(valueAbs);
 }
 
 /*
- * Not implemented.
+ * Write integer value using the smallest possible form.
+ * Up to room bytes at out[] may be overwritten.
+ *
+ * RETURNS: Number of bytes written.
  */
 
-BJSON_API bjson_status_t bjson_encoderReset(bjson_encodeCtx_t *ctx,
-                                            const char *sepText)
+static size_t _writeInteger(uint8_t *out, size_t room, int64_t value)
 {
-  /* Unused parameter */
-  (void)sepText;
+  if (value == 0)
+  {
+    out[0] = BJSON_DATATYPE_STRICT_INTEGER_ZERO;
 
-  _setErrorState(ctx, bjson_status_error_notImplemented);
+    return 1;
+  }
+  else if (value == 1)
+  {
+    out[0] = BJSON_DATATYPE_STRICT_INTEGER_ONE;
 
-  return ctx->statusCode;
+    return 1;
+  }
+  else if (value < 0)
+  {
+    uint64_t valueAbs = 0 - (uint64_t) value;
+
+    return _writeSizedDataType(out, room, BJSON_DATATYPE_NEGATIVE_INTEGER_BASE,
+                               _dataSizeOf(valueAbs), valueAbs);
+  }
+
+  return _writeSizedDataType(out, room, BJSON_DATATYPE_POSITIVE_INTEGER_BASE,
+                             _dataSizeOf(value), value);
 }
 
+#if BJSON_LITTLE_ENDIAN
 /*
- * Push null value into output BJSON stream.
- *
- * ctx - encoder context created by bjson_encoderCreate() before (IN),
- *
- * RETURNS: bjson_status_ok if success,
- *          one of bjson_status_error_xxx codes otherwise.
+ * The same as _writeInteger(), but without branches on value. Always
+ * stores 9 bytes, so there *MUST* be room for them at out[].
  */
 
-BJSON_API bjson_status_t bjson_encodeNull(bjson_encodeCtx_t *ctx)
+static size_t _writeIntegerWide(uint8_t *out, int64_t value)
 {
-  _setErrorStateIfKeyTurn(ctx);
+  int      isNegative = (value < 0);
+  int      isStrict   = ((uint64_t) value <= 1);
+  uint64_t valueAbs   = isNegative ? 0 - (uint64_t) value : (uint64_t) value;
 
-  if (_isOk(ctx))
+  unsigned int dataSize = _dataSizeOf(valueAbs);
+
+  uint64_t dataType = isNegative ? BJSON_DATATYPE_NEGATIVE_INTEGER_BASE
+                                 : BJSON_DATATYPE_POSITIVE_INTEGER_BASE;
+
+  uint64_t word = (dataType | dataSize) | (valueAbs << 8);
+  size_t   size = 1 + ((size_t) 1 << dataSize);
+
+  word = isStrict ? BJSON_DATATYPE_STRICT_INTEGER_ZERO + (uint64_t) value : word;
+  size = isStrict ? 1 : size;
+
+  memcpy(out, &word, sizeof(word));
+
+  out[sizeof(word)] = (uint8_t) (valueAbs >> 56);
+
+  return size;
+}
+#endif
+
+/*
+ * Choose the way double is written. Without compactNumbers option it's
+ * always float64. Otherwise integral values go as the smallest integer
+ * (or float32 if shorter e.g. 2^40), values exactly representable as
+ * float32 go as float32. Negative zero is not integer, keep its sign.
+ */
+
+static bjson_encodeDoubleForm_t _doubleFormOf(double value, int compactNumbers)
+{
+  if (compactNumbers == 0)
   {
-    _putRaw_BYTE(ctx, BJSON_DATATYPE_NULL);
-    _rotateMapTurn(ctx);
+    return bjson_encodeDoubleForm_float64;
+  }
 
-    BJSON_DEBUG("encoder: encoded null, deep [%d], dataIdx [%d]",
-                ctx->deepIdx, ctx->outDataIdx);
+  if (value >= -9223372036854775808.0 && value < 9223372036854775808.0 &&
+      (double) (int64_t) value == value && !(value == 0 && signbit(value)))
+  {
+    if ((double) (float) value == value &&
+        _integerSize((int64_t) value) > 1 + sizeof(float))
+    {
+      return bjson_encodeDoubleForm_float32;
+    }
+
+    return bjson_encodeDoubleForm_integer;
   }
 
-  return ctx->statusCode;
+  if ((double) (float) value == value)
+  {
+    return bjson_encodeDoubleForm_float32;
+  }
+
+  return bjson_encodeDoubleForm_float64;
+}
+
+static size_t _doubleSize(double value, bjson_encodeDoubleForm_t form)
+{
+  switch (form)
+  {
+    case bjson_encodeDoubleForm_integer: return _integerSize((int64_t) value);
+    case bjson_encodeDoubleForm_float32: return 1 + sizeof(float);
+    default:                             return 1 + sizeof(double);
+  }
+}
+
+static size_t _writeFloat32(uint8_t *out, float value)
+{
+  out[0] = BJSON_DATATYPE_FLOAT32;
+
+  memcpy(out + 1, &value, sizeof(value));
+
+  return 1 + sizeof(value);
+}
+
+static size_t _writeDouble(uint8_t *out, size_t room,
+                           double value, bjson_encodeDoubleForm_t form)
+{
+  switch (form)
+  {
+    case bjson_encodeDoubleForm_integer:
+    {
+      return _writeInteger(out, room, (int64_t) value);
+    }
+
+    case bjson_encodeDoubleForm_float32:
+    {
+      return _writeFloat32(out, (float) value);
+    }
+
+    default:
+    {
+      out[0] = BJSON_DATATYPE_FLOAT64;
+
+      memcpy(out + 1, &value, sizeof(value));
+
+      return 1 + sizeof(value);
+    }
+  }
 }
 
 /*
- * Push boolean value into output BJSON stream.
- *
- * ctx   - encoder context created by bjson_encoderCreate() before (IN).
- * value - set 1 to encode true value, 0 otherwise (IN).
+ * Check is there room for one more nesting level. Used by functions
+ * writing whole array at once.
+ */
+
+static int _canEnterArray(bjson_encodeCtx_t *ctx)
+{
+  if (ctx->deepIdx == BJSON_MAX_DEPTH)
+  {
+    /* Error - too many nested containers (maps/arrays). */
+    _setErrorState(ctx, bjson_status_error_tooManyNestedContainers);
+
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Reserve whole array with known body size and write its header.
  *
- * RETURNS: bjson_status_ok if success,
- *          one of bjson_status_error_xxx codes otherwise.
+ * RETURNS: Pointer to write body at or NULL if nothing should be
+ *          written (counting only or error).
  */
 
-BJSON_API bjson_status_t bjson_encodeBool(bjson_encodeCtx_t *ctx, int value)
+static uint8_t *_putArrayHeader(bjson_encodeCtx_t *ctx, size_t bodySize)
 {
-  _setErrorStateIfKeyTurn(ctx);
+  unsigned int dataSize = _dataSizeOf(bodySize);
 
-  if (_isOk(ctx))
+  size_t headerSize = 1 + ((size_t) 1 << dataSize);
+
+  uint8_t *out = _reserveOutData(ctx, headerSize + bodySize);
+
+  if (out == NULL)
   {
-    uint8_t dataType = value ? BJSON_DATATYPE_STRICT_TRUE : BJSON_DATATYPE_STRICT_FALSE;
+    _countOutData(ctx, headerSize + bodySize);
 
-    _putRaw_BYTE(ctx, dataType);
-    _rotateMapTurn(ctx);
+    return NULL;
+  }
 
-    BJSON_DEBUG("encoder: encoded bool (%d), deep [%d], dataIdx [%d]",
-                value, ctx->deepIdx, ctx->outDataIdx);
+  _writeSizedDataType(out, ctx->outDataCapacity - ctx->outDataIdx,
+                      BJSON_DATATYPE_ARRAY_BASE, dataSize, bodySize);
+
+  ctx->outDataIdx += headerSize + bodySize;
+
+  return out + headerSize;
+}
+
+/*
+ * Read little endian size field of 1, 2, 4 or 8 bytes.
+ */
+
+static uint64_t _readSizeField(const uint8_t *data, size_t fieldSize)
+{
+  uint64_t value = 0;
+
+  while (fieldSize > 0)
+  {
+    fieldSize--;
+    value = (value << 8) | data[fieldSize];
   }
 
-  return ctx->statusCode;
+  return value;
 }
 
 /*
- * Push integer value into output BJSON stream.
+ * Fast structural check of pre-encoded BJSON value (see bjson_encodeRaw()).
+ * Data must contain exactly one complete value, each container body must
+ * be filled exactly by its items and each map key must be a string.
+ * Values themselves (utf8, numbers) are not inspected.
  *
- * ctx   - encoder context created by bjson_encoderCreate() before (IN),
- * value - integer value to be encoded e.g. 1234 (IN).
+ * data     - pre-encoded BJSON value (IN),
+ * dataSize - number of bytes in data[] (IN),
+ * maxDepth - number of nesting levels still available (IN).
  *
- * RETURNS: bjson_status_ok if success,
+ * RETURNS: bjson_status_ok if data can be spliced as is,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeInteger(bjson_encodeCtx_t *ctx,
-                                             int64_t value)
+static bjson_status_t _validateRaw(const uint8_t *data, size_t dataSize,
+                                   int maxDepth)
 {
-  _setErrorStateIfKeyTurn(ctx);
+  size_t blockEnd[BJSON_MAX_DEPTH + 1];
+  uint8_t blockIsMap[BJSON_MAX_DEPTH + 1];
+  uint8_t blockMapTurn[BJSON_MAX_DEPTH + 1];
 
-  if (_isOk(ctx))
+  int deepIdx = 0;
+  size_t idx  = 0;
+
+  if (dataSize == 0)
   {
-    if (value == 0)
-    {
-      /*
-       * Strict integer zero.
-       */
+    return bjson_status_error_emptyInputPassed;
+  }
 
-      _putRaw_BYTE(ctx, BJSON_DATATYPE_STRICT_INTEGER_ZERO);
+  blockEnd[0]     = dataSize;
+  blockIsMap[0]   = 0;
+  blockMapTurn[0] = 0;
 
-      BJSON_DEBUG("encoder: encoded integer zero, deep [%d], dataIdx [%d]",
-                  ctx->deepIdx, ctx->outDataIdx);
+  for (;;)
+  {
+    uint8_t dataType = 0;
+    size_t fieldSize = 0;
+    uint64_t bodySize = 0;
+
+    /*
+     * Leave containers, which are already complete.
+     */
+
+    while (deepIdx > 0 && idx == blockEnd[deepIdx])
+    {
+      if (blockIsMap[deepIdx] && !blockMapTurn[deepIdx])
+      {
+        /* Error - last key has no value. */
+        return bjson_status_error_keyWithoutValue;
+      }
+
+      deepIdx--;
     }
-    else if (value == 1)
+
+    if (deepIdx == 0 && idx > 0)
     {
-      /*
-       * Strict integer one.
-       */
+      /* Top value is complete. Nothing more allowed after it. */
+      return (idx == dataSize) ? bjson_status_ok
+                               : bjson_status_error_moreDataThanDeclared;
+    }
 
-      _putRaw_BYTE(ctx, BJSON_DATATYPE_STRICT_INTEGER_ONE);
+    dataType = data[idx++];
 
-      BJSON_DEBUG("encoder: encoded integer one, deep [%d], dataIdx [%d]",
-                  ctx->deepIdx, ctx->outDataIdx);
+    if (blockIsMap[deepIdx])
+    {
+      if (blockMapTurn[deepIdx] &&
+          (dataType & ~3U) != BJSON_DATATYPE_STRING_BASE &&
+          dataType != BJSON_DATATYPE_EMPTY_STRING)
+      {
+        /* Error - map key must be a string. */
+        return bjson_status_error_invalidObjectKey;
+      }
+
+      blockMapTurn[deepIdx] = !blockMapTurn[deepIdx];
     }
-    else if (value < 0)
+
+    switch (dataType & ~3U)
+    {
+      case 0:
+      case BJSON_DATATYPE_STRICT_FALSE:
+      {
+        /* Value stored in data type itself. */
+        continue;
+      }
+
+      case BJSON_DATATYPE_POSITIVE_INTEGER_BASE:
+      case BJSON_DATATYPE_NEGATIVE_INTEGER_BASE:
+      case BJSON_DATATYPE_FLOAT_BASE:
+      {
+        /* Fixed size value. Treat it as body without size field. */
+        bodySize = (uint64_t) 1 << (dataType & 3U);
+
+        break;
+      }
+
+      case BJSON_DATATYPE_STRING_BASE:
+      case BJSON_DATATYPE_BINARY_BASE:
+      case BJSON_DATATYPE_ARRAY_BASE:
+      case BJSON_DATATYPE_MAP_BASE:
+      {
+        fieldSize = (size_t) 1 << (dataType & 3U);
+
+        if (blockEnd[deepIdx] - idx < fieldSize)
+        {
+          return (blockEnd[deepIdx] == dataSize)
+                     ? bjson_status_error_unexpectedEndOfStream
+                     : bjson_status_error_moreDataThanDeclared;
+        }
+
+        bodySize = _readSizeField(data + idx, fieldSize);
+
+        idx += fieldSize;
+
+        break;
+      }
+
+      default:
+      {
+        /* Error - unknown data type. */
+        return bjson_status_error_invalidDataType;
+      }
+    }
+
+    if (bodySize > blockEnd[deepIdx] - idx)
     {
       /*
-       * Negative integer.
+       * Error - value goes beyond its parent or beyond whole data.
        */
 
-      _encodeSizedDataType(ctx, BJSON_DATATYPE_NEGATIVE_INTEGER_BASE, -value);
+      return (blockEnd[deepIdx] == dataSize)
+                 ? bjson_status_error_unexpectedEndOfStream
+                 : bjson_status_error_moreDataThanDeclared;
+    }
 
-      BJSON_DEBUG("encoder: encoded negative integer (%lld), deep [%d], dataIdx [%d]",
-                  value, ctx->deepIdx, ctx->outDataIdx);
+    if ((dataType & ~3U) == BJSON_DATATYPE_ARRAY_BASE ||
+        (dataType & ~3U) == BJSON_DATATYPE_MAP_BASE)
+    {
+      if (deepIdx == maxDepth)
+      {
+        /* Error - too many nested containers (maps/arrays). */
+        return bjson_status_error_tooManyNestedContainers;
+      }
+
+      deepIdx++;
+
+      blockEnd[deepIdx]     = idx + bodySize;
+      blockIsMap[deepIdx]   = ((dataType & ~3U) == BJSON_DATATYPE_MAP_BASE);
+      blockMapTurn[deepIdx] = 1;
     }
     else
     {
-      /*
-       * Positive integer.
-       */
+      idx += bodySize;
+    }
+  }
+}
+
+/*
+ * Put next block on top of block stack. Stack is grown if needed.
+ *
+ * RETURNS: Pointer to new block with common fields set or NULL if
+ *          error.
+ */
 
-      _encodeSizedDataType(ctx, BJSON_DATATYPE_POSITIVE_INTEGER_BASE, value);
+static bjson_encodeBlock_t *_pushBlock(bjson_encodeCtx_t *ctx,
+                                       uint8_t dataTypeBase)
+{
+  bjson_encodeBlock_t *block = NULL;
 
-      BJSON_DEBUG("encoder: encoded positive integer (%lld), deep [%d], dataIdx [%d]",
-                  value, ctx->deepIdx, ctx->outDataIdx);
+  if (ctx->deepIdx + 1 == ctx->blocksCapacity)
+  {
+    /*
+     * Not enough space for next block - resize block stack.
+     */
+
+    int newCapacity = MIN(ctx->blocksCapacity * 2, BJSON_MAX_DEPTH + 2);
+
+    bjson_encodeBlock_t *newBlocks = bjson_realloc(ctx, ctx->blocks,
+                                                   newCapacity * sizeof(bjson_encodeBlock_t));
+
+    if (newBlocks == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return NULL;
     }
 
-    _rotateMapTurn(ctx);
+    ctx->blocks         = newBlocks;
+    ctx->blocksCapacity = newCapacity;
   }
 
-  return ctx->statusCode;
+  ctx->deepIdx++;
+
+  block = &ctx->blocks[ctx->deepIdx];
+
+  block->dataTypeBase = dataTypeBase;
+  block->mapTurn      = 0;
+  block->isSized      = 0;
+  block->bodySize     = 0;
+  block->idx          = ctx->outDataIdx;
+  block->gapIdx       = 0;
+  block->slack        = 0;
+  block->measuredIdx  = 0;
+  block->refIdx       = ctx->numRefs;
+  block->refBytes     = 0;
+
+  return block;
 }
 
 /*
- * Push double precision number into output BJSON stream.
- *
- * ctx   - encoder context created by bjson_encoderCreate() before (IN).
- * value - number to be encoded e.g. 3.14 (IN).
- *
- * RETURNS: bjson_status_ok if success,
- *          one of bjson_status_error_xxx codes otherwise.
+ * Open container with body size known up front. Final header is written
+ * immediately, so there is no placeholder to fix up later.
  */
 
-BJSON_API bjson_status_t bjson_encodeDouble(bjson_encodeCtx_t *ctx, double value)
+static void _enterSizedMapOrArray(bjson_encodeCtx_t *ctx,
+                                  uint8_t dataTypeBase,
+                                  size_t bodySize)
 {
-  _setErrorStateIfKeyTurn(ctx);
+  bjson_encodeBlock_t *block = NULL;
 
-  if (_isOk(ctx))
+  if (_isEmptyString(dataTypeBase, bodySize))
   {
-    _putRaw_BYTE(ctx, BJSON_DATATYPE_FLOAT64);
-    _putRaw_FLOAT64(ctx, value);
-    _rotateMapTurn(ctx);
+    _putRaw_BYTE(ctx, BJSON_DATATYPE_EMPTY_STRING);
+  }
+  else
+  {
+    _putSizedDataType(ctx, dataTypeBase, bodySize, NULL, 0);
+  }
 
-    BJSON_DEBUG("encoder: encoded double (%lf), deep [%d], dataIdx [%d]",
-                value, ctx->deepIdx, ctx->outDataIdx);
+  block = _pushBlock(ctx, dataTypeBase);
+
+  if (block)
+  {
+    block->isSized  = 1;
+    block->bodySize = bodySize;
   }
+}
 
-  return ctx->statusCode;
+/*
+ * Open container in measure pass. Nothing is written. Reserve slot for
+ * body size, which is known when container is closed.
+ */
+
+static void _enterMeasuredMapOrArray(bjson_encodeCtx_t *ctx,
+                                     uint8_t dataTypeBase)
+{
+  bjson_encodeBlock_t *block = NULL;
+
+  if (ctx->numMeasured == ctx->measuredCapacity)
+  {
+    /*
+     * Not enough space for next size - resize sizes array.
+     */
+
+    size_t newCapacity = MAX(ctx->measuredCapacity * 2, 16);
+
+    size_t *newSizes = bjson_realloc(ctx, ctx->measuredSizes,
+                                     newCapacity * sizeof(size_t));
+
+    if (newSizes == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return;
+    }
+
+    ctx->measuredSizes    = newSizes;
+    ctx->measuredCapacity = newCapacity;
+  }
+
+  block = _pushBlock(ctx, dataTypeBase);
+
+  if (block)
+  {
+    block->measuredIdx = ctx->numMeasured;
+
+    ctx->numMeasured++;
+  }
 }
 
 /*
- * Not implemented. Reserved for the future use.
+ * Open container with unknown body size. We reserve room for
+ * pesimistic 32-bit size scenario and compact it when closed.
  */
 
-BJSON_API bjson_status_t bjson_encodeNumberFromText(bjson_encodeCtx_t *ctx,
-                                                    const char *text,
-                                                    size_t textLen)
+static void _enterUnsizedMapOrArray(bjson_encodeCtx_t *ctx,
+                                    uint8_t dataTypeBase)
 {
-  /* Mark unused params */
-  (void)text;
-  (void)textLen;
+  static uint8_t arrayHeaderFiller[] =
+  {
+    MAX_VALUE_UINT8,
+    MAX_VALUE_UINT8,
+    MAX_VALUE_UINT8,
+    MAX_VALUE_UINT8,
+    MAX_VALUE_UINT8
+  };
 
-  _setErrorState(ctx, bjson_status_error_notImplemented);
+  bjson_encodeBlock_t *block = NULL;
 
-  return ctx->statusCode;
+  if (!ctx->isStaticBuffer && ctx->numGaps == ctx->gapsCapacity)
+  {
+    /*
+     * Not enough space for next gap entry - resize gaps array.
+     */
+
+    size_t newCapacity = MAX(ctx->gapsCapacity * 2, 16);
+
+    bjson_encodeGap_t *newGaps = bjson_realloc(ctx, ctx->gaps,
+                                               newCapacity * sizeof(bjson_encodeGap_t));
+
+    if (newGaps == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return;
+    }
+
+    ctx->gaps         = newGaps;
+    ctx->gapsCapacity = newCapacity;
+  }
+
+  block = _pushBlock(ctx, dataTypeBase);
+
+  if (block == NULL)
+  {
+    return;
+  }
+
+  block->gapIdx = ctx->numGaps;
+
+  if (!ctx->isStaticBuffer)
+  {
+    ctx->gaps[ctx->numGaps].headerIdx = ctx->outDataIdx;
+    ctx->gaps[ctx->numGaps].gapSize   = 0;
+    ctx->gaps[ctx->numGaps].isWide    = 0;
+    ctx->numGaps++;
+  }
+
+  _putRaw_BLOB(ctx, arrayHeaderFiller, sizeof(arrayHeaderFiller));
+}
+
+/*
+ * Track the deepest container nesting. Streamed values are open as
+ * blocks too, but they're not containers.
+ */
+
+static void _countPeakDepth(bjson_encodeCtx_t *ctx, uint8_t dataTypeBase)
+{
+#if BJSON_STATS_ENABLED > 0
+  if (dataTypeBase == BJSON_DATATYPE_MAP_BASE ||
+      dataTypeBase == BJSON_DATATYPE_ARRAY_BASE)
+  {
+    BJSON_STATS_PEAK(ctx->stats, maxDepth, ctx->deepIdx);
+  }
+#else
+  (void)ctx;
+  (void)dataTypeBase;
+#endif
+}
+
+static void _enterMapOrArray(bjson_encodeCtx_t *ctx, uint8_t dataTypeBase)
+{
+  /*
+   * Streamed string/binary is one value, not a container, so it does not
+   * count to nesting limit. It can't be nested, so one extra slot is enough.
+   */
+
+  if (ctx->deepIdx == BJSON_MAX_DEPTH &&
+      (dataTypeBase == BJSON_DATATYPE_MAP_BASE ||
+       dataTypeBase == BJSON_DATATYPE_ARRAY_BASE))
+  {
+    /* Error - too many nested containers (maps/arrays). */
+    _setErrorState(ctx, bjson_status_error_tooManyNestedContainers);
+  }
+  else
+  {
+    _rotateMapTurn(ctx);
+
+    switch (ctx->mode)
+    {
+      case bjson_encodeMode_measure:
+      {
+        _enterMeasuredMapOrArray(ctx, dataTypeBase);
+
+        break;
+      }
+
+      case bjson_encodeMode_write:
+      {
+        if (ctx->nextMeasuredIdx < ctx->numMeasured)
+        {
+          size_t bodySize = ctx->measuredSizes[ctx->nextMeasuredIdx];
+
+          ctx->nextMeasuredIdx++;
+
+          _enterSizedMapOrArray(ctx, dataTypeBase, bodySize);
+        }
+        else
+        {
+          /* Error - more containers than in measure pass. */
+          _setErrorState(ctx, bjson_status_error_measurePassMismatch);
+        }
+
+        break;
+      }
+
+      default:
+      {
+        _enterUnsizedMapOrArray(ctx, dataTypeBase);
+      }
+    }
+
+    _countPeakDepth(ctx, dataTypeBase);
+
+    BJSON_DEBUG("encoder: entered '%s', deep [%d], dataIdx [%d]",
+                _blockName(dataTypeBase),
+                ctx->deepIdx,
+                ctx->outDataIdx);
+  }
+}
+
+static void _enterMapOrArrayWithSize(bjson_encodeCtx_t *ctx,
+                                     uint8_t dataTypeBase,
+                                     size_t bodySize)
+{
+  if (ctx->deepIdx == BJSON_MAX_DEPTH)
+  {
+    /* Error - too many nested containers (maps/arrays). */
+    _setErrorState(ctx, bjson_status_error_tooManyNestedContainers);
+  }
+  else
+  {
+    _rotateMapTurn(ctx);
+    _enterSizedMapOrArray(ctx, dataTypeBase, bodySize);
+
+    _countPeakDepth(ctx, dataTypeBase);
+
+    BJSON_DEBUG("encoder: entered '%s' with size [%u], deep [%d], dataIdx [%d]",
+                _blockName(dataTypeBase),
+                bodySize,
+                ctx->deepIdx,
+                ctx->outDataIdx);
+  }
+}
+
+/*
+ * Close container open with known body size. Just verify the size.
+ */
+
+static void _leaveSizedMapOrArray(bjson_encodeCtx_t *ctx)
+{
+  size_t bodySize = ctx->outDataIdx - ctx->blocks[ctx->deepIdx].idx
+                  - ctx->blocks[ctx->deepIdx].slack
+                  + ctx->blocks[ctx->deepIdx].refBytes;
+
+  if (bodySize != ctx->blocks[ctx->deepIdx].bodySize)
+  {
+    /* Error - body size differs from declared one. */
+    _setErrorState(ctx, bjson_status_error_containerSizeMismatch);
+  }
+  else
+  {
+    ctx->blocks[ctx->deepIdx - 1].slack    += ctx->blocks[ctx->deepIdx].slack;
+    ctx->blocks[ctx->deepIdx - 1].refBytes += ctx->blocks[ctx->deepIdx].refBytes;
+    ctx->deepIdx--;
+  }
+}
+
+/*
+ * Close container in measure pass. Store body size and count header,
+ * which will be written in front of the body in write pass.
+ */
+
+static void _leaveMeasuredMapOrArray(bjson_encodeCtx_t *ctx)
+{
+  size_t bodySize = ctx->outDataIdx - ctx->blocks[ctx->deepIdx].idx;
+
+  ctx->measuredSizes[ctx->blocks[ctx->deepIdx].measuredIdx] = bodySize;
+
+  ctx->outDataIdx += _blockHeaderSize(ctx->blocks[ctx->deepIdx].dataTypeBase,
+                                     bodySize);
+  ctx->deepIdx--;
+}
+
+/*
+ * Close container with body over 4GB. Header with QWORD size field is
+ * longer than placeholder, so it's split. The head goes to placeholder,
+ * the tail is kept in gap entry and put into output, when it's written
+ * out or compacted. Body is not moved here.
+ */
+
+static void _leaveWideMapOrArray(bjson_encodeCtx_t *ctx, size_t bodySize)
+{
+  uint8_t header[1 + sizeof(uint64_t)];
+
+  bjson_encodeGap_t *gap = NULL;
+
+  size_t headerIdx  = ctx->blocks[ctx->deepIdx].idx;
+  size_t bodyIdx    = headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+  size_t headerSize = _writeSizedDataType(header, sizeof(header),
+                                          ctx->blocks[ctx->deepIdx].dataTypeBase,
+                                          BJSON_DATASIZE_QWORD, bodySize);
+
+  size_t tailSize = headerSize - BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+
+  if (ctx->isStaticBuffer)
+  {
+    /*
+     * No gap entries for static buffer. Make room for whole header
+     * right now if there is enough space left.
+     */
+
+    if (ctx->outDataCapacity - ctx->outDataIdx < tailSize)
+    {
+      _setErrorState(ctx, bjson_status_error_bufferFull);
+
+      _countOutData(ctx, tailSize);
+    }
+    else
+    {
+      memmove(ctx->outData + bodyIdx + tailSize, ctx->outData + bodyIdx,
+              ctx->outDataIdx - bodyIdx);
+
+      BJSON_STATS_ADD(ctx->stats, bytesMoved, ctx->outDataIdx - bodyIdx);
+
+      memcpy(ctx->outData + headerIdx, header, headerSize);
+
+      ctx->outDataIdx += tailSize;
+    }
+
+    ctx->deepIdx--;
+
+    return;
+  }
+
+  gap = &ctx->gaps[ctx->blocks[ctx->deepIdx].gapIdx];
+
+  memcpy(ctx->outData + gap->headerIdx, header, BJSON_DEFAULT_ARRAY_HEADER_SIZE);
+  memcpy(gap->wideTail, header + BJSON_DEFAULT_ARRAY_HEADER_SIZE, sizeof(gap->wideTail));
+
+  gap->isWide  = 1;
+  gap->gapSize = 0;
+
+  /*
+   * Final output is longer than outData here. Slack goes below zero,
+   * unsigned wrap around keeps sizes of parents right.
+   */
+
+  ctx->blocks[ctx->deepIdx - 1].slack += ctx->blocks[ctx->deepIdx].slack - tailSize;
+
+  ctx->blocks[ctx->deepIdx - 1].refBytes += ctx->blocks[ctx->deepIdx].refBytes;
+  ctx->deepIdx--;
+}
+
+/*
+ * Close container open with unknown body size. Write final header in
+ * place of placeholder.
+ */
+
+static void _leaveUnsizedMapOrArray(bjson_encodeCtx_t *ctx)
+{
+  /*
+   * Calculate real body size. Don't count gaps left by nested
+   * containers, they'll be removed at the end. Count payloads
+   * referenced in place, they're not in outData.
+   */
+
+  size_t headerIdx  = ctx->blocks[ctx->deepIdx].idx;
+  size_t endIdx     = ctx->outDataIdx;
+  size_t headerSize = 0;
+  size_t refBytes   = ctx->blocks[ctx->deepIdx].refBytes;
+  size_t bodySize   = endIdx - headerIdx - BJSON_DEFAULT_ARRAY_HEADER_SIZE
+                    - ctx->blocks[ctx->deepIdx].slack + refBytes;
+
+  BJSON_DEBUG2("encoder: calculated array/map size is [%d] bytes", bodySize);
+
+  if (_isCountingOnly(ctx))
+  {
+    /*
+     * Static buffer is full. Just count final header.
+     */
+
+    ctx->outDataIdx = headerIdx
+                    + _blockHeaderSize(ctx->blocks[ctx->deepIdx].dataTypeBase, bodySize)
+                    + bodySize - refBytes;
+
+    ctx->blocks[ctx->deepIdx - 1].refBytes += refBytes;
+    ctx->deepIdx--;
+
+    return;
+  }
+
+  if (_dataSizeOf(bodySize) == BJSON_DATASIZE_QWORD)
+  {
+    _leaveWideMapOrArray(ctx, bodySize);
+
+    return;
+  }
+
+  /*
+   * Fill up header padded at enterXxx() call.
+   */
+
+  if (_isEmptyString(ctx->blocks[ctx->deepIdx].dataTypeBase, bodySize))
+  {
+    ctx->outData[headerIdx] = BJSON_DATATYPE_EMPTY_STRING;
+
+    headerSize = 1;
+  }
+  else
+  {
+    headerSize = _writeSizedDataType(ctx->outData + headerIdx,
+                                     BJSON_DEFAULT_ARRAY_HEADER_SIZE,
+                                     ctx->blocks[ctx->deepIdx].dataTypeBase,
+                                     _dataSizeOf(bodySize), bodySize);
+  }
+
+  BJSON_STATS_ADD(ctx->stats, headerBytesWasted, BJSON_DEFAULT_ARRAY_HEADER_SIZE - headerSize);
+
+  if (ctx->isStaticBuffer ||
+      (ctx->blocks[ctx->deepIdx].slack == 0 &&
+       bodySize - refBytes <= BJSON_INLINE_COMPACT_LIMIT))
+  {
+    /*
+     * Small body without gaps inside. Move it backward right now
+     * and forget gap entries of this container and nested ones.
+     * Always done for static buffer to avoid gaps array allocation.
+     */
+
+    size_t shift = BJSON_DEFAULT_ARRAY_HEADER_SIZE - headerSize;
+    size_t i     = 0;
+
+    if (shift > 0)
+    {
+      uint8_t *newBody = ctx->outData + headerIdx + headerSize;
+      uint8_t *oldBody = ctx->outData + headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+
+      memmove(newBody, oldBody, bodySize - refBytes);
+
+      BJSON_STATS_ADD(ctx->stats, bytesMoved, bodySize - refBytes);
+
+      for (i = ctx->blocks[ctx->deepIdx].refIdx; i < ctx->numRefs; i++)
+      {
+        ctx->refs[i].outIdx -= shift;
+      }
+    }
+
+    ctx->numGaps    = ctx->blocks[ctx->deepIdx].gapIdx;
+    ctx->outDataIdx = headerIdx + headerSize + bodySize - refBytes;
+  }
+  else
+  {
+    /*
+     * Don't move body if header is less than 32-bit. Remember the gap
+     * and pass it to parent container instead.
+     */
+
+    if (headerSize < BJSON_DEFAULT_ARRAY_HEADER_SIZE)
+    {
+      ctx->gaps[ctx->blocks[ctx->deepIdx].gapIdx].gapSize =
+          BJSON_DEFAULT_ARRAY_HEADER_SIZE - headerSize;
+    }
+
+    ctx->blocks[ctx->deepIdx - 1].slack += ctx->blocks[ctx->deepIdx].slack +
+                                         ctx->gaps[ctx->blocks[ctx->deepIdx].gapIdx].gapSize;
+
+    ctx->outDataIdx = endIdx;
+  }
+
+  ctx->blocks[ctx->deepIdx - 1].refBytes += refBytes;
+  ctx->deepIdx--;
+}
+
+static void _leaveBlock(bjson_encodeCtx_t *ctx)
+{
+  BJSON_DEBUG("encoder: leaving '%s', deep [%d], dataIdx [%d]",
+              _blockName(ctx->blocks[ctx->deepIdx].dataTypeBase),
+              ctx->deepIdx,
+              ctx->outDataIdx);
+
+  if (ctx->blocks[ctx->deepIdx].isSized)
+  {
+    _leaveSizedMapOrArray(ctx);
+  }
+  else if (ctx->mode == bjson_encodeMode_measure)
+  {
+    _leaveMeasuredMapOrArray(ctx);
+  }
+  else
+  {
+    _leaveUnsizedMapOrArray(ctx);
+  }
+}
+
+static void _leaveMapOrArray(bjson_encodeCtx_t *ctx, int isMap)
+{
+  if (_isStreamOpen(ctx))
+  {
+    /* Error - streamed string or binary must be ended first. */
+    _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+  }
+  else if (ctx->deepIdx < 1)
+  {
+    /*
+     * Error - neither map nor array open.
+     */
+
+    if (isMap)
+    {
+      _setErrorState(ctx, bjson_status_error_closeMapAtRootLevel);
+    }
+    else
+    {
+      _setErrorState(ctx, bjson_status_error_closeArrayAtRootLevel);
+    }
+
+  }
+  else if (_isMapOpen(ctx) != isMap)
+  {
+    /*
+     * Error - type mismatch while closing i.e. map closed, but
+     * array open or vice versa.
+     */
+
+    if (isMap)
+    {
+      _setErrorState(ctx, bjson_status_error_closeMapButArrayOpen);
+    }
+    else
+    {
+      _setErrorState(ctx, bjson_status_error_closeArrayButMapOpen);
+    }
+  }
+  else
+  {
+    _leaveBlock(ctx);
+  }
+}
+
+/*
+ * Remove all header gaps left by closed containers and complete headers
+ * split by containers over 4GB. Each byte is moved at most once no matter
+ * how deep containers are nested. Containers still open are kept valid.
+ */
+
+static void _compactOutData(bjson_encodeCtx_t *ctx)
+{
+  ptrdiff_t delta = 0;
+
+  size_t readIdx  = 0;
+  size_t endIdx   = 0;
+  size_t limitIdx = 0;
+  size_t refIdx   = 0;
+  size_t growth   = 0;
+  size_t i        = 0;
+  int depth       = 1;
+
+  ctx->savepointEpoch++;
+
+  for (i = 0; i < ctx->numGaps; i++)
+  {
+    if (ctx->gaps[i].isWide)
+    {
+      growth += sizeof(ctx->gaps[i].wideTail);
+    }
+  }
+
+  if (growth > 0)
+  {
+    _prepareOutDataBuffer(ctx, growth);
+
+    if (!_isOk(ctx))
+    {
+      return;
+    }
+  }
+
+  /*
+   * Pass #1: Go forward. Data between gaps (segment) goes back by gap
+   * bytes removed so far and forth by header tails put so far. Shift
+   * offsets of open containers and referenced payloads. Move segments,
+   * which go back.
+   */
+
+  for (i = 0; i <= ctx->numGaps; i++)
+  {
+    if (i < ctx->numGaps)
+    {
+      endIdx   = ctx->gaps[i].headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE
+               - ctx->gaps[i].gapSize;
+      limitIdx = endIdx;
+    }
+    else
+    {
+      endIdx   = ctx->outDataIdx;
+      limitIdx = SIZE_MAX;
+    }
+
+    while (depth <= ctx->deepIdx && ctx->blocks[depth].idx < limitIdx)
+    {
+      ctx->blocks[depth].idx += delta;
+      depth++;
+    }
+
+    while (refIdx < ctx->numRefs && ctx->refs[refIdx].outIdx < limitIdx)
+    {
+      ctx->refs[refIdx].outIdx += delta;
+      refIdx++;
+    }
+
+    if (delta < 0)
+    {
+      memmove(ctx->outData + readIdx + delta, ctx->outData + readIdx,
+              endIdx - readIdx);
+
+      BJSON_STATS_ADD(ctx->stats, bytesMoved, endIdx - readIdx);
+    }
+
+    if (i < ctx->numGaps)
+    {
+      bjson_encodeGap_t *gap = &ctx->gaps[i];
+
+      delta  -= gap->gapSize;
+      delta  += gap->isWide ? sizeof(gap->wideTail) : 0;
+      readIdx = gap->headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+    }
+  }
+
+  ctx->outDataIdx += delta;
+
+  /*
+   * Pass #2: Go backward. Move segments, which go forth, and put header
+   * tails right after their segments. Needed only if some header was
+   * split.
+   */
+
+  for (i = ctx->numGaps + 1; growth > 0 && i > 0; i--)
+  {
+    bjson_encodeGap_t *gap = (i - 1 < ctx->numGaps) ? &ctx->gaps[i - 1] : NULL;
+
+    endIdx  = ctx->outDataIdx - delta;
+    readIdx = (i > 1) ? ctx->gaps[i - 2].headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE : 0;
+
+    if (gap)
+    {
+      endIdx = gap->headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE - gap->gapSize;
+
+      if (gap->isWide)
+      {
+        memcpy(ctx->outData + endIdx + delta, gap->wideTail, sizeof(gap->wideTail));
+      }
+    }
+
+    if (delta > 0)
+    {
+      memmove(ctx->outData + readIdx + delta, ctx->outData + readIdx,
+              endIdx - readIdx);
+
+      BJSON_STATS_ADD(ctx->stats, bytesMoved, endIdx - readIdx);
+    }
+
+    if (i > 1)
+    {
+      delta += ctx->gaps[i - 2].gapSize;
+      delta -= ctx->gaps[i - 2].isWide ? sizeof(ctx->gaps[i - 2].wideTail) : 0;
+    }
+  }
+
+  /*
+   * Keep entries for unsized containers still open. Their gaps are not
+   * known yet.
+   */
+
+  ctx->numGaps = 0;
+
+  for (depth = 0; depth <= ctx->deepIdx; depth++)
+  {
+    if (depth > 0 && !ctx->blocks[depth].isSized)
+    {
+      ctx->gaps[ctx->numGaps].headerIdx = ctx->blocks[depth].idx;
+      ctx->gaps[ctx->numGaps].gapSize   = 0;
+      ctx->gaps[ctx->numGaps].isWide    = 0;
+
+      ctx->blocks[depth].gapIdx = ctx->numGaps;
+      ctx->numGaps++;
+    }
+
+    ctx->blocks[depth].slack = 0;
+  }
+
+  BJSON_DEBUG2("encoder: compacted outData to [%d] bytes", ctx->outDataIdx);
+}
+
+/*
+ * Copy payloads referenced in place into outData, so output is one
+ * contiguous buffer again. Data is moved from the end, so each byte is
+ * moved at most once. Must be called after _compactOutData().
+ */
+
+static void _flattenRefs(bjson_encodeCtx_t *ctx)
+{
+  size_t srcEnd = ctx->outDataIdx;
+  size_t dstEnd = ctx->outDataIdx + ctx->refBytes;
+  size_t shift  = 0;
+  size_t i      = 0;
+  int depth     = 0;
+
+  if (ctx->numRefs == 0)
+  {
+    return;
+  }
+
+  ctx->savepointEpoch++;
+
+  _prepareOutDataBuffer(ctx, ctx->refBytes);
+
+  if (!_isOk(ctx))
+  {
+    return;
+  }
+
+  for (i = ctx->numRefs; i > 0; i--)
+  {
+    bjson_encodeRef_t *ref = &ctx->refs[i - 1];
+
+    size_t segSize = srcEnd - ref->outIdx;
+
+    memmove(ctx->outData + dstEnd - segSize, ctx->outData + ref->outIdx, segSize);
+
+    BJSON_STATS_ADD(ctx->stats, bytesMoved, segSize);
+
+    dstEnd -= segSize;
+
+    memcpy(ctx->outData + dstEnd - ref->bufLen, ref->buf, ref->bufLen);
+
+    dstEnd -= ref->bufLen;
+    srcEnd  = ref->outIdx;
+  }
+
+  /*
+   * Containers still open are shifted by payloads inserted before them.
+   * So are their gap entries recreated by _compactOutData().
+   */
+
+  i = 0;
+
+  for (depth = 1; depth <= ctx->deepIdx; depth++)
+  {
+    while (i < ctx->numRefs && ctx->refs[i].outIdx <= ctx->blocks[depth].idx)
+    {
+      shift += ctx->refs[i].bufLen;
+      i++;
+    }
+
+    ctx->blocks[depth].idx += shift;
+
+    if (!ctx->blocks[depth].isSized && !ctx->isStaticBuffer)
+    {
+      ctx->gaps[ctx->blocks[depth].gapIdx].headerIdx = ctx->blocks[depth].idx;
+    }
+  }
+
+  for (depth = 0; depth <= ctx->deepIdx; depth++)
+  {
+    ctx->blocks[depth].refBytes = 0;
+  }
+
+  ctx->outDataIdx += ctx->refBytes;
+  ctx->numRefs     = 0;
+  ctx->refBytes    = 0;
+
+  BJSON_DEBUG2("encoder: flattened outData to [%d] bytes", ctx->outDataIdx);
+}
+
+/*
+ * Go back to initial state i.e. no open containers, no error and
+ * default encode mode. Allocated buffers are kept for reuse.
+ */
+
+static void _resetState(bjson_encodeCtx_t *ctx)
+{
+  ctx->statusCode = bjson_status_ok;
+  ctx->mode       = bjson_encodeMode_default;
+  ctx->deepIdx    = 0;
+  ctx->numGaps    = 0;
+
+  ctx->blocks[0].slack = 0;
+
+  ctx->numMeasured     = 0;
+  ctx->nextMeasuredIdx = 0;
+  ctx->measuredTotal   = 0;
+
+  ctx->bytesNeeded = 0;
+
+  ctx->savepointEpoch++;
+}
+
+static void _writeToSink(bjson_encodeCtx_t *ctx,
+                         bjson_encoderSink_t sink, void *sinkCtx,
+                         const void *buf, size_t bufLen)
+{
+  if (bufLen > 0 && _isOk(ctx))
+  {
+    if (sink(sinkCtx, buf, bufLen) != 0)
+    {
+      _setErrorState(ctx, bjson_status_error_sinkFailed);
+    }
+  }
+}
+
+/*
+ * Write outData[fromIdx, toIdx) to sink together with payloads
+ * referenced in place inside this range.
+ */
+
+static void _writeRangeToSink(bjson_encodeCtx_t *ctx,
+                              bjson_encoderSink_t sink, void *sinkCtx,
+                              size_t fromIdx, size_t toIdx, size_t *refIdx)
+{
+  while (*refIdx < ctx->numRefs && ctx->refs[*refIdx].outIdx <= toIdx)
+  {
+    bjson_encodeRef_t *ref = &ctx->refs[*refIdx];
+
+    _writeToSink(ctx, sink, sinkCtx, ctx->outData + fromIdx, ref->outIdx - fromIdx);
+    _writeToSink(ctx, sink, sinkCtx, ref->buf, ref->bufLen);
+
+    fromIdx = ref->outIdx;
+
+    (*refIdx)++;
+  }
+
+  _writeToSink(ctx, sink, sinkCtx, ctx->outData + fromIdx, toIdx - fromIdx);
+}
+
+/*
+ * Write final output to sink without moving anything in outData. Gaps
+ * are skipped, split headers are completed and referenced payloads are
+ * written in their places. All containers must be closed.
+ */
+
+static void _writeOutDataToSink(bjson_encodeCtx_t *ctx,
+                                bjson_encoderSink_t sink, void *sinkCtx)
+{
+  size_t readIdx = 0;
+  size_t refIdx  = 0;
+  size_t i       = 0;
+
+  for (i = 0; i < ctx->numGaps; i++)
+  {
+    bjson_encodeGap_t *gap = &ctx->gaps[i];
+
+    size_t placeholderEnd = gap->headerIdx + BJSON_DEFAULT_ARRAY_HEADER_SIZE;
+
+    _writeRangeToSink(ctx, sink, sinkCtx,
+                      readIdx, placeholderEnd - gap->gapSize, &refIdx);
+
+    if (gap->isWide)
+    {
+      _writeToSink(ctx, sink, sinkCtx, gap->wideTail, sizeof(gap->wideTail));
+    }
+
+    readIdx = placeholderEnd;
+  }
+
+  _writeRangeToSink(ctx, sink, sinkCtx, readIdx, ctx->outDataIdx, &refIdx);
+}
+
+/*
+ * Verify write pass repeated measure pass when the last container was
+ * closed.
+ */
+
+static void _verifyWritePass(bjson_encodeCtx_t *ctx)
+{
+  if (ctx->mode == bjson_encodeMode_write &&
+      ctx->deepIdx == 0 &&
+      (ctx->nextMeasuredIdx != ctx->numMeasured ||
+       ctx->outDataIdx + ctx->refBytes != ctx->measuredTotal))
+  {
+    /* Error - write pass differs from measure one. */
+    _setErrorState(ctx, bjson_status_error_measurePassMismatch);
+  }
+}
+
+#if BJSON_STATS_ENABLED > 0
+/*
+ * Size of output encoded so far, as it will be after compaction.
+ * Nothing is written in measure pass or when static buffer is full.
+ */
+
+static size_t _outputSize(bjson_encodeCtx_t *ctx)
+{
+  size_t size = ctx->outDataIdx + ctx->refBytes;
+  int depth   = 0;
+
+  if (_isCountingOnly(ctx))
+  {
+    return 0;
+  }
+
+  for (depth = 0; depth <= ctx->deepIdx; depth++)
+  {
+    size -= ctx->blocks[depth].slack;
+  }
+
+  return size;
+}
+#endif
+
+/*
+ * Pass complete root document to sink (if set) and make outData empty,
+ * so the same space is used by next document. Nothing is moved, gaps
+ * are skipped and referenced payloads are passed to sink directly.
+ */
+
+static void _flushRecord(bjson_encodeCtx_t *ctx)
+{
+  if (ctx->sink &&
+      ctx->deepIdx == 0 &&
+      ctx->mode == bjson_encodeMode_default &&
+      _isOk(ctx))
+  {
+    _writeOutDataToSink(ctx, ctx->sink, ctx->sinkCtx);
+
+    BJSON_DEBUG2("encoder: flushed [%d] bytes to sink",
+                 ctx->outDataIdx + ctx->refBytes);
+
+    BJSON_STATS_ADD(ctx->stats, bytesWritten, _outputSize(ctx));
+
+    ctx->outDataIdx    = 0;
+    ctx->numGaps       = 0;
+    ctx->blocks[0].slack = 0;
+
+    ctx->savepointEpoch++;
+
+    _clearRefs(ctx);
+  }
+}
+
+/*
+ * Value is complete. Switch map between key and value turn and flush
+ * root document if it was the last value.
+ */
+
+static void _endValue(bjson_encodeCtx_t *ctx)
+{
+  _rotateMapTurn(ctx);
+
+  if (ctx->deepIdx == 0)
+  {
+    _flushRecord(ctx);
+  }
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *                                 Public API
+ * ----------------------------------------------------------------------------
+ */
+
+/*
+ * Create new encoder context. All other bjson_encodeXxx() functions
+ * need this context to work.
+ *
+ * memoryFunctions  - optional struct containing pointers to custom
+ *                    malloc/free/realloc functions. Set to NULL if
+ *                    not needed (IN/OPT).
+ *
+ * callerCtx        - optional caller specified context passed to all
+ *                    user memory callbacks. Set to NULL if not
+ *                    needed (IN/OPT).
+ *
+ * WARNING! Returned context *MUST* be freed by caller using
+ *          bjson_encoderDestroy() function.
+ *
+ * RETURNS: Pointer to new allocated encoder context if success,
+ *          NULL if error.
+ */
+
+BJSON_API bjson_encodeCtx_t *bjson_encoderCreate(
+                                 bjson_memoryFunctions_t *memoryFunctions,
+                                 void *callerCtx)
+{
+  bjson_encodeCtx_t *ctx = calloc(sizeof(bjson_encodeCtx_t), 1);
+
+  if (ctx == NULL)
+  {
+    return NULL;
+  }
+
+  ctx->memoryFunctions = memoryFunctions;
+  ctx->callerCtx       = callerCtx;
+
+  ctx->trimCapacity       = SIZE_MAX;
+  ctx->referenceThreshold = SIZE_MAX;
+  ctx->growthPercent      = 100;
+
+  /*
+   * Block stack grows with nesting depth. Root level entry is always
+   * there.
+   */
+
+  ctx->blocks = bjson_malloc(ctx, BJSON_DEFAULT_BLOCKS_CAPACITY
+                                      * sizeof(bjson_encodeBlock_t));
+
+  if (ctx->blocks == NULL)
+  {
+    free(ctx);
+
+    return NULL;
+  }
+
+  memset(ctx->blocks, 0, sizeof(bjson_encodeBlock_t));
+
+  ctx->blocksCapacity = BJSON_DEFAULT_BLOCKS_CAPACITY;
+
+  return ctx;
+}
+
+/*
+ * Create new encoder context writing into caller supplied buffer.
+ * Output buffer is never reallocated.
+ *
+ * TIP#1: If buffer is too small, encode functions return
+ *        bjson_status_error_bufferFull, but encoder goes on counting
+ *        bytes. bjson_encoderGetResult() returns number of bytes needed
+ *        to encode whole document then.
+ *
+ * TIP#2: Use bjson_encoderClear() to encode next document into the same
+ *        buffer with no allocation at all.
+ *
+ * TIP#3: Block stack for BJSON_MAX_DEPTH nested containers is allocated
+ *        here, so encoding never allocates, however deep document is.
+ *
+ * buf      - caller owned buffer, where encoded data is written to. It
+ *            *MUST* be valid until encoder is destroyed (IN).
+ * capacity - size of buf[] buffer in bytes (IN).
+ *
+ * WARNING! Returned context *MUST* be freed by caller using
+ *          bjson_encoderDestroy() function.
+ *
+ * RETURNS: Pointer to new allocated encoder context if success,
+ *          NULL if error.
+ */
+
+BJSON_API bjson_encodeCtx_t *bjson_encoderCreateStatic(void *buf, size_t capacity)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
+
+  if (ctx)
+  {
+    bjson_encodeBlock_t *blocks = bjson_realloc(ctx, ctx->blocks,
+                                                (BJSON_MAX_DEPTH + 2)
+                                                    * sizeof(bjson_encodeBlock_t));
+
+    if (blocks == NULL)
+    {
+      bjson_encoderDestroy(ctx);
+
+      return NULL;
+    }
+
+    ctx->blocks          = blocks;
+    ctx->blocksCapacity  = BJSON_MAX_DEPTH + 2;
+    ctx->outData         = buf;
+    ctx->outDataCapacity = capacity;
+    ctx->isStaticBuffer  = 1;
+  }
+
+  return ctx;
+}
+
+/*
+ * Create new encoder context writing into memory mapped temporary file
+ * instead of heap. Document size is bounded by disk space, not by RAM.
+ * Use bjson_encoderFinish() to write final document into file.
+ *
+ * TIP#1: Temporary file is removed from directory right after it's
+ *        created, so it disappears when encoder is destroyed or process
+ *        dies.
+ *
+ * TIP#2: Available on POSIX systems only. NULL is returned elsewhere.
+ *
+ * tempDir - directory, where temporary file is created. Set to NULL to
+ *           use TMPDIR environment variable or /tmp (IN/OPT).
+ *
+ * WARNING! Returned context *MUST* be freed by caller using
+ *          bjson_encoderDestroy() function.
+ *
+ * RETURNS: Pointer to new allocated encoder context if success,
+ *          NULL if error.
+ */
+
+BJSON_API bjson_encodeCtx_t *bjson_encoderCreateSpill(const char *tempDir)
+{
+  bjson_encodeCtx_t *ctx = NULL;
+
+  #if BJSON_SPILL_SUPPORTED
+  static const char fileNameTemplate[] = "/bjson-spill-XXXXXX";
+
+  char *path = NULL;
+  int fd     = -1;
+
+  if (tempDir == NULL)
+  {
+    tempDir = getenv("TMPDIR");
+  }
+
+  if (tempDir == NULL || tempDir[0] == 0)
+  {
+    tempDir = "/tmp";
+  }
+
+  path = malloc(strlen(tempDir) + sizeof(fileNameTemplate));
+
+  if (path == NULL)
+  {
+    return NULL;
+  }
+
+  strcpy(path, tempDir);
+  strcat(path, fileNameTemplate);
+
+  fd = mkstemp(path);
+
+  if (fd != -1)
+  {
+    unlink(path);
+
+    ctx = bjson_encoderCreate(NULL, NULL);
+
+    if (ctx)
+    {
+      ctx->isSpilled = 1;
+      ctx->spillFd   = fd;
+    }
+    else
+    {
+      close(fd);
+    }
+  }
+
+  BJSON_DEBUG("encoder: spill file '%s', fd [%d]", path, fd);
+
+  free(path);
+  #else
+  (void)tempDir;
+  #endif
+
+  return ctx;
+}
+
+/*
+ * Set up encoder option. See bjson_encoderOption_t for list of available
+ * options and type of value expected for each one.
+ *
+ * ctx    - encoder context created by bjson_encoderCreate() before (IN),
+ * option - option to set (IN),
+ * ...    - new option value (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderConfig(bjson_encodeCtx_t *ctx,
+                                             bjson_encoderOption_t option, ...)
+{
+  bjson_status_t statusCode = bjson_status_ok;
+
+  va_list args;
+  va_start(args, option);
+
+  switch (option)
+  {
+    case bjson_encoderOption_trimCapacity:
+    {
+      ctx->trimCapacity = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_encoderOption_compactNumbers:
+    {
+      ctx->compactNumbers = va_arg(args, int);
+
+      break;
+    }
+
+    case bjson_encoderOption_validateRaw:
+    {
+      ctx->validateRaw = va_arg(args, int);
+
+      break;
+    }
+
+    case bjson_encoderOption_referenceThreshold:
+    {
+      ctx->referenceThreshold = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_encoderOption_initialCapacity:
+    {
+      ctx->initialCapacity = va_arg(args, size_t);
+
+      break;
+    }
+
+    case bjson_encoderOption_growthPercent:
+    {
+      ctx->growthPercent = va_arg(args, size_t);
+      ctx->growthPercent = MAX(ctx->growthPercent, BJSON_MIN_GROWTH_PERCENT);
+
+      break;
+    }
+
+    default:
+    {
+      statusCode = bjson_status_error_unknownOption;
+    }
+  }
+
+  va_end(args);
+
+  return statusCode;
+}
+
+/*
+ * Free encoder context.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ */
+
+BJSON_API void bjson_encoderDestroy(bjson_encodeCtx_t *ctx)
+{
+  if (ctx)
+  {
+    if (ctx->isSpilled)
+    {
+      #if BJSON_SPILL_SUPPORTED
+      if (ctx->outData)
+      {
+        munmap(ctx->outData, ctx->outDataCapacity);
+      }
+
+      close(ctx->spillFd);
+      #endif
+    }
+    else if (ctx->outData && !ctx->isStaticBuffer)
+    {
+      bjson_free(ctx, ctx->outData);
+    }
+
+    if (ctx->gaps)
+    {
+      bjson_free(ctx, ctx->gaps);
+    }
+
+    bjson_free(ctx, ctx->blocks);
+
+    if (ctx->measuredSizes)
+    {
+      bjson_free(ctx, ctx->measuredSizes);
+    }
+
+    if (ctx->templateSizes)
+    {
+      bjson_free(ctx, ctx->templateSizes);
+    }
+
+    if (ctx->refs)
+    {
+      bjson_free(ctx, ctx->refs);
+    }
+
+    if (ctx->chunks)
+    {
+      bjson_free(ctx, ctx->chunks);
+    }
+
+    free(ctx);
+  }
+}
+
+/*
+ * Get pointer to output buffer containing encoded raw BJSON bytes.
+ *
+ * TIP#1: This call returns pointer to internal allocated buffer.
+ *        Caller *MUST NOT* free it by own.
+ *
+ * TIP#2: Output buffer is freed when bjson_encoderDestroy() is called.
+ *
+ * TIP#3: In measure pass nothing is written. NULL buffer and number of
+ *        bytes measured so far are returned.
+ *
+ * TIP#4: If static buffer is full, NULL buffer and number of bytes needed
+ *        are returned together with bjson_status_error_bufferFull.
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN),
+ * buf     - pointer to internal buffer containing encoded BJSON data (OUT).
+ * bufSize - number of bytes stored in returned buf[] buffer (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderGetResult(bjson_encodeCtx_t *ctx,
+                                                void **buf, size_t *bufSize)
+{
+  if (ctx->statusCode == bjson_status_error_bufferFull)
+  {
+    *buf     = NULL;
+    *bufSize = ctx->bytesNeeded;
+  }
+  else if (_isOk(ctx) && ctx->mode == bjson_encodeMode_measure)
+  {
+    *buf     = NULL;
+    *bufSize = ctx->outDataIdx;
+  }
+  else if (_isOk(ctx))
+  {
+    _verifyWritePass(ctx);
+
+    if (_isOk(ctx))
+    {
+      _compactOutData(ctx);
+      _flattenRefs(ctx);
+
+      *buf     = ctx->outData;
+      *bufSize = ctx->outDataIdx;
+    }
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Hand output buffer over to caller and go back to initial state, so the
+ * same context can be used to encode next document.
+ *
+ * TIP#1: Unlike bjson_encoderGetResult(), returned buffer is owned by
+ *        caller and stays valid after bjson_encoderDestroy(). It *MUST*
+ *        be freed by bjson_encoderFreeResult() (or by free() function
+ *        from memoryFunctions passed to bjson_encoderCreate()).
+ *
+ * TIP#2: Nothing is copied. Next document is encoded into new allocated
+ *        buffer. Encoder created by bjson_encoderCreateStatic() can't give
+ *        away caller's buffer, so data is copied into new allocated one.
+ *        So is data of encoder created by bjson_encoderCreateSpill().
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN),
+ * buf     - pointer to encoded BJSON data (OUT),
+ * bufSize - size of encoded BJSON data in bytes (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderDetachResult(bjson_encodeCtx_t *ctx,
+                                                   void **buf, size_t *bufSize)
+{
+  void  *data     = NULL;
+  size_t dataSize = 0;
+
+  *buf     = NULL;
+  *bufSize = 0;
+
+  if (bjson_encoderGetResult(ctx, &data, &dataSize) != bjson_status_ok ||
+      data == NULL)
+  {
+    return ctx->statusCode;
+  }
+
+  if (ctx->isStaticBuffer || ctx->isSpilled)
+  {
+    void *dataCopy = bjson_malloc(ctx, dataSize);
+
+    if (dataCopy == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return ctx->statusCode;
+    }
+
+    memcpy(dataCopy, data, dataSize);
+
+    data = dataCopy;
+  }
+  else
+  {
+    ctx->outData         = NULL;
+    ctx->outDataCapacity = 0;
+  }
+
+  BJSON_STATS_ADD(ctx->stats, bytesWritten, dataSize);
+
+  _resetState(ctx);
+
+  ctx->outDataIdx = 0;
+
+  *buf     = data;
+  *bufSize = dataSize;
+
+  BJSON_DEBUG2("encoder: detached [%d] bytes of output", dataSize);
+
+  return bjson_status_ok;
+}
+
+/*
+ * Free buffer returned by bjson_encoderDetachResult() before.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ * buf - pointer returned by bjson_encoderDetachResult() (IN).
+ */
+
+BJSON_API void bjson_encoderFreeResult(bjson_encodeCtx_t *ctx, void *buf)
+{
+  bjson_free(ctx, buf);
+}
+
+/*
+ * Get encoded BJSON as list of chunks ready for writev()/sendmsg().
+ * Chunks point to internal buffer (headers and small values) and to
+ * payloads referenced in place (see bjson_encoderOption_referenceThreshold),
+ * so nothing is copied.
+ *
+ * TIP#1: Returned list and chunks pointing to internal buffer are valid
+ *        until next call on the same encoder context.
+ *
+ * TIP#2: Without referenced payloads there is exactly one chunk, the same
+ *        as returned by bjson_encoderGetResult().
+ *
+ * ctx       - encoder context created by bjson_encoderCreate() before (IN),
+ * chunks    - list of chunks to write in order (OUT),
+ * numChunks - number of items in chunks[] list (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderGetChunks(bjson_encodeCtx_t *ctx,
+                                                const bjson_encoderChunk_t **chunks,
+                                                size_t *numChunks)
+{
+  size_t numNeeded = ctx->numRefs * 2 + 1;
+  size_t readIdx   = 0;
+  size_t i         = 0;
+
+  *chunks    = NULL;
+  *numChunks = 0;
+
+  if (ctx->numRefs == 0 || !_isOk(ctx) || ctx->mode == bjson_encodeMode_measure)
+  {
+    /*
+     * Nothing referenced. Whole output is one buffer.
+     */
+
+    void *buf      = NULL;
+    size_t bufSize = 0;
+
+    if (bjson_encoderGetResult(ctx, &buf, &bufSize) != bjson_status_ok ||
+        buf == NULL || bufSize == 0)
+    {
+      return ctx->statusCode;
+    }
+
+    numNeeded = 1;
+  }
+
+  if (ctx->chunksCapacity < numNeeded)
+  {
+    bjson_encoderChunk_t *newChunks = bjson_realloc(ctx, ctx->chunks,
+                                                    numNeeded * sizeof(bjson_encoderChunk_t));
+
+    if (newChunks == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return ctx->statusCode;
+    }
+
+    ctx->chunks         = newChunks;
+    ctx->chunksCapacity = numNeeded;
+  }
+
+  _verifyWritePass(ctx);
+
+  if (_isOk(ctx))
+  {
+    _compactOutData(ctx);
+  }
+
+  if (!_isOk(ctx))
+  {
+    return ctx->statusCode;
+  }
+
+  /*
+   * Interleave pieces of outData with referenced payloads. Skip empty
+   * pieces e.g. between two payloads.
+   */
+
+  for (i = 0; i < ctx->numRefs; i++)
+  {
+    bjson_encodeRef_t *ref = &ctx->refs[i];
+
+    if (ref->outIdx > readIdx)
+    {
+      ctx->chunks[*numChunks].buf    = ctx->outData + readIdx;
+      ctx->chunks[*numChunks].bufLen = ref->outIdx - readIdx;
+
+      (*numChunks)++;
+    }
+
+    if (ref->bufLen > 0)
+    {
+      ctx->chunks[*numChunks].buf    = ref->buf;
+      ctx->chunks[*numChunks].bufLen = ref->bufLen;
+
+      (*numChunks)++;
+    }
+
+    readIdx = ref->outIdx;
+  }
+
+  if (ctx->outDataIdx > readIdx)
+  {
+    ctx->chunks[*numChunks].buf    = ctx->outData + readIdx;
+    ctx->chunks[*numChunks].bufLen = ctx->outDataIdx - readIdx;
+
+    (*numChunks)++;
+  }
+
+  *chunks = ctx->chunks;
+
+  return ctx->statusCode;
+}
+
+/*
+ * Sink writing into FILE passed as sink context.
+ */
+
+static int _writeToFile(void *sinkCtx, const void *buf, size_t bufLen)
+{
+  return (fwrite(buf, 1, bufLen, (FILE *) sinkCtx) == bufLen) ? 0 : -1;
+}
+
+/*
+ * Finish document and write it into file. Output is written straight
+ * from encoder buffer, header gaps are skipped on the fly, so nothing is
+ * moved. Works with containers over 4GB too.
+ *
+ * TIP#1: It's the way to get output of encoder created by
+ *        bjson_encoderCreateSpill(), but works with any encoder.
+ *
+ * TIP#2: Encoded data is kept. Use bjson_encoderClear() to encode next
+ *        document.
+ *
+ * ctx      - encoder context created by bjson_encoderCreate() before (IN),
+ * fileName - path to output file. File is truncated if exists (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderFinish(bjson_encodeCtx_t *ctx,
+                                             const char *fileName)
+{
+  FILE *file = NULL;
+
+  if (!_isOk(ctx))
+  {
+    return ctx->statusCode;
+  }
+
+  if (ctx->mode == bjson_encodeMode_measure)
+  {
+    /* Error - nothing is written in measure pass. */
+    _setErrorState(ctx, bjson_status_error_measurePassMismatch);
+  }
+  else if (ctx->deepIdx > 0)
+  {
+    /* Error - document not finished. */
+    if (_isStreamOpen(ctx))
+    {
+      _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+    }
+    else if (_isMapOpen(ctx))
+    {
+      _setErrorState(ctx, bjson_status_error_unclosedMap);
+    }
+    else
+    {
+      _setErrorState(ctx, bjson_status_error_unclosedArray);
+    }
+  }
+  else
+  {
+    _verifyWritePass(ctx);
+  }
+
+  if (!_isOk(ctx))
+  {
+    return ctx->statusCode;
+  }
+
+  file = fopen(fileName, "wb");
+
+  if (file == NULL)
+  {
+    _setErrorState(ctx, bjson_status_error_sinkFailed);
+
+    return ctx->statusCode;
+  }
+
+  _writeOutDataToSink(ctx, _writeToFile, file);
+
+  if (fclose(file) != 0 && _isOk(ctx))
+  {
+    _setErrorState(ctx, bjson_status_error_sinkFailed);
+  }
+
+  BJSON_DEBUG("encoder: finished [%d] bytes into '%s'",
+              ctx->outDataIdx + ctx->refBytes, fileName);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Start measure pass. Current output (if any) is discarded.
+ * All next bjson_encodeXxx() calls write nothing, but only measure body
+ * size of each container and total output size.
+ *
+ * TIP: Typical usage looks like:
+ *
+ *      bjson_encoderBeginMeasure(ctx)
+ *        bjson_encodeXxx(ctx, ...)
+ *        ...
+ *      bjson_encoderBeginWrite(ctx, &totalSize)
+ *        bjson_encodeXxx(ctx, ...)   <- the same sequence once again
+ *        ...
+ *      bjson_encoderGetResult(ctx, &buf, &bufSize)
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderBeginMeasure(bjson_encodeCtx_t *ctx)
+{
+  if (_isOk(ctx))
+  {
+    ctx->mode            = bjson_encodeMode_measure;
+    ctx->outDataIdx      = 0;
+    ctx->deepIdx         = 0;
+    ctx->numGaps         = 0;
+    ctx->numMeasured     = 0;
+    ctx->nextMeasuredIdx = 0;
+    ctx->blocks[0].slack   = 0;
+
+    _clearRefs(ctx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Finish measure pass and start write pass. Output buffer is allocated
+ * once with exact size. Caller *MUST* repeat the same sequence of
+ * bjson_encodeXxx() calls as in measure pass. Container headers are
+ * written with final sizes, so no data is moved.
+ *
+ * ctx       - encoder context created by bjson_encoderCreate() before (IN),
+ * totalSize - total size of encoded BJSON in bytes. Set to NULL if not
+ *             needed (OUT/OPT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderBeginWrite(bjson_encodeCtx_t *ctx,
+                                                 size_t *totalSize)
+{
+  if (!_isOk(ctx))
+  {
+    return ctx->statusCode;
+  }
+
+  if (ctx->mode != bjson_encodeMode_measure)
+  {
+    /* Error - write pass without measure pass. */
+    _setErrorState(ctx, bjson_status_error_measurePassMismatch);
+  }
+  else if (ctx->deepIdx > 0)
+  {
+    /* Error - measure pass not finished. */
+    if (_isStreamOpen(ctx))
+    {
+      _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+    }
+    else if (_isMapOpen(ctx))
+    {
+      _setErrorState(ctx, bjson_status_error_unclosedMap);
+    }
+    else
+    {
+      _setErrorState(ctx, bjson_status_error_unclosedArray);
+    }
+  }
+  else
+  {
+    ctx->measuredTotal = ctx->outDataIdx;
+
+    if (ctx->isStaticBuffer && ctx->outDataCapacity < ctx->measuredTotal)
+    {
+      /*
+       * Static buffer too small. Go on counting, so calls sequence is
+       * still verified.
+       */
+
+      _setErrorState(ctx, bjson_status_error_bufferFull);
+
+      ctx->bytesNeeded = ctx->measuredTotal;
+    }
+    else if (ctx->outDataCapacity < ctx->measuredTotal)
+    {
+      /*
+       * Allocate output buffer with exact size.
+       */
+
+      _resizeOutData(ctx, ctx->measuredTotal);
+
+      if (!_isOk(ctx))
+      {
+        return ctx->statusCode;
+      }
+    }
+
+    ctx->mode            = bjson_encodeMode_write;
+    ctx->outDataIdx      = 0;
+    ctx->nextMeasuredIdx = 0;
+    ctx->blocks[0].slack   = 0;
+
+    _clearRefs(ctx);
+
+    if (totalSize)
+    {
+      *totalSize = ctx->measuredTotal;
+    }
+
+    BJSON_DEBUG("encoder: measured [%u] bytes in [%u] containers",
+                ctx->measuredTotal, ctx->numMeasured);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Make room for at least given number of bytes more, so they're encoded
+ * without any realloc. Useful when approximate output size is known up
+ * front e.g. from previous run.
+ *
+ * TIP#1: Call it after bjson_encoderClear() to reserve space for whole
+ *        next document. Use bjson_encoderOption_initialCapacity option
+ *        to reserve it for the first document without extra call.
+ *
+ * TIP#2: Static buffer is never reallocated, so it's no-op for encoder
+ *        created by bjson_encoderCreateStatic(). So it is in measure pass.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN),
+ * bytes - number of bytes to be encoded from current position (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderReserve(bjson_encodeCtx_t *ctx,
+                                              size_t bytes)
+{
+  if (_isOk(ctx) &&
+      !ctx->isStaticBuffer &&
+      ctx->mode != bjson_encodeMode_measure &&
+      ctx->outDataCapacity - ctx->outDataIdx < bytes)
+  {
+    _resizeOutData(ctx, ctx->outDataIdx + bytes);
+
+    BJSON_DEBUG("encoder: reserved [%u] bytes, capacity [%u]",
+                bytes, ctx->outDataCapacity);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Shrink output buffer to size of data encoded so far. Unused capacity
+ * left by buffer growth is given back.
+ *
+ * TIP: Encoding may go on after shrink, but next write will grow buffer
+ *      again. Call it when document is finished, but output is kept for
+ *      longer time e.g. by bjson_encoderDetachResult().
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderShrinkToFit(bjson_encodeCtx_t *ctx)
+{
+  if (!_isOk(ctx) || ctx->isStaticBuffer ||
+      ctx->outDataCapacity == ctx->outDataIdx)
+  {
+    return ctx->statusCode;
+  }
+
+  if (ctx->outDataIdx > 0)
+  {
+    _resizeOutData(ctx, ctx->outDataIdx);
+  }
+  else if (!ctx->isSpilled)
+  {
+    /*
+     * Nothing encoded yet - free buffer at all. Spill file can't be
+     * mapped with zero size, so it's kept.
+     */
+
+    bjson_free(ctx, ctx->outData);
+
+    ctx->outData         = NULL;
+    ctx->outDataCapacity = 0;
+  }
+
+  BJSON_DEBUG("encoder: shrunk outData buffer to [%u] bytes",
+              ctx->outDataCapacity);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Discard encoded data and go back to initial state, so the same context
+ * can be used to encode next document. Error state is cleared too.
+ *
+ * TIP: Output buffer is *NOT* freed, so next document is encoded without
+ *      any allocation. Buffer is shrunk only if it grew over limit set by
+ *      bjson_encoderOption_trimCapacity option.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderClear(bjson_encodeCtx_t *ctx)
+{
+  BJSON_STATS_ADD(ctx->stats, bytesWritten, _outputSize(ctx));
+
+  _resetState(ctx);
+  _clearRefs(ctx);
+
+  ctx->outDataIdx = 0;
+
+  if (ctx->outDataCapacity > ctx->trimCapacity &&
+      !ctx->isStaticBuffer &&
+      !ctx->isSpilled)
+  {
+    if (ctx->trimCapacity == 0)
+    {
+      bjson_free(ctx, ctx->outData);
+
+      ctx->outData         = NULL;
+      ctx->outDataCapacity = 0;
+    }
+    else
+    {
+      uint8_t *newOutData = bjson_realloc(ctx, ctx->outData, ctx->trimCapacity);
+
+      if (newOutData)
+      {
+        ctx->outData         = newOutData;
+        ctx->outDataCapacity = ctx->trimCapacity;
+      }
+    }
+
+    BJSON_DEBUG2("encoder: trimmed outData buffer to [%d] bytes",
+                 ctx->outDataCapacity);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Finish current document and go back to initial state. Already encoded
+ * data is kept, next document is appended after optional separator.
+ * Error state is cleared too.
+ *
+ * TIP#1: If encoder was in error state, encoded data may be inconsistent,
+ *        so it's discarded.
+ *
+ * TIP#2: All containers and streamed values must be closed before.
+ *        Otherwise reset is rejected and nothing is changed, so caller
+ *        can still finish document and reset once again.
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN),
+ * sepText - optional raw bytes put between documents. Set to NULL if
+ *           not needed (IN/OPT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_unclosedMap, bjson_status_error_unclosedArray
+ *          or bjson_status_error_streamedValueOpen if document is not
+ *          finished,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderReset(bjson_encodeCtx_t *ctx,
+                                            const char *sepText)
+{
+  if (_isOk(ctx) && ctx->deepIdx > 0)
+  {
+    /* Error - document not finished. Keep it untouched. */
+    if (_isStreamOpen(ctx))
+    {
+      return bjson_status_error_streamedValueOpen;
+    }
+
+    return _isMapOpen(ctx) ? bjson_status_error_unclosedMap
+                           : bjson_status_error_unclosedArray;
+  }
+
+  if (_isOk(ctx) && ctx->mode != bjson_encodeMode_measure)
+  {
+    _compactOutData(ctx);
+  }
+  else
+  {
+    ctx->outDataIdx = 0;
+
+    _clearRefs(ctx);
+  }
+
+  _resetState(ctx);
+
+  if (sepText)
+  {
+    _putRaw_BLOB(ctx, sepText, strlen(sepText));
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Pass each root document to caller sink as soon as it's complete
+ * instead of keeping it in output buffer. Output buffer is reused for
+ * next document, so it grows only up to the biggest single document.
+ *
+ * TIP#1: Many root documents can be encoded one after another. Use
+ *        bjson_encoderReset() to put separator between them.
+ *
+ * TIP#2: Works in default (one pass) mode only. In measure and write
+ *        passes output stays in buffer as usual.
+ *
+ * TIP#3: Payloads referenced in place (see
+ *        bjson_encoderOption_referenceThreshold) are passed to sink
+ *        directly, without copying them into output buffer.
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN),
+ * sink    - function called with each piece of encoded output or NULL to
+ *           keep output in buffer again (IN/OPT),
+ * sinkCtx - optional caller context passed to sink. Set to NULL if not
+ *           needed (IN/OPT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderSetSink(bjson_encodeCtx_t *ctx,
+                                              bjson_encoderSink_t sink,
+                                              void *sinkCtx)
+{
+  ctx->sink    = sink;
+  ctx->sinkCtx = sinkCtx;
+
+  return ctx->statusCode;
+}
+
+/*
+ * Remember current encoder state, so everything encoded after it can be
+ * dropped later by bjson_encoderRollback(). Nothing is copied, so it's
+ * cheap to take savepoint before each sub-object, which may turn out to
+ * be skipped or replaced.
+ *
+ * TIP#1: Containers open after savepoint may be still open at rollback,
+ *        they're discarded too.
+ *
+ * TIP#2: Savepoint is no longer valid when container open before it
+ *        was closed, or output was compacted, flushed to sink or
+ *        cleared (e.g. bjson_encoderGetResult(), root document passed
+ *        to sink, bjson_encoderClear()).
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ * sp  - encoder state to be restored by bjson_encoderRollback() (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderSavepoint(bjson_encodeCtx_t *ctx,
+                                                bjson_encoderSavepoint_t *sp)
+{
+  if (_canGoOn(ctx))
+  {
+    int deepIdx = ctx->deepIdx;
+
+    sp->statusCode      = ctx->statusCode;
+    sp->mode            = ctx->mode;
+    sp->epoch           = ctx->savepointEpoch;
+    sp->outDataIdx      = ctx->outDataIdx;
+    sp->bytesNeeded     = ctx->bytesNeeded;
+    sp->deepIdx         = deepIdx;
+    sp->blockIdx        = ctx->blocks[deepIdx].idx;
+    sp->blockMapTurn    = ctx->blocks[deepIdx].mapTurn;
+    sp->blockSlack      = ctx->blocks[deepIdx].slack;
+    sp->numGaps         = ctx->numGaps;
+    sp->numRefs         = ctx->numRefs;
+    sp->refBytes        = ctx->refBytes;
+    sp->blockRefBytes   = ctx->blocks[deepIdx].refBytes;
+    sp->numMeasured     = ctx->numMeasured;
+    sp->nextMeasuredIdx = ctx->nextMeasuredIdx;
+
+    BJSON_DEBUG("encoder: savepoint at deep [%d], dataIdx [%d]",
+                deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Drop everything encoded after savepoint taken by
+ * bjson_encoderSavepoint() before. Output position, nesting and map
+ * key/value turn are restored, so encoding goes on as if calls made
+ * after savepoint never happened.
+ *
+ * TIP: Errors set after savepoint (e.g. bjson_status_error_bufferFull
+ *      or bjson_status_error_invalidObjectKey) are dropped too.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ * sp  - savepoint filled by bjson_encoderSavepoint() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_invalidSavepoint if savepoint is no longer
+ *          valid (see bjson_encoderSavepoint()),
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encoderRollback(bjson_encodeCtx_t *ctx,
+                                               const bjson_encoderSavepoint_t *sp)
+{
+  if (sp->epoch != ctx->savepointEpoch ||
+      sp->mode != (int) ctx->mode ||
+      sp->deepIdx > ctx->deepIdx ||
+      sp->blockIdx != ctx->blocks[sp->deepIdx].idx ||
+      sp->outDataIdx > ctx->outDataIdx)
+  {
+    /* Error - data before savepoint was moved or container closed. */
+    _setErrorState(ctx, bjson_status_error_invalidSavepoint);
+  }
+  else
+  {
+    int deepIdx = sp->deepIdx;
+
+    ctx->statusCode      = sp->statusCode;
+    ctx->outDataIdx      = sp->outDataIdx;
+    ctx->bytesNeeded     = sp->bytesNeeded;
+    ctx->deepIdx         = deepIdx;
+    ctx->numGaps         = sp->numGaps;
+    ctx->numRefs         = sp->numRefs;
+    ctx->refBytes        = sp->refBytes;
+    ctx->numMeasured     = sp->numMeasured;
+    ctx->nextMeasuredIdx = sp->nextMeasuredIdx;
+
+    ctx->blocks[deepIdx].mapTurn  = sp->blockMapTurn;
+    ctx->blocks[deepIdx].slack    = sp->blockSlack;
+    ctx->blocks[deepIdx].refBytes = sp->blockRefBytes;
+
+    BJSON_DEBUG("encoder: rolled back to deep [%d], dataIdx [%d]",
+                deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push null value into output BJSON stream.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeNull(bjson_encodeCtx_t *ctx)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _putRaw_BYTE(ctx, BJSON_DATATYPE_NULL);
+    _countTokens(ctx, &ctx->stats.numNulls, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded null, deep [%d], dataIdx [%d]",
+                ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push boolean value into output BJSON stream.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN).
+ * value - set 1 to encode true value, 0 otherwise (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeBool(bjson_encodeCtx_t *ctx, int value)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    uint8_t dataType = value ? BJSON_DATATYPE_STRICT_TRUE : BJSON_DATATYPE_STRICT_FALSE;
+
+    _putRaw_BYTE(ctx, dataType);
+    _countTokens(ctx, &ctx->stats.numBools, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded bool (%d), deep [%d], dataIdx [%d]",
+                value, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push integer value into output BJSON stream.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN),
+ * value - integer value to be encoded e.g. 1234 (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeInteger(bjson_encodeCtx_t *ctx,
+                                             int64_t value)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    if (value == 0)
+    {
+      /*
+       * Strict integer zero.
+       */
+
+      _putRaw_BYTE(ctx, BJSON_DATATYPE_STRICT_INTEGER_ZERO);
+
+      BJSON_DEBUG("encoder: encoded integer zero, deep [%d], dataIdx [%d]",
+                  ctx->deepIdx, ctx->outDataIdx);
+    }
+    else if (value == 1)
+    {
+      /*
+       * Strict integer one.
+       */
+
+      _putRaw_BYTE(ctx, BJSON_DATATYPE_STRICT_INTEGER_ONE);
+
+      BJSON_DEBUG("encoder: encoded integer one, deep [%d], dataIdx [%d]",
+                  ctx->deepIdx, ctx->outDataIdx);
+    }
+    else if (value < 0)
+    {
+      /*
+       * Negative integer.
+       */
+
+      _putSizedDataType(ctx, BJSON_DATATYPE_NEGATIVE_INTEGER_BASE,
+                        0 - (uint64_t) value, NULL, 0);
+
+      BJSON_DEBUG("encoder: encoded negative integer (%lld), deep [%d], dataIdx [%d]",
+                  value, ctx->deepIdx, ctx->outDataIdx);
+    }
+    else
+    {
+      /*
+       * Positive integer.
+       */
+
+      _putSizedDataType(ctx, BJSON_DATATYPE_POSITIVE_INTEGER_BASE, value, NULL, 0);
+
+      BJSON_DEBUG("encoder: encoded positive integer (%lld), deep [%d], dataIdx [%d]",
+                  value, ctx->deepIdx, ctx->outDataIdx);
+    }
+
+    _countTokens(ctx, &ctx->stats.numIntegers, 1);
+    _endValue(ctx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push double precision number into output BJSON stream.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN).
+ * value - number to be encoded e.g. 3.14 (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeDouble(bjson_encodeCtx_t *ctx, double value)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    bjson_encodeDoubleForm_t form = _doubleFormOf(value, ctx->compactNumbers);
+
+    size_t size = _doubleSize(value, form);
+
+    uint8_t *out = _reserveOutData(ctx, size);
+
+    if (out)
+    {
+      ctx->outDataIdx += _writeDouble(out, ctx->outDataCapacity - ctx->outDataIdx,
+                                      value, form);
+    }
+    else
+    {
+      _countOutData(ctx, size);
+    }
+
+    _countTokens(ctx, &ctx->stats.numDoubles, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded double (%lf), deep [%d], dataIdx [%d]",
+                value, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push single precision number into output BJSON stream.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN).
+ * value - number to be encoded e.g. 3.14 (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeFloat(bjson_encodeCtx_t *ctx, float value)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    uint8_t *out = _reserveOutData(ctx, 1 + sizeof(value));
+
+    if (out)
+    {
+      ctx->outDataIdx += _writeFloat32(out, value);
+    }
+    else
+    {
+      _countOutData(ctx, 1 + sizeof(value));
+    }
+
+    _countTokens(ctx, &ctx->stats.numDoubles, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded float (%f), deep [%d], dataIdx [%d]",
+                value, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Not implemented. Reserved for the future use.
+ */
+
+BJSON_API bjson_status_t bjson_encodeNumberFromText(bjson_encodeCtx_t *ctx,
+                                                    const char *text,
+                                                    size_t textLen)
+{
+  /* Mark unused params */
+  (void)text;
+  (void)textLen;
+
+  _setErrorState(ctx, bjson_status_error_notImplemented);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push utf8 string into output BJSON stream.
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * text    - buffer containing text to be encoded. Zero byte terminator
+ *           is *NOT* neccesery. (IN).
+ *
+ * textLen - number of bytes stored in text[] buffer *WITHOUT* zero terminator
+ *           if exists (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeString(bjson_encodeCtx_t *ctx,
+                                            const char *text,
+                                            size_t textLen)
+{
+  if (_canGoOn(ctx) && _isStreamOpen(ctx))
+  {
+    _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+  }
+
+  if (_canGoOn(ctx))
+  {
+    if (textLen == 0)
+    {
+      /*
+       * Special case - empty string.
+       */
+
+      _putRaw_BYTE(ctx, BJSON_DATATYPE_EMPTY_STRING);
+
+      BJSON_DEBUG("encoder: encoded empty string, deep [%d], dataIdx [%d]",
+                  ctx->deepIdx, ctx->outDataIdx);
+    }
+    else
+    {
+      /*
+       * String header: DATATYPE_STRINGxx <byte-size> followed by
+       * string body (utf8 *WITHOUT* zero terminator).
+       */
+
+      BJSON_DEBUG3("encoder: going to put [%d] bytes of utf8 string at offset [%d]",
+                   textLen, ctx->outDataIdx);
+
+      if (_isReferenced(ctx, textLen))
+      {
+        _putSizedDataType(ctx, BJSON_DATATYPE_STRING_BASE, textLen, NULL, 0);
+        _putRef(ctx, text, textLen);
+      }
+      else
+      {
+        _putSizedDataType(ctx, BJSON_DATATYPE_STRING_BASE, textLen, text, textLen);
+      }
+
+      /*
+       * Log encode event.
+       */
+
+      BJSON_DEBUG("encoder: encoded %s '%.*s', deep [%d], dataIdx [%d]",
+                  _isKeyTurn(ctx) ? "key" : "string",
+                  textLen, text,
+                  ctx->deepIdx,
+                  ctx->outDataIdx);
+    }
+
+    _countTokens(ctx, _isKeyTurn(ctx) ? &ctx->stats.numKeys
+                                      : &ctx->stats.numStrings, 1);
+    _endValue(ctx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push C-style (ASCIIZ, zero terminated) string into output BJSON stream.
+ *
+ * ctx  - encoder context created by bjson_encoderCreate() before (IN).
+ * text - buffer containing null terminated text to be encoded (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeCString(bjson_encodeCtx_t *ctx,
+                                             const char *text)
+{
+  return bjson_encodeString(ctx, text, strlen(text));
+}
+
+/*
+ * Encode map key once, so it can be put into output by plain copy.
+ *
+ * text            - buffer containing key text. Zero byte terminator is
+ *                   *NOT* neccesery (IN),
+ *
+ * textLen         - number of bytes stored in text[] buffer *WITHOUT*
+ *                   zero terminator if exists (IN),
+ *
+ * memoryFunctions - custom malloc/free functions to allocate key. Set to
+ *                   NULL to use default system functions (IN/OPT).
+ *
+ * callerCtx       - caller defined context passed to memory functions
+ *                   (IN/OPT).
+ *
+ * WARNING! Returned key *MUST* be freed by caller using bjson_keyFree()
+ *          function.
+ *
+ * RETURNS: Pointer to new allocated prepared key if success,
+ *          NULL if error.
+ */
+
+BJSON_API bjson_preparedKey_t *bjson_keyPrepare(
+                                   const char *text,
+                                   size_t textLen,
+                                   bjson_memoryFunctions_t *memoryFunctions,
+                                   void *callerCtx)
+{
+  size_t headerSize = 1;
+  size_t keySize    = 0;
+
+  bjson_preparedKey_t *key = NULL;
+
+  if (textLen > 0)
+  {
+    headerSize = _sizedDataTypeHeaderSize(textLen);
+  }
+
+  keySize = sizeof(bjson_preparedKey_t) + headerSize + textLen;
+
+  if (memoryFunctions)
+  {
+    key = memoryFunctions->malloc(callerCtx, keySize);
+  }
+  else
+  {
+    key = malloc(keySize);
+  }
+
+  if (key == NULL)
+  {
+    return NULL;
+  }
+
+  key->memoryFunctions = memoryFunctions;
+  key->callerCtx       = callerCtx;
+  key->size            = headerSize + textLen;
+
+  if (textLen == 0)
+  {
+    key->data[0] = BJSON_DATATYPE_EMPTY_STRING;
+  }
+  else
+  {
+    _writeSizedDataType(key->data, headerSize, BJSON_DATATYPE_STRING_BASE,
+                        _dataSizeOf(textLen), textLen);
+
+    memcpy(key->data + headerSize, text, textLen);
+  }
+
+  return key;
+}
+
+/*
+ * Free key created by bjson_keyPrepare() before. Key is freed by the
+ * same memory functions it was allocated with.
+ *
+ * key - prepared key returned by bjson_keyPrepare() (IN/OPT).
+ */
+
+BJSON_API void bjson_keyFree(bjson_preparedKey_t *key)
+{
+  if (key && key->memoryFunctions)
+  {
+    key->memoryFunctions->free(key->callerCtx, key);
+  }
+  else
+  {
+    free(key);
+  }
+}
+
+/*
+ * Push map key prepared by bjson_keyPrepare() into output BJSON stream.
+ * It's the same as bjson_encodeString() with the same text, but encoded
+ * bytes are just copied.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN),
+ * key - prepared key returned by bjson_keyPrepare(). NULL is reported as
+ *       out of memory error (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_keyNotExpected if not in key position,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeKeyPrepared(bjson_encodeCtx_t *ctx,
+                                                 const bjson_preparedKey_t *key)
+{
+  if (_canGoOn(ctx))
+  {
+    if (_isStreamOpen(ctx))
+    {
+      /* Error - streamed string/binary must be ended first. */
+      _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+    }
+    else if (key == NULL)
+    {
+      /* Error - bjson_keyPrepare() failed before. */
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+    }
+    else if (!_isKeyTurn(ctx))
+    {
+      /* Error - value or array item expected. */
+      _setErrorState(ctx, bjson_status_error_keyNotExpected);
+    }
+    else
+    {
+      _putRaw_BLOB(ctx, key->data, key->size);
+      _countTokens(ctx, &ctx->stats.numKeys, 1);
+      _endValue(ctx);
+
+      BJSON_DEBUG("encoder: encoded prepared key of [%u] bytes, deep [%d], dataIdx [%d]",
+                  key->size, ctx->deepIdx, ctx->outDataIdx);
+    }
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Splice complete, pre-encoded BJSON value into output BJSON stream as
+ * next array item or map value. Bytes are copied as is, so it's the
+ * cheapest way to embed value encoded before e.g. by another encoder.
+ *
+ * TIP: Data is not checked unless bjson_encoderOption_validateRaw is set.
+ *      Splicing broken data without it produces broken output.
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN),
+ * bytes - complete BJSON value (IN),
+ * len   - number of bytes stored in bytes[] buffer (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeRaw(bjson_encodeCtx_t *ctx,
+                                         const void *bytes,
+                                         size_t len)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx) && ctx->validateRaw)
+  {
+    bjson_status_t statusCode = _validateRaw(bytes, len,
+                                             BJSON_MAX_DEPTH - ctx->deepIdx);
+
+    if (statusCode != bjson_status_ok)
+    {
+      /* Error - data is not one complete BJSON value. */
+      _setErrorState(ctx, statusCode);
+    }
+  }
+
+  if (_canGoOn(ctx))
+  {
+    BJSON_DEBUG3("encoder: going to put [%d] bytes of raw value at offset [%d]",
+                 len, ctx->outDataIdx);
+
+    _putRaw_BLOB(ctx, bytes, len);
+    _countTokens(ctx, &ctx->stats.numRaws, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded [%u] bytes of raw value, deep [%d], dataIdx [%d]",
+                len, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push arbitrary binary blob into output BJSON stream.
+ *
+ * ctx      - encoder context created by bjson_encoderCreate() before (IN).
+ * blob     - buffer containing data to be encoded (IN).
+ * blobSize - number of bytes stored in blob[] buffer (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeBinary(bjson_encodeCtx_t *ctx,
+                                            void *blob,
+                                            size_t blobSize)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    /*
+     * Binary blob header: DATATYPE_BINARYxx <byte-size> followed by
+     * raw bytes.
+     */
+
+    BJSON_DEBUG3("encoder: going to put [%d] bytes of binary blob at offset [%d]",
+                 blobSize, ctx->outDataIdx);
+
+    if (_isReferenced(ctx, blobSize))
+    {
+      _putSizedDataType(ctx, BJSON_DATATYPE_BINARY_BASE, blobSize, NULL, 0);
+      _putRef(ctx, blob, blobSize);
+    }
+    else
+    {
+      _putSizedDataType(ctx, BJSON_DATATYPE_BINARY_BASE, blobSize, blob, blobSize);
+    }
+
+    _countTokens(ctx, &ctx->stats.numBinaries, 1);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded [%u] bytes of binary blob, deep [%d], dataIdx [%d]",
+                blobSize, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *                     Strings and binaries streamed in pieces
+ * ----------------------------------------------------------------------------
+ */
+
+static void _appendStreamedValue(bjson_encodeCtx_t *ctx,
+                                 uint8_t dataTypeBase,
+                                 const void *buf,
+                                 size_t bufLen)
+{
+  if (!_canGoOn(ctx))
+  {
+    return;
+  }
+
+  if (!_isStreamOpen(ctx) ||
+      ctx->blocks[ctx->deepIdx].dataTypeBase != dataTypeBase)
+  {
+    /* Error - Append() without matching Begin(). */
+    _setErrorState(ctx, bjson_status_error_streamedValueNotOpen);
+  }
+  else if (bufLen > 0)
+  {
+    if (_isReferenced(ctx, bufLen))
+    {
+      _putRef(ctx, buf, bufLen);
+    }
+    else
+    {
+      _putRaw_BLOB(ctx, buf, bufLen);
+    }
+
+    BJSON_DEBUG3("encoder: appended [%d] bytes to streamed %s, dataIdx [%d]",
+                 bufLen, _blockName(dataTypeBase), ctx->outDataIdx);
+  }
+}
+
+static void _endStreamedValue(bjson_encodeCtx_t *ctx, uint8_t dataTypeBase)
+{
+  if (!_canGoOn(ctx))
+  {
+    return;
+  }
+
+  if (!_isStreamOpen(ctx) ||
+      ctx->blocks[ctx->deepIdx].dataTypeBase != dataTypeBase)
+  {
+    /* Error - End() without matching Begin(). */
+    _setErrorState(ctx, bjson_status_error_streamedValueNotOpen);
+  }
+  else
+  {
+    _leaveBlock(ctx);
+
+    if (ctx->deepIdx == 0)
+    {
+      _flushRecord(ctx);
+    }
+  }
+}
+
+/*
+ * Begin string pushed into output BJSON stream piece by piece. Header
+ * is reserved like for unsized container, pieces passed to
+ * bjson_encodeStringAppend() go straight into output and final size is
+ * patched by bjson_encodeStringEnd(). There is no need to collect whole
+ * text in one buffer first.
+ *
+ * Example (encode {'key': 'hello world'})
+ *   bjson_encodeMapOpen(ctx)
+ *     bjson_encodeCString(ctx, "key")
+ *     bjson_encodeStringBegin(ctx)
+ *       bjson_encodeStringAppend(ctx, "hello ", 6)
+ *       bjson_encodeStringAppend(ctx, "world", 5)
+ *     bjson_encodeStringEnd(ctx)
+ *   bjson_encodeMapClose(ctx)
+ *
+ * WARNING! Each bjson_encodeStringBegin() call *MUST* be followed by
+ *          bjson_encodeStringEnd() call. No other value can be encoded
+ *          in between.
+ *
+ * TIP#1: Output is the same as bjson_encodeString() called once with
+ *        all pieces joined. Streamed string can be a map key too.
+ *
+ * TIP#2: Pieces are not checked for UTF-8. Multibyte character can be
+ *        split between two pieces.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeStringBegin(bjson_encodeCtx_t *ctx)
+{
+  if (_canGoOn(ctx) && _isStreamOpen(ctx))
+  {
+    _setErrorState(ctx, bjson_status_error_streamedValueOpen);
+  }
+
+  if (_canGoOn(ctx))
+  {
+    _countTokens(ctx, _isKeyTurn(ctx) ? &ctx->stats.numKeys
+                                      : &ctx->stats.numStrings, 1);
+
+    _enterMapOrArray(ctx, BJSON_DATATYPE_STRING_BASE);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push next piece of string open by bjson_encodeStringBegin() before.
+ *
+ * ctx     - encoder context created by bjson_encoderCreate() before (IN),
+ * text    - next piece of utf8 text (IN),
+ * textLen - size of text[] piece in bytes. Zero is allowed (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_streamedValueNotOpen if no string open,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeStringAppend(bjson_encodeCtx_t *ctx,
+                                                  const char *text,
+                                                  size_t textLen)
+{
+  _appendStreamedValue(ctx, BJSON_DATATYPE_STRING_BASE, text, textLen);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Finish string open by bjson_encodeStringBegin() before. Final size is
+ * written into header reserved at begin.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_streamedValueNotOpen if no string open,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeStringEnd(bjson_encodeCtx_t *ctx)
+{
+  _endStreamedValue(ctx, BJSON_DATATYPE_STRING_BASE);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Begin binary blob pushed into output BJSON stream piece by piece.
+ * See bjson_encodeStringBegin() for details.
+ *
+ * WARNING! Each bjson_encodeBinaryBegin() call *MUST* be followed by
+ *          bjson_encodeBinaryEnd() call.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeBinaryBegin(bjson_encodeCtx_t *ctx)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _countTokens(ctx, &ctx->stats.numBinaries, 1);
+
+    _enterMapOrArray(ctx, BJSON_DATATYPE_BINARY_BASE);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push next piece of binary blob open by bjson_encodeBinaryBegin() before.
+ *
+ * ctx      - encoder context created by bjson_encoderCreate() before (IN),
+ * blob     - next piece of raw bytes (IN),
+ * blobSize - size of blob[] piece in bytes. Zero is allowed (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_streamedValueNotOpen if no binary open,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeBinaryAppend(bjson_encodeCtx_t *ctx,
+                                                  const void *blob,
+                                                  size_t blobSize)
+{
+  _appendStreamedValue(ctx, BJSON_DATATYPE_BINARY_BASE, blob, blobSize);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Finish binary blob open by bjson_encodeBinaryBegin() before.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_streamedValueNotOpen if no binary open,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeBinaryEnd(bjson_encodeCtx_t *ctx)
+{
+  _endStreamedValue(ctx, BJSON_DATATYPE_BINARY_BASE);
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push whole array of integers into output BJSON stream at once.
+ * Output is the same as bjson_encodeArrayOpen(), bjson_encodeInteger()
+ * called for each value and bjson_encodeArrayClose(), but body size is
+ * computed up front and output buffer is reserved only once.
+ *
+ * ctx       - encoder context created by bjson_encoderCreate() before (IN),
+ * values    - array of values to be encoded (IN),
+ * numValues - number of items in values[] array (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeInt64Array(bjson_encodeCtx_t *ctx,
+                                                const int64_t *values,
+                                                size_t numValues)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx) && _canEnterArray(ctx))
+  {
+    size_t bodySize = 0;
+    size_t i        = 0;
+
+    uint8_t *out = NULL;
+
+    for (i = 0; i < numValues; i++)
+    {
+      bodySize += _integerSize(values[i]);
+    }
+
+    out = _putArrayHeader(ctx, bodySize);
+    i   = 0;
+
+    if (out)
+    {
+      uint8_t *outEnd = ctx->outData + ctx->outDataCapacity;
+
+      #if BJSON_LITTLE_ENDIAN
+      while (i < numValues && (size_t) (outEnd - out) > sizeof(uint64_t))
+      {
+        out += _writeIntegerWide(out, values[i]);
+        i++;
+      }
+      #endif
+
+      while (i < numValues)
+      {
+        out += _writeInteger(out, outEnd - out, values[i]);
+        i++;
+      }
+    }
+
+    _countTokens(ctx, &ctx->stats.numArrays, 1);
+    _countTokens(ctx, &ctx->stats.numIntegers, numValues);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded array of [%u] integers, deep [%d], dataIdx [%d]",
+                numValues, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push whole array of double precision numbers into output BJSON stream
+ * at once. Each value is written like by bjson_encodeDouble(), so
+ * bjson_encoderOption_compactNumbers is respected.
+ *
+ * ctx       - encoder context created by bjson_encoderCreate() before (IN),
+ * values    - array of values to be encoded (IN),
+ * numValues - number of items in values[] array (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeDoubleArray(bjson_encodeCtx_t *ctx,
+                                                 const double *values,
+                                                 size_t numValues)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx) && _canEnterArray(ctx))
+  {
+    size_t bodySize = numValues * (1 + sizeof(double));
+    size_t i        = 0;
+
+    uint8_t *out = NULL;
+
+    if (ctx->compactNumbers)
+    {
+      bodySize = 0;
+
+      for (i = 0; i < numValues; i++)
+      {
+        bodySize += _doubleSize(values[i], _doubleFormOf(values[i], 1));
+      }
+    }
+
+    out = _putArrayHeader(ctx, bodySize);
+
+    if (out)
+    {
+      uint8_t *outEnd = ctx->outData + ctx->outDataCapacity;
+
+      for (i = 0; i < numValues; i++)
+      {
+        out += _writeDouble(out, outEnd - out, values[i],
+                            _doubleFormOf(values[i], ctx->compactNumbers));
+      }
+    }
+
+    _countTokens(ctx, &ctx->stats.numArrays, 1);
+    _countTokens(ctx, &ctx->stats.numDoubles, numValues);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded array of [%u] doubles, deep [%d], dataIdx [%d]",
+                numValues, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Push whole array of single precision numbers into output BJSON stream
+ * at once. Each value is written as 5-byte float32.
+ *
+ * ctx       - encoder context created by bjson_encoderCreate() before (IN),
+ * values    - array of values to be encoded (IN),
+ * numValues - number of items in values[] array (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeFloatArray(bjson_encodeCtx_t *ctx,
+                                                const float *values,
+                                                size_t numValues)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx) && _canEnterArray(ctx))
+  {
+    size_t i = 0;
+
+    uint8_t *out = _putArrayHeader(ctx, numValues * (1 + sizeof(float)));
+
+    if (out)
+    {
+      for (i = 0; i < numValues; i++)
+      {
+        out += _writeFloat32(out, values[i]);
+      }
+    }
+
+    _countTokens(ctx, &ctx->stats.numArrays, 1);
+    _countTokens(ctx, &ctx->stats.numDoubles, numValues);
+    _endValue(ctx);
+
+    BJSON_DEBUG("encoder: encoded array of [%u] floats, deep [%d], dataIdx [%d]",
+                numValues, ctx->deepIdx, ctx->outDataIdx);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Begin encoding array container (values list) into output BJSON stream.
+ *
+ * WARNING! Each bjson_encodeArrayOpen() call *MUST* be followed by
+ *          bjson_encodeArrayClose() call.
+ *
+ * Example (encode [1,2,3]):
+ *   bjson_encodeArrayOpen(ctx)
+ *     bjson_encodeInteger(ctx, 1)
+ *     bjson_encodeInteger(ctx, 2)
+ *     bjson_encodeInteger(ctx, 3)
+ *   bjson_encodeArrayClose(ctx)
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeArrayOpen(bjson_encodeCtx_t *ctx)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _enterMapOrArray(ctx, BJSON_DATATYPE_ARRAY_BASE);
+    _rotateMapTurn(ctx);
+    _countTokens(ctx, &ctx->stats.numArrays, 1);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Begin encoding array container with body size known up front.
+ * Final header is written immediately, so body is never moved.
+ * Body size is verified when array is closed.
+ *
+ * WARNING! Each bjson_encodeArrayOpenSized() call *MUST* be followed by
+ *          bjson_encodeArrayClose() call.
+ *
+ * TIP: Body size is number of encoded bytes of all items, *WITHOUT*
+ *      array header itself. It's known e.g. when re-encoding decoded
+ *      subtree or fixed layout record.
+ *
+ * ctx      - encoder context created by bjson_encoderCreate() before (IN).
+ * bodySize - exact size of encoded array body in bytes (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeArrayOpenSized(bjson_encodeCtx_t *ctx,
+                                                    size_t bodySize)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _enterMapOrArrayWithSize(ctx, BJSON_DATATYPE_ARRAY_BASE, bodySize);
+    _rotateMapTurn(ctx);
+    _countTokens(ctx, &ctx->stats.numArrays, 1);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Close array open by bjson_encodeArrayOpen() before.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeArrayClose(bjson_encodeCtx_t *ctx)
+{
+  if (_canGoOn(ctx))
+  {
+    _leaveMapOrArray(ctx, 0);
+
+    if (ctx->deepIdx == 0)
+    {
+      _flushRecord(ctx);
+    }
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Begin encoding map container (key->value list) into output BJSON stream.
+ *
+ * WARNING! Each bjson_encodeMapOpen() call *MUST* be followed by
+ *          bjson_encodeMapClose() call.
+ *
+ * TIP#1: Use bjson_encodeString() or bjson_encodeCString() to encode keys.
+ *
+ * Example (encode {'key1': 1, 'key2': 2})
+ *   bjson_encodeMapOpen(ctx)
+ *     bjson_encodeCString(ctx, "key1")
+ *     bjson_encodeInteger(ctx, 1)
+ *     bjson_encodeCString(ctx, "key2")
+ *     bjson_encodeInteger(ctx, 2)
+ *   bjson_encodeMapClose(ctx)
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeMapOpen(bjson_encodeCtx_t *ctx)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _enterMapOrArray(ctx, BJSON_DATATYPE_MAP_BASE);
+    _rotateMapTurn(ctx);
+    _countTokens(ctx, &ctx->stats.numMaps, 1);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Begin encoding map container with body size known up front.
+ * See bjson_encodeArrayOpenSized() for details.
+ *
+ * WARNING! Each bjson_encodeMapOpenSized() call *MUST* be followed by
+ *          bjson_encodeMapClose() call.
+ *
+ * ctx      - encoder context created by bjson_encoderCreate() before (IN).
+ * bodySize - exact size of encoded map body (keys and values) in bytes (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeMapOpenSized(bjson_encodeCtx_t *ctx,
+                                                  size_t bodySize)
+{
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
+  {
+    _enterMapOrArrayWithSize(ctx, BJSON_DATATYPE_MAP_BASE, bodySize);
+    _rotateMapTurn(ctx);
+    _countTokens(ctx, &ctx->stats.numMaps, 1);
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * Close map open by bjson_encodeMapOpen() before.
+ *
+ * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          one of bjson_status_error_xxx codes otherwise.
+ */
+
+BJSON_API bjson_status_t bjson_encodeMapClose(bjson_encodeCtx_t *ctx)
+{
+  if (_canGoOn(ctx))
+  {
+    _leaveMapOrArray(ctx, 1);
+
+    if (ctx->deepIdx == 0)
+    {
+      _flushRecord(ctx);
+    }
+  }
+
+  return ctx->statusCode;
+}
+
+/*
+ * ----------------------------------------------------------------------------
+ *                               Message templates
+ * ----------------------------------------------------------------------------
+ */
+
+static void _templateSetErrorState(bjson_template_t *tpl,
+                                   bjson_status_t statusCode)
+{
+  BJSON_DEBUG("template: set error state (%d): '%s'",
+              statusCode, bjson_getStatusAsText(statusCode));
+
+  tpl->statusCode = statusCode;
+}
+
+static void *_templateMalloc(bjson_template_t *tpl, size_t size)
+{
+  if (tpl->memoryFunctions)
+  {
+    return tpl->memoryFunctions->malloc(tpl->callerCtx, size);
+  }
+
+  return malloc(size);
+}
+
+static void _templateFree(bjson_template_t *tpl, void *ptr)
+{
+  if (ptr)
+  {
+    if (tpl->memoryFunctions)
+    {
+      tpl->memoryFunctions->free(tpl->callerCtx, ptr);
+    }
+    else
+    {
+      free(ptr);
+    }
+  }
+}
+
+static void *_templateRealloc(bjson_template_t *tpl, void *ptr, size_t newSize)
+{
+  if (tpl->memoryFunctions)
+  {
+    return tpl->memoryFunctions->realloc(tpl->callerCtx, ptr, newSize);
+  }
+
+  return realloc(ptr, newSize);
+}
+
+static void _templatePutOp(bjson_template_t *tpl, uint8_t code,
+                           uint8_t arg, size_t size)
+{
+  if (tpl->numOps == tpl->opsCapacity)
+  {
+    size_t newCapacity = MAX(tpl->opsCapacity * 2, 16);
+
+    bjson_templateOp_t *newOps = _templateRealloc(tpl, tpl->ops,
+                                                  newCapacity * sizeof(bjson_templateOp_t));
+
+    if (newOps == NULL)
+    {
+      _templateSetErrorState(tpl, bjson_status_error_outOfMemory);
+
+      return;
+    }
+
+    tpl->ops         = newOps;
+    tpl->opsCapacity = newCapacity;
+  }
+
+  tpl->ops[tpl->numOps].code    = code;
+  tpl->ops[tpl->numOps].arg     = arg;
+  tpl->ops[tpl->numOps].isFixed = 0;
+  tpl->ops[tpl->numOps].size    = size;
+
+  tpl->numOps++;
+}
+
+/*
+ * Append constant bytes. Adjacent constants are merged into one op.
+ */
+
+static void _templatePutConst(bjson_template_t *tpl,
+                              const void *bytes, size_t size)
+{
+  if (tpl->constCapacity - tpl->constSize < size)
+  {
+    size_t newCapacity = MAX(tpl->constCapacity * 2, tpl->constSize + size);
+
+    uint8_t *newConstData = _templateRealloc(tpl, tpl->constData, newCapacity);
+
+    if (newConstData == NULL)
+    {
+      _templateSetErrorState(tpl, bjson_status_error_outOfMemory);
+
+      return;
+    }
+
+    tpl->constData     = newConstData;
+    tpl->constCapacity = newCapacity;
+  }
+
+  memcpy(tpl->constData + tpl->constSize, bytes, size);
+
+  tpl->constSize += size;
+
+  if (tpl->numOps > 0 && tpl->ops[tpl->numOps - 1].code == bjson_templateOp_const)
+  {
+    tpl->ops[tpl->numOps - 1].size += size;
+  }
+  else
+  {
+    _templatePutOp(tpl, bjson_templateOp_const, 0, size);
+  }
+}
+
+/*
+ * Check can next value go at current position and rotate map turn.
+ *
+ * RETURNS: 1 if value can be recorded,
+ *          0 if error.
+ */
+
+static int _templateBeginValue(bjson_template_t *tpl, int isString)
+{
+  int deepIdx = tpl->deepIdx;
+
+  if (tpl->statusCode != bjson_status_ok)
+  {
+    return 0;
+  }
+
+  if (tpl->isCompiled || (deepIdx == 0 && tpl->hasRoot))
+  {
+    /* Error - template is already complete. */
+    _templateSetErrorState(tpl, bjson_status_error_invalidTemplate);
+
+    return 0;
+  }
+
+  if (tpl->blocks[deepIdx].isMap)
+  {
+    if (tpl->blocks[deepIdx].mapTurn && !isString)
+    {
+      /* Error - map key must be a string. */
+      _templateSetErrorState(tpl, bjson_status_error_invalidObjectKey);
+
+      return 0;
+    }
+
+    tpl->blocks[deepIdx].mapTurn = !tpl->blocks[deepIdx].mapTurn;
+  }
+
+  tpl->hasRoot = 1;
+
+  return 1;
+}
+
+static bjson_status_t _templateOpen(bjson_template_t *tpl, int isMap)
+{
+  if (_templateBeginValue(tpl, 0))
+  {
+    if (tpl->deepIdx == BJSON_MAX_DEPTH)
+    {
+      /* Error - too many nested containers (maps/arrays). */
+      _templateSetErrorState(tpl, bjson_status_error_tooManyNestedContainers);
+    }
+    else
+    {
+      if (tpl->deepIdx + 1 == tpl->blocksCapacity)
+      {
+        /*
+         * Not enough space for next block - resize block stack.
+         */
+
+        int newCapacity = MIN(tpl->blocksCapacity * 2, BJSON_MAX_DEPTH + 1);
+
+        bjson_templateBlock_t *newBlocks = _templateRealloc(tpl, tpl->blocks,
+                                                            newCapacity * sizeof(bjson_templateBlock_t));
+
+        if (newBlocks == NULL)
+        {
+          _templateSetErrorState(tpl, bjson_status_error_outOfMemory);
+
+          return tpl->statusCode;
+        }
+
+        tpl->blocks         = newBlocks;
+        tpl->blocksCapacity = newCapacity;
+      }
+
+      tpl->deepIdx++;
+      tpl->maxDepth = MAX(tpl->maxDepth, tpl->deepIdx);
+
+      tpl->blocks[tpl->deepIdx].isMap   = isMap;
+      tpl->blocks[tpl->deepIdx].mapTurn = 1;
+
+      _templatePutOp(tpl, bjson_templateOp_open,
+                     isMap ? BJSON_DATATYPE_MAP_BASE : BJSON_DATATYPE_ARRAY_BASE, 0);
+    }
+  }
+
+  return tpl->statusCode;
+}
+
+static bjson_status_t _templateClose(bjson_template_t *tpl, int isMap)
+{
+  int deepIdx = tpl->deepIdx;
+
+  if (tpl->statusCode == bjson_status_ok)
+  {
+    if (tpl->isCompiled)
+    {
+      _templateSetErrorState(tpl, bjson_status_error_invalidTemplate);
+    }
+    else if (deepIdx == 0)
+    {
+      _templateSetErrorState(tpl, isMap ? bjson_status_error_closeMapAtRootLevel
+                                        : bjson_status_error_closeArrayAtRootLevel);
+    }
+    else if (tpl->blocks[deepIdx].isMap != isMap)
+    {
+      _templateSetErrorState(tpl, isMap ? bjson_status_error_closeMapButArrayOpen
+                                        : bjson_status_error_closeArrayButMapOpen);
+    }
+    else if (isMap && !tpl->blocks[deepIdx].mapTurn)
+    {
+      _templateSetErrorState(tpl, bjson_status_error_keyWithoutValue);
+    }
+    else
+    {
+      tpl->deepIdx--;
+
+      _templatePutOp(tpl, bjson_templateOp_close, 0, 0);
+    }
+  }
+
+  return tpl->statusCode;
+}
+
+/*
+ * Number of bytes taken by slot value or 0 if it depends on value.
+ */
+
+static size_t _templateSlotFixedSize(uint8_t slotType)
+{
+  switch (slotType)
+  {
+    case bjson_templateSlot_double: return 1 + sizeof(double);
+    case bjson_templateSlot_bool:   return 1;
+    default:                        return 0;
+  }
+}
+
+static size_t _templateSlotSize(uint8_t slotType,
+                                const bjson_templateValue_t *value)
+{
+  switch (slotType)
+  {
+    case bjson_templateSlot_integer:
+    {
+      return _integerSize(value->valueInteger);
+    }
+
+    case bjson_templateSlot_string:
+    {
+      if (value->span.bufLen == 0)
+      {
+        /* Empty string goes as one byte data type. */
+        return 1;
+      }
+
+      return _sizedDataTypeHeaderSize(value->span.bufLen) + value->span.bufLen;
+    }
+
+    case bjson_templateSlot_binary:
+    {
+      return _sizedDataTypeHeaderSize(value->span.bufLen) + value->span.bufLen;
+    }
+
+    default:
+    {
+      return _templateSlotFixedSize(slotType);
+    }
+  }
+}
+
+/*
+ * Compute body sizes of containers left in compiled template. Ops are
+ * walked backward, so each body is complete when its open op is met.
+ * Sizes are stored in ctx->templateSizes in open ops order. It's
+ * encoder's scratch buffer, so it comes from encoder's memory functions,
+ * while template itself is only read here.
+ *
+ * RETURNS: Total size of rendered template.
+ */
+
+static size_t _templateMeasure(bjson_encodeCtx_t *ctx,
+                               const bjson_template_t *tpl,
+                               const bjson_templateValue_t *values)
+{
+  size_t numNeeded = tpl->numOpens + tpl->maxOpenDepth + 1;
+
+  size_t *bodySizes = NULL;
+  size_t *stack     = NULL;
+
+  size_t slotIdx = tpl->numSlots;
+  size_t openIdx = tpl->numOpens;
+  size_t i       = tpl->numOps;
+
+  int stackIdx = 0;
+
+  if (ctx->templateSizesCapacity < numNeeded)
+  {
+    size_t *newSizes = bjson_realloc(ctx, ctx->templateSizes,
+                                     numNeeded * sizeof(size_t));
+
+    if (newSizes == NULL)
+    {
+      _setErrorState(ctx, bjson_status_error_outOfMemory);
+
+      return 0;
+    }
+
+    ctx->templateSizes         = newSizes;
+    ctx->templateSizesCapacity = numNeeded;
+  }
+
+  bodySizes = ctx->templateSizes;
+  stack     = ctx->templateSizes + tpl->numOpens;
+
+  stack[0] = 0;
+
+  while (i > 0)
+  {
+    const bjson_templateOp_t *op = &tpl->ops[--i];
+
+    switch (op->code)
+    {
+      case bjson_templateOp_const:
+      {
+        stack[stackIdx] += op->size;
+
+        break;
+      }
+
+      case bjson_templateOp_slot:
+      {
+        stack[stackIdx] += _templateSlotSize(op->arg, &values[--slotIdx]);
+
+        break;
+      }
+
+      case bjson_templateOp_close:
+      {
+        stack[++stackIdx] = 0;
+
+        break;
+      }
+
+      default:
+      {
+        size_t bodySize = stack[stackIdx--];
+
+        bodySizes[--openIdx] = bodySize;
+
+        stack[stackIdx] += _sizedDataTypeHeaderSize(bodySize) + bodySize;
+      }
+    }
+  }
+
+  return stack[0];
+}
+
+/*
+ * Write rendered template into out[], which has exactly outSize bytes.
+ */
+
+static void _templateWrite(const bjson_template_t *tpl,
+                           const bjson_templateValue_t *values,
+                           const size_t *bodySizes,
+                           uint8_t *out, size_t outSize)
+{
+  const uint8_t *constData = tpl->constData;
+
+  uint8_t *outEnd = out + outSize;
+
+  size_t i = 0;
+
+  for (i = 0; i < tpl->numOps; i++)
+  {
+    const bjson_templateOp_t *op = &tpl->ops[i];
+
+    switch (op->code)
+    {
+      case bjson_templateOp_const:
+      {
+        memcpy(out, constData, op->size);
+
+        out       += op->size;
+        constData += op->size;
+
+        break;
+      }
+
+      case bjson_templateOp_slot:
+      {
+        const bjson_templateValue_t *value = values++;
+
+        switch (op->arg)
+        {
+          case bjson_templateSlot_integer:
+          {
+            out += _writeInteger(out, outEnd - out, value->valueInteger);
+
+            break;
+          }
+
+          case bjson_templateSlot_double:
+          {
+            out += _writeDouble(out, outEnd - out, value->valueDouble,
+                                bjson_encodeDoubleForm_float64);
+
+            break;
+          }
+
+          case bjson_templateSlot_bool:
+          {
+            *out++ = value->valueBoolean ? BJSON_DATATYPE_STRICT_TRUE
+                                         : BJSON_DATATYPE_STRICT_FALSE;
+
+            break;
+          }
+
+          default:
+          {
+            uint8_t base = (op->arg == bjson_templateSlot_string)
+                               ? BJSON_DATATYPE_STRING_BASE
+                               : BJSON_DATATYPE_BINARY_BASE;
+
+            if (value->span.bufLen == 0 && base == BJSON_DATATYPE_STRING_BASE)
+            {
+              *out++ = BJSON_DATATYPE_EMPTY_STRING;
+
+              break;
+            }
+
+            out += _writeSizedDataType(out, outEnd - out, base,
+                                       _dataSizeOf(value->span.bufLen),
+                                       value->span.bufLen);
+
+            memcpy(out, value->span.buf, value->span.bufLen);
+
+            out += value->span.bufLen;
+          }
+        }
+
+        break;
+      }
+
+      case bjson_templateOp_open:
+      {
+        size_t bodySize = *bodySizes++;
+
+        out += _writeSizedDataType(out, outEnd - out, op->arg,
+                                   _dataSizeOf(bodySize), bodySize);
+
+        break;
+      }
+
+      default:
+      {
+        break;
+      }
+    }
+  }
 }
 
 /*
- * Push utf8 string into output BJSON stream.
+ * Create new, empty message template.
  *
- * ctx     - encoder context created by bjson_encoderCreate() before (IN).
+ * memoryFunctions - custom malloc/free/realloc functions used for all
+ *                   template memory. Set to NULL to use default system
+ *                   functions (IN/OPT).
  *
- * text    - buffer containing text to be encoded. Zero byte terminator
- *           is *NOT* neccesery. (IN).
+ * callerCtx       - caller defined context passed to memory functions
+ *                   (IN/OPT).
  *
- * textLen - number of bytes stored in text[] buffer *WITHOUT* zero terminator
- *           if exists (IN).
+ * WARNING! Returned template *MUST* be freed by caller using
+ *          bjson_templateDestroy() function.
  *
- * RETURNS: bjson_status_ok if success,
- *          one of bjson_status_error_xxx codes otherwise.
+ * RETURNS: Pointer to new allocated template if success,
+ *          NULL if error.
  */
 
-BJSON_API bjson_status_t bjson_encodeString(bjson_encodeCtx_t *ctx,
-                                            const char *text,
-                                            size_t textLen)
+BJSON_API bjson_template_t *bjson_templateCreate(
+                                bjson_memoryFunctions_t *memoryFunctions,
+                                void *callerCtx)
 {
-  if (_isOk(ctx))
+  bjson_template_t *tpl = NULL;
+
+  if (memoryFunctions)
   {
-    if (textLen == 0)
-    {
-      /*
-       * Special case - empty string.
-       */
+    tpl = memoryFunctions->malloc(callerCtx, sizeof(bjson_template_t));
+  }
+  else
+  {
+    tpl = malloc(sizeof(bjson_template_t));
+  }
 
-      _putRaw_BYTE(ctx, BJSON_DATATYPE_EMPTY_STRING);
+  if (tpl == NULL)
+  {
+    return NULL;
+  }
 
-      BJSON_DEBUG("encoder: encoded empty string, deep [%d], dataIdx [%d]",
-                  ctx->deepIdx, ctx->outDataIdx);
-    }
-    else
-    {
-      /*
-       * String header: DATATYPE_STRINGxx <byte-size>.
-       */
+  memset(tpl, 0, sizeof(bjson_template_t));
 
-      _encodeSizedDataType(ctx, BJSON_DATATYPE_STRING_BASE, textLen);
+  tpl->memoryFunctions = memoryFunctions;
+  tpl->callerCtx       = callerCtx;
 
-      /*
-       * String body (utf8 *WITHOUT* zero terminator).
-       */
+  /*
+   * Block stack grows with nesting depth. Root level entry is always
+   * there.
+   */
 
-      BJSON_DEBUG3("encoder: going to put [%d] bytes of utf8 string at offset [%d]",
-                   textLen, ctx->outDataIdx);
+  tpl->blocks = _templateMalloc(tpl, BJSON_DEFAULT_BLOCKS_CAPACITY
+                                         * sizeof(bjson_templateBlock_t));
 
-      _putRaw_BLOB(ctx, text, textLen);
+  if (tpl->blocks == NULL)
+  {
+    _templateFree(tpl, tpl);
 
-      /*
-       * Log encode event.
-       */
+    return NULL;
+  }
 
-      BJSON_DEBUG("encoder: encoded %s '%.*s', deep [%d], dataIdx [%d]",
-                  _isKeyTurn(ctx) ? "key" : "string",
-                  textLen, text,
-                  ctx->deepIdx,
-                  ctx->outDataIdx);
-    }
+  memset(tpl->blocks, 0, sizeof(bjson_templateBlock_t));
 
-    _rotateMapTurn(ctx);
-  }
+  tpl->blocksCapacity = BJSON_DEFAULT_BLOCKS_CAPACITY;
 
-  return ctx->statusCode;
+  return tpl;
 }
 
 /*
- * Push C-style (ASCIIZ, zero terminated) string into output BJSON stream.
+ * Free template created by bjson_templateCreate().
  *
- * ctx  - encoder context created by bjson_encoderCreate() before (IN).
- * text - buffer containing null terminated text to be encoded (IN).
+ * tpl - template to free. Can be NULL (IN).
+ */
+
+BJSON_API void bjson_templateDestroy(bjson_template_t *tpl)
+{
+  if (tpl)
+  {
+    _templateFree(tpl, tpl->ops);
+    _templateFree(tpl, tpl->constData);
+    _templateFree(tpl, tpl->blocks);
+    _templateFree(tpl, tpl);
+  }
+}
+
+/*
+ * Record map/array open and close in template being built.
+ *
+ * tpl - template created by bjson_templateCreate() before (IN).
  *
  * RETURNS: bjson_status_ok if success,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeCString(bjson_encodeCtx_t *ctx,
-                                             const char *text)
+BJSON_API bjson_status_t bjson_templateMapOpen(bjson_template_t *tpl)
 {
-  return bjson_encodeString(ctx, text, strlen(text));
+  return _templateOpen(tpl, 1);
+}
+
+BJSON_API bjson_status_t bjson_templateMapClose(bjson_template_t *tpl)
+{
+  return _templateClose(tpl, 1);
+}
+
+BJSON_API bjson_status_t bjson_templateArrayOpen(bjson_template_t *tpl)
+{
+  return _templateOpen(tpl, 0);
+}
+
+BJSON_API bjson_status_t bjson_templateArrayClose(bjson_template_t *tpl)
+{
+  return _templateClose(tpl, 0);
 }
 
 /*
- * Push arbitrary binary blob into output BJSON stream.
+ * Record constant string i.e. map key or string value, which is the same
+ * in each rendered message.
  *
- * ctx      - encoder context created by bjson_encoderCreate() before (IN).
- * blob     - buffer containing data to be encoded (IN).
- * blobSize - number of bytes stored in blob[] buffer (IN).
+ * tpl     - template created by bjson_templateCreate() before (IN),
+ * text    - utf8 string to record (IN),
+ * textLen - length of text in bytes (IN).
  *
  * RETURNS: bjson_status_ok if success,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeBinary(bjson_encodeCtx_t *ctx,
-                                            void *blob,
-                                            size_t blobSize)
+BJSON_API bjson_status_t bjson_templateString(bjson_template_t *tpl,
+                                              const char *text,
+                                              size_t textLen)
 {
-  _setErrorStateIfKeyTurn(ctx);
-
-  if (_isOk(ctx))
+  if (_templateBeginValue(tpl, 1))
   {
-    /*
-     * Binary blob header: DATATYPE_BINARYxx <byte-size>.
-     */
-
-    _encodeSizedDataType(ctx, BJSON_DATATYPE_BINARY_BASE, blobSize);
+    uint8_t header[16] = {BJSON_DATATYPE_EMPTY_STRING};
 
-    /*
-     * Binary blob data - raw bytes go here.
-     */
-
-    BJSON_DEBUG3("encoder: going to put [%d] bytes of binary blob at offset [%d]",
-                 blobSize, ctx->outDataIdx);
+    size_t headerSize = 1;
 
-    _putRaw_BLOB(ctx, blob, blobSize);
-    _rotateMapTurn(ctx);
+    if (textLen > 0)
+    {
+      headerSize = _writeSizedDataType(header, sizeof(header),
+                                       BJSON_DATATYPE_STRING_BASE,
+                                       _dataSizeOf(textLen), textLen);
+    }
 
-    BJSON_DEBUG("encoder: encoded [%u] bytes of binary blob, deep [%d], dataIdx [%d]",
-                blobSize, ctx->deepIdx, ctx->outDataIdx);
+    _templatePutConst(tpl, header, headerSize);
+    _templatePutConst(tpl, text, textLen);
   }
 
-  return ctx->statusCode;
+  return tpl->statusCode;
 }
 
 /*
- * Begin encoding array container (values list) into output BJSON stream.
- *
- * WARNING! Each bjson_encodeArrayOpen() call *MUST* be followed by
- *          bjson_encodeArrayClose() call.
- *
- * Example (encode [1,2,3]):
- *   bjson_encodeArrayOpen(ctx)
- *     bjson_encodeInteger(ctx, 1)
- *     bjson_encodeInteger(ctx, 2)
- *     bjson_encodeInteger(ctx, 3)
- *   bjson_encodeArrayClose(ctx)
+ * Record constant, pre-encoded BJSON value e.g. null or nested document.
+ * Bytes are not checked, see bjson_encodeRaw().
  *
- * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ * tpl   - template created by bjson_templateCreate() before (IN),
+ * bytes - complete BJSON value (IN),
+ * len   - number of bytes stored in bytes[] buffer (IN).
  *
  * RETURNS: bjson_status_ok if success,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeArrayOpen(bjson_encodeCtx_t *ctx)
+BJSON_API bjson_status_t bjson_templateRaw(bjson_template_t *tpl,
+                                           const void *bytes,
+                                           size_t len)
 {
-  _setErrorStateIfKeyTurn(ctx);
-
-  if (_isOk(ctx))
+  if (_templateBeginValue(tpl, 0))
   {
-    _enterMapOrArray(ctx, 0);
-    _rotateMapTurn(ctx);
+    _templatePutConst(tpl, bytes, len);
   }
 
-  return ctx->statusCode;
+  return tpl->statusCode;
 }
 
 /*
- * Close array open by bjson_encodeArrayOpen() before.
+ * Record slot i.e. place for value given at render time. Slots are
+ * numbered in recording order starting from 0.
  *
- * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ * TIP: Only string slot can be used as map key.
+ *
+ * tpl      - template created by bjson_templateCreate() before (IN),
+ * slotType - type of value expected in this slot (IN).
  *
  * RETURNS: bjson_status_ok if success,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeArrayClose(bjson_encodeCtx_t *ctx)
+BJSON_API bjson_status_t bjson_templateSlot(bjson_template_t *tpl,
+                                            bjson_templateSlot_t slotType)
 {
-  if (_isOk(ctx))
+  if (slotType > bjson_templateSlot_binary)
   {
-    _leaveMapOrArray(ctx, 0);
+    _templateSetErrorState(tpl, bjson_status_error_invalidDataType);
+  }
+  else if (_templateBeginValue(tpl, slotType == bjson_templateSlot_string))
+  {
+    _templatePutOp(tpl, bjson_templateOp_slot, slotType, 0);
+
+    tpl->numSlots++;
   }
 
-  return ctx->statusCode;
+  return tpl->statusCode;
 }
 
 /*
- * Begin encoding map container (key->value list) into output BJSON stream.
- *
- * WARNING! Each bjson_encodeMapOpen() call *MUST* be followed by
- *          bjson_encodeMapClose() call.
- *
- * TIP#1: Use bjson_encodeString() or bjson_encodeCString() to encode keys.
- *
- * Example (encode {'key1': 1, 'key2': 2})
- *   bjson_encodeMapOpen(ctx)
- *     bjson_encodeCString(ctx, "key1")
- *     bjson_encodeInteger(ctx, 1)
- *     bjson_encodeCString(ctx, "key2")
- *     bjson_encodeInteger(ctx, 2)
- *   bjson_encodeMapClose(ctx)
+ * Finish recording. Headers of containers, which body size doesn't depend
+ * on slot values, are written once here and merged with constant bytes
+ * around. Template can't be changed anymore after this call.
  *
- * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ * tpl - template created by bjson_templateCreate() before (IN).
  *
- * RETURNS: bjson_status_ok if success,
+ * RETURNS: bjson_status_ok if template is ready to render,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeMapOpen(bjson_encodeCtx_t *ctx)
+BJSON_API bjson_status_t bjson_templateCompile(bjson_template_t *tpl)
 {
-  _setErrorStateIfKeyTurn(ctx);
+  bjson_templateOp_t *ops = tpl->ops;
+  uint8_t *constData      = tpl->constData;
 
-  if (_isOk(ctx))
+  size_t numOps = tpl->numOps;
+  size_t i      = 0;
+
+  size_t *stackSize    = NULL;
+  uint8_t *stackFixed  = NULL;
+  const uint8_t *src   = NULL;
+
+  int stackIdx   = 0;
+  int fixedDepth = 0;
+  int openDepth  = 0;
+
+  if (tpl->statusCode != bjson_status_ok || tpl->isCompiled)
   {
-    _enterMapOrArray(ctx, 1);
-    _rotateMapTurn(ctx);
+    return tpl->statusCode;
   }
 
-  return ctx->statusCode;
+  if (tpl->deepIdx > 0)
+  {
+    _templateSetErrorState(tpl, tpl->blocks[tpl->deepIdx].isMap
+                                    ? bjson_status_error_unclosedMap
+                                    : bjson_status_error_unclosedArray);
+
+    return tpl->statusCode;
+  }
+
+  if (!tpl->hasRoot)
+  {
+    _templateSetErrorState(tpl, bjson_status_error_emptyInputPassed);
+
+    return tpl->statusCode;
+  }
+
+  /*
+   * Walk ops backward and find containers with body size known up
+   * front i.e. without variable size slots inside.
+   */
+
+  stackSize  = _templateMalloc(tpl, (tpl->maxDepth + 1) * sizeof(size_t));
+  stackFixed = _templateMalloc(tpl, tpl->maxDepth + 1);
+
+  if (stackSize == NULL || stackFixed == NULL)
+  {
+    _templateFree(tpl, stackSize);
+    _templateFree(tpl, stackFixed);
+
+    _templateSetErrorState(tpl, bjson_status_error_outOfMemory);
+
+    return tpl->statusCode;
+  }
+
+  stackSize[0]  = 0;
+  stackFixed[0] = 1;
+
+  for (i = numOps; i > 0; i--)
+  {
+    bjson_templateOp_t *op = &ops[i - 1];
+
+    switch (op->code)
+    {
+      case bjson_templateOp_const:
+      {
+        stackSize[stackIdx] += op->size;
+
+        break;
+      }
+
+      case bjson_templateOp_slot:
+      {
+        size_t slotSize = _templateSlotFixedSize(op->arg);
+
+        stackSize[stackIdx] += slotSize;
+
+        if (slotSize == 0)
+        {
+          stackFixed[stackIdx] = 0;
+        }
+
+        break;
+      }
+
+      case bjson_templateOp_close:
+      {
+        stackIdx++;
+
+        stackSize[stackIdx]  = 0;
+        stackFixed[stackIdx] = 1;
+
+        break;
+      }
+
+      default:
+      {
+        op->size    = stackSize[stackIdx];
+        op->isFixed = stackFixed[stackIdx];
+
+        stackIdx--;
+
+        if (op->isFixed)
+        {
+          stackSize[stackIdx] += _sizedDataTypeHeaderSize(op->size) + op->size;
+        }
+        else
+        {
+          stackFixed[stackIdx] = 0;
+        }
+      }
+    }
+  }
+
+  tpl->isFixed   = stackFixed[0];
+  tpl->fixedSize = stackSize[0];
+
+  _templateFree(tpl, stackSize);
+  _templateFree(tpl, stackFixed);
+
+  /*
+   * Record ops once again. Fixed containers go as constant bytes.
+   */
+
+  tpl->ops           = NULL;
+  tpl->numOps        = 0;
+  tpl->opsCapacity   = 0;
+  tpl->constData     = NULL;
+  tpl->constSize     = 0;
+  tpl->constCapacity = 0;
+
+  src = constData;
+
+  for (i = 0; i < numOps && tpl->statusCode == bjson_status_ok; i++)
+  {
+    bjson_templateOp_t *op = &ops[i];
+
+    switch (op->code)
+    {
+      case bjson_templateOp_const:
+      {
+        _templatePutConst(tpl, src, op->size);
+
+        src += op->size;
+
+        break;
+      }
+
+      case bjson_templateOp_slot:
+      {
+        _templatePutOp(tpl, op->code, op->arg, 0);
+
+        break;
+      }
+
+      case bjson_templateOp_open:
+      {
+        if (fixedDepth > 0 || op->isFixed)
+        {
+          uint8_t header[16];
+
+          size_t headerSize = _writeSizedDataType(header, sizeof(header), op->arg,
+                                                  _dataSizeOf(op->size), op->size);
+
+          _templatePutConst(tpl, header, headerSize);
+
+          fixedDepth++;
+        }
+        else
+        {
+          _templatePutOp(tpl, op->code, op->arg, 0);
+
+          tpl->numOpens++;
+
+          openDepth++;
+
+          tpl->maxOpenDepth = MAX(tpl->maxOpenDepth, openDepth);
+        }
+
+        break;
+      }
+
+      default:
+      {
+        if (fixedDepth > 0)
+        {
+          fixedDepth--;
+        }
+        else
+        {
+          _templatePutOp(tpl, op->code, 0, 0);
+
+          openDepth--;
+        }
+      }
+    }
+  }
+
+  _templateFree(tpl, ops);
+  _templateFree(tpl, constData);
+
+  if (tpl->statusCode == bjson_status_ok)
+  {
+    tpl->isCompiled = 1;
+
+    BJSON_DEBUG("template: compiled [%u] ops, [%u] const bytes, [%u] slots",
+                tpl->numOps, tpl->constSize, tpl->numSlots);
+  }
+
+  return tpl->statusCode;
 }
 
 /*
- * Close map open by bjson_encodeMapOpen() before.
+ * Push rendered template into output BJSON stream as next array item or
+ * map value. Output is the same as calling bjson_encodeXxx() for each
+ * recorded token with slots replaced by given values.
  *
- * ctx - encoder context created by bjson_encoderCreate() before (IN).
+ * ctx    - encoder context created by bjson_encoderCreate() before (IN),
+ * tpl    - template compiled by bjson_templateCompile() before (IN),
+ * values - one value for each template slot in recording order (IN).
  *
  * RETURNS: bjson_status_ok if success,
  *          one of bjson_status_error_xxx codes otherwise.
  */
 
-BJSON_API bjson_status_t bjson_encodeMapClose(bjson_encodeCtx_t *ctx)
+BJSON_API bjson_status_t
+  bjson_templateRender(bjson_encodeCtx_t *ctx,
+                       const bjson_template_t *tpl,
+                       const bjson_templateValue_t *values)
 {
-  if (_isOk(ctx))
+  _setErrorStateIfKeyTurn(ctx);
+
+  if (_canGoOn(ctx))
   {
-    _leaveMapOrArray(ctx, 1);
+    if (!tpl->isCompiled)
+    {
+      /* Error - template not compiled or broken. */
+      _setErrorState(ctx, bjson_status_error_invalidTemplate);
+    }
+    else if (tpl->maxDepth > BJSON_MAX_DEPTH - ctx->deepIdx)
+    {
+      /* Error - too many nested containers (maps/arrays). */
+      _setErrorState(ctx, bjson_status_error_tooManyNestedContainers);
+    }
+    else
+    {
+      size_t totalSize = tpl->isFixed ? tpl->fixedSize
+                                      : _templateMeasure(ctx, tpl, values);
+
+      uint8_t *out = NULL;
+
+      if (_canGoOn(ctx))
+      {
+        out = _reserveOutData(ctx, totalSize);
+
+        if (out)
+        {
+          _templateWrite(tpl, values, ctx->templateSizes, out, totalSize);
+
+          ctx->outDataIdx += totalSize;
+        }
+        else
+        {
+          _countOutData(ctx, totalSize);
+        }
+
+        _endValue(ctx);
+
+        BJSON_DEBUG("encoder: rendered template of [%u] bytes, deep [%d], dataIdx [%d]",
+                    totalSize, ctx->deepIdx, ctx->outDataIdx);
+      }
+    }
   }
 
   return ctx->statusCode;
@@ -985,3 +5729,33 @@ BJSON_API bjson_status_t bjson_encoderGetStatus(bjson_encodeCtx_t *ctx)
 {
   return ctx->statusCode;
 }
+
+/*
+ * Retrieve statistics collected by encoder since context was created.
+ *
+ * TIP: Compare reallocs with bytesWritten to choose initial capacity,
+ *      and bytesMoved with bytesWritten to find document shapes, which
+ *      are expensive to compact (e.g. many big nested containers).
+ *
+ * ctx   - encoder context created by bjson_encoderCreate() before (IN),
+ * stats - structure to receive collected statistics (OUT).
+ *
+ * RETURNS: bjson_status_ok if success,
+ *          bjson_status_error_notImplemented if library was built without
+ *          statistics support.
+ */
+
+BJSON_API bjson_status_t bjson_encoderGetStats(bjson_encodeCtx_t *ctx,
+                                               bjson_encoderStats_t *stats)
+{
+  *stats = ctx->stats;
+
+#if BJSON_STATS_ENABLED > 0
+  /* Count output still kept in outData too. */
+  stats->bytesWritten += _outputSize(ctx);
+
+  return bjson_status_ok;
+#else
+  return bjson_status_error_notImplemented;
+#endif
+}
@@ -36,6 +36,195 @@ extern "C" {
 
 typedef struct bjson_encodeCtx bjson_encodeCtx_t;
 
+/*
+ * Map key encoded once, ready to be copied into output as is
+ * (see bjson_keyPrepare()).
+ */
+
+typedef struct bjson_preparedKey bjson_preparedKey_t;
+
+/*
+ * Compiled document shape with placeholders for scalar values
+ * (see bjson_templateCreate()).
+ */
+
+typedef struct bjson_template bjson_template_t;
+
+typedef enum
+{
+  bjson_templateSlot_integer,
+  bjson_templateSlot_double,
+  bjson_templateSlot_bool,
+  bjson_templateSlot_string,
+  bjson_templateSlot_binary
+}
+bjson_templateSlot_t;
+
+/*
+ * Value filled into template slot. Member used depends on slot type.
+ */
+
+typedef union
+{
+  int     valueBoolean;
+  int64_t valueInteger;
+  double  valueDouble;
+
+  struct
+  {
+    const void *buf;
+    size_t bufLen;
+  }
+  span;
+}
+bjson_templateValue_t;
+
+/*
+ * One piece of encoded output (see bjson_encoderGetChunks()).
+ * Fields are in the same order as in POSIX struct iovec.
+ */
+
+typedef struct
+{
+  const void *buf;
+  size_t bufLen;
+}
+bjson_encoderChunk_t;
+
+/*
+ * Function receiving encoded output (see bjson_encoderSetSink()).
+ * Should return 0 if all bufLen bytes were written, any other value
+ * stops encoding with bjson_status_error_sinkFailed.
+ */
+
+typedef int (*bjson_encoderSink_t)(void *sinkCtx, const void *buf, size_t bufLen);
+
+/*
+ * Encoder statistics collected since context was created
+ * (see bjson_encoderGetStats()). Measure pass is not counted.
+ */
+
+typedef struct
+{
+  /* Number of output bytes, including ones already passed to sink. */
+  uint64_t bytesWritten;
+
+  /* Number of pushed tokens by type. Items of numeric arrays are counted one by one. */
+  uint64_t numNulls;
+  uint64_t numBools;
+  uint64_t numIntegers;
+  uint64_t numDoubles;
+  uint64_t numStrings;
+  uint64_t numKeys;
+  uint64_t numBinaries;
+  uint64_t numArrays;
+  uint64_t numMaps;
+  uint64_t numRaws;
+
+  /* Number of output buffer (re)allocations. */
+  uint64_t numReallocs;
+
+  /* Number of bytes copied by output buffer reallocations. */
+  uint64_t reallocBytesCopied;
+
+  /* Number of bytes moved to remove header gaps and flatten references. */
+  uint64_t bytesMoved;
+
+  /* Number of header bytes reserved for unsized containers, but not used. */
+  uint64_t headerBytesWasted;
+
+  /* The deepest containers nesting level reached. */
+  int maxDepth;
+}
+bjson_encoderStats_t;
+
+/*
+ * Encoder state remembered by bjson_encoderSavepoint(). Treat it as
+ * opaque, fields are private.
+ */
+
+typedef struct
+{
+  bjson_status_t statusCode;
+  int mode;
+  size_t epoch;
+  size_t outDataIdx;
+  size_t bytesNeeded;
+  int deepIdx;
+  size_t blockIdx;
+  uint8_t blockMapTurn;
+  size_t blockSlack;
+  size_t numGaps;
+  size_t numRefs;
+  size_t refBytes;
+  size_t blockRefBytes;
+  size_t numMeasured;
+  size_t nextMeasuredIdx;
+}
+bjson_encoderSavepoint_t;
+
+/*
+ * Options to tune encoder behavior (see bjson_encoderConfig()).
+ */
+
+typedef enum
+{
+  /*
+   * size_t, default SIZE_MAX (never trim).
+   * Output buffer is kept by bjson_encoderClear() for next document.
+   * If it grew over this size, then it's shrunk back to this size.
+   * Set to 0 to free it on each clear.
+   */
+
+  bjson_encoderOption_trimCapacity,
+
+  /*
+   * int, default 0 (off).
+   * If set, bjson_encodeDouble() writes integral values as the smallest
+   * integer type and values exactly representable as float32 as 5-byte
+   * float32. Decoded value is always the same as encoded one.
+   */
+
+  bjson_encoderOption_compactNumbers,
+
+  /*
+   * int, default 0 (off).
+   * If set, bjson_encodeRaw() checks structure of spliced value and
+   * fails instead of producing broken output.
+   */
+
+  bjson_encoderOption_validateRaw,
+
+  /*
+   * size_t, default SIZE_MAX (never).
+   * Strings and binaries of at least this size are not copied into
+   * output buffer, but referenced in place. Use bjson_encoderGetChunks()
+   * to get output without copying them. Caller *MUST* keep referenced
+   * data alive until output is consumed. Ignored by static encoders.
+   */
+
+  bjson_encoderOption_referenceThreshold,
+
+  /*
+   * size_t, default 0.
+   * The first output buffer allocation is at least this size, so
+   * documents up to this size are encoded without any realloc.
+   */
+
+  bjson_encoderOption_initialCapacity,
+
+  /*
+   * size_t, default 100 (double capacity).
+   * Full output buffer grows by this percent of its capacity, e.g. 50
+   * means 1.5 times bigger buffer. Lower values waste less memory on
+   * big documents, but need more reallocs. Values lower than 25 are
+   * treated as 25.
+   */
+
+  bjson_encoderOption_growthPercent
+}
+bjson_encoderOption_t;
+
 /*
  * Functions to create/destroy encoder context.
  * All other functions need this context to work.
@@ -59,6 +248,36 @@ BJSON_API bjson_encodeCtx_t *bjson_encoderCreate(
 
 BJSON_API void bjson_encoderDestroy(bjson_encodeCtx_t *encodeCtx);
 
+/*
+ * Create encoder writing into caller owned, fixed size buffer.
+ * Buffer is never reallocated. If it's too small, encoder reports
+ * bjson_status_error_bufferFull and bjson_encoderGetResult() returns
+ * number of bytes needed.
+ */
+
+BJSON_API bjson_encodeCtx_t *bjson_encoderCreateStatic(void *buf,
+                                                       size_t capacity);
+
+/*
+ * Function to create encoder context, which spills output into memory
+ * mapped temporary file instead of heap, so document may be larger than
+ * RAM. Final document is written by bjson_encoderFinish().
+ *
+ * TIP: Available on POSIX systems only.
+ */
+
+BJSON_API bjson_encodeCtx_t *bjson_encoderCreateSpill(const char *tempDir);
+
+/*
+ * Function to set up encoder options.
+ *
+ * Example:
+ *   bjson_encoderConfig(ctx, bjson_encoderOption_trimCapacity, (size_t) 65536);
+ */
+
+BJSON_API bjson_status_t
+  bjson_encoderConfig(bjson_encodeCtx_t *ctx, bjson_encoderOption_t option, ...);
+
 /*
  * Function to retrive pointer to output buffer containing encoded BJSON
  * bytes.
@@ -72,10 +291,63 @@ BJSON_API void bjson_encoderDestroy(bjson_encodeCtx_t *encodeCtx);
 BJSON_API bjson_status_t bjson_encoderGetResult(bjson_encodeCtx_t *ctx,
                                                 void **buf, size_t *bufSize);
 
+/*
+ * Function to take encoded BJSON away from encoder. Caller becomes owner
+ * of returned buffer and encoder is ready to encode next document.
+ *
+ * TIP: Each call to bjson_encoderDetachResult() *MUST* be followed by
+ *      bjson_encoderFreeResult() call.
+ */
+
+BJSON_API bjson_status_t bjson_encoderDetachResult(bjson_encodeCtx_t *ctx,
+                                                   void **buf,
+                                                   size_t *bufSize);
+
+BJSON_API void bjson_encoderFreeResult(bjson_encodeCtx_t *ctx, void *buf);
+
+/*
+ * Function to retrieve encoded BJSON as list of chunks to write in order
+ * e.g. by writev(). Referenced payloads are not copied.
+ *
+ * TIP: bjson_encoderGetResult() still returns one contiguous buffer.
+ *      Referenced payloads are copied into it at that moment.
+ */
+
+BJSON_API bjson_status_t
+  bjson_encoderGetChunks(bjson_encodeCtx_t *ctx,
+                         const bjson_encoderChunk_t **chunks,
+                         size_t *numChunks);
+
+/*
+ * Function to write finished document into file straight from encoder
+ * buffer, without compacting it in memory. Body of containers over 4GB
+ * is never moved this way.
+ */
+
+BJSON_API bjson_status_t bjson_encoderFinish(bjson_encodeCtx_t *ctx,
+                                             const char *fileName);
+
+/*
+ * Two-pass encoding. First pass measures container and total sizes,
+ * second one writes the same calls sequence into exactly allocated
+ * buffer with final headers, so no data is moved nor reallocated.
+ */
+
+BJSON_API bjson_status_t bjson_encoderBeginMeasure(bjson_encodeCtx_t *ctx);
+
+BJSON_API bjson_status_t bjson_encoderBeginWrite(bjson_encodeCtx_t *ctx,
+                                                 size_t *totalSize);
+
 /*
  * Function to manage internal encoder state.
  * These functions are helpful to reuse the same encoder context over
  * many JSON documents.
+ *
+ * TIP#1: bjson_encoderClear() discards encoded data, but keeps output
+ *        buffer, so next document is encoded without allocations.
+ *
+ * TIP#2: bjson_encoderReset() keeps encoded data and appends next
+ *        document after optional separator.
  */
 
 BJSON_API bjson_status_t bjson_encoderClear(bjson_encodeCtx_t *ctx);
@@ -83,6 +355,55 @@ BJSON_API bjson_status_t bjson_encoderClear(bjson_encodeCtx_t *ctx);
 BJSON_API bjson_status_t bjson_encoderReset(bjson_encodeCtx_t *ctx,
                                             const char *sepText);
 
+/*
+ * Output buffer capacity management. Reserve room for expected output
+ * up front to avoid reallocs, then give back unused capacity.
+ */
+
+BJSON_API bjson_status_t bjson_encoderReserve(bjson_encodeCtx_t *ctx,
+                                              size_t bytes);
+
+BJSON_API bjson_status_t bjson_encoderShrinkToFit(bjson_encodeCtx_t *ctx);
+
+/*
+ * Stream many root documents (records) one after another into caller
+ * sink e.g. file or pipe. Each record is passed to sink as soon as it's
+ * complete and output buffer is reused for next one, so memory needed
+ * is bounded by the biggest single record, not by whole stream.
+ *
+ * TIP: Typical usage looks like:
+ *
+ *      bjson_encoderSetSink(ctx, mySink, mySinkCtx)
+ *        bjson_encodeMapOpen(ctx)       <- record #1
+ *        ...
+ *        bjson_encodeMapClose(ctx)      <- record #1 passed to sink
+ *        bjson_encodeMapOpen(ctx)       <- record #2
+ *        ...
+ */
+
+BJSON_API bjson_status_t bjson_encoderSetSink(bjson_encodeCtx_t *ctx,
+                                              bjson_encoderSink_t sink,
+                                              void *sinkCtx);
+
+/*
+ * Drop part of document encoded after savepoint e.g. sub-object which
+ * turned out to be skipped or replaced halfway through. Nothing is
+ * copied, no scratch encoder is needed.
+ *
+ * TIP: Typical usage looks like:
+ *
+ *      bjson_encoderSavepoint(ctx, &sp)
+ *      bjson_encodeMapOpen(ctx)
+ *        ...                            <- sub-object must be skipped
+ *      bjson_encoderRollback(ctx, &sp)  <- map is gone, still open
+ */
+
+BJSON_API bjson_status_t bjson_encoderSavepoint(bjson_encodeCtx_t *ctx,
+                                                bjson_encoderSavepoint_t *sp);
+
+BJSON_API bjson_status_t bjson_encoderRollback(bjson_encodeCtx_t *ctx,
+                                               const bjson_encoderSavepoint_t *sp);
+
 /*
  * bjson_encodeXxx() functions to encode variety tokens into
  * output bjson stream.
@@ -94,6 +415,9 @@ BJSON_API bjson_status_t bjson_encodeInteger(bjson_encodeCtx_t *ctx,
 BJSON_API bjson_status_t bjson_encodeDouble(bjson_encodeCtx_t *ctx,
                                             double value);
 
+BJSON_API bjson_status_t bjson_encodeFloat(bjson_encodeCtx_t *ctx,
+                                           float value);
+
 BJSON_API bjson_status_t bjson_encodeNull(bjson_encodeCtx_t *ctx);
 BJSON_API bjson_status_t bjson_encodeBool(bjson_encodeCtx_t *ctx, int value);
 BJSON_API bjson_status_t bjson_encodeMapOpen(bjson_encodeCtx_t *ctx);
@@ -101,6 +425,35 @@ BJSON_API bjson_status_t bjson_encodeMapClose(bjson_encodeCtx_t *ctx);
 BJSON_API bjson_status_t bjson_encodeArrayOpen(bjson_encodeCtx_t *ctx);
 BJSON_API bjson_status_t bjson_encodeArrayClose(bjson_encodeCtx_t *ctx);
 
+/*
+ * Open container with body size known up front. Final header is written
+ * at once and body size is verified by bjson_encodeXxxClose().
+ */
+
+BJSON_API bjson_status_t bjson_encodeMapOpenSized(bjson_encodeCtx_t *ctx,
+                                                  size_t bodySize);
+
+BJSON_API bjson_status_t bjson_encodeArrayOpenSized(bjson_encodeCtx_t *ctx,
+                                                    size_t bodySize);
+
+/*
+ * Encode whole array of numbers in one call. Output is the same as
+ * bjson_encodeArrayOpen(), bjson_encodeXxx() for each value and
+ * bjson_encodeArrayClose(), but output buffer is reserved only once.
+ */
+
+BJSON_API bjson_status_t bjson_encodeInt64Array(bjson_encodeCtx_t *ctx,
+                                                const int64_t *values,
+                                                size_t numValues);
+
+BJSON_API bjson_status_t bjson_encodeDoubleArray(bjson_encodeCtx_t *ctx,
+                                                 const double *values,
+                                                 size_t numValues);
+
+BJSON_API bjson_status_t bjson_encodeFloatArray(bjson_encodeCtx_t *ctx,
+                                                const float *values,
+                                                size_t numValues);
+
 BJSON_API bjson_status_t bjson_encodeNumberFromText(bjson_encodeCtx_t *ctx,
                                                     const char *text,
                                                     size_t textLen);
@@ -116,6 +469,121 @@ BJSON_API bjson_status_t bjson_encodeBinary(bjson_encodeCtx_t *ctx,
                                             void *blob,
                                             size_t blobSize);
 
+/*
+ * Strings and binaries pushed piece by piece. Header is patched when
+ * value is ended, so payload is never collected in one buffer first.
+ */
+
+BJSON_API bjson_status_t bjson_encodeStringBegin(bjson_encodeCtx_t *ctx);
+
+BJSON_API bjson_status_t bjson_encodeStringAppend(bjson_encodeCtx_t *ctx,
+                                                  const char *text,
+                                                  size_t textLen);
+
+BJSON_API bjson_status_t bjson_encodeStringEnd(bjson_encodeCtx_t *ctx);
+
+BJSON_API bjson_status_t bjson_encodeBinaryBegin(bjson_encodeCtx_t *ctx);
+
+BJSON_API bjson_status_t bjson_encodeBinaryAppend(bjson_encodeCtx_t *ctx,
+                                                  const void *blob,
+                                                  size_t blobSize);
+
+BJSON_API bjson_status_t bjson_encodeBinaryEnd(bjson_encodeCtx_t *ctx);
+
+/*
+ * Splice complete, pre-encoded BJSON value as next array item or map
+ * value. Bytes are copied as is.
+ */
+
+BJSON_API bjson_status_t bjson_encodeRaw(bjson_encodeCtx_t *ctx,
+                                         const void *bytes,
+                                         size_t len);
+
+/*
+ * Prepared map keys. Key is encoded once and each next
+ * bjson_encodeKeyPrepared() call is just a copy.
+ *
+ * TIP#1: Each call to bjson_keyPrepare() *MUST* be followed by
+ *        bjson_keyFree() call.
+ *
+ * TIP#2: Prepared key doesn't depend on encoder context, so the same key
+ *        can be used by many encoders, also from many threads.
+ *
+ * TIP#3: Pass the same memory functions as to bjson_encoderCreate() to
+ *        keep keys on the caller's heap too. bjson_keyFree() uses them.
+ */
+
+BJSON_API bjson_preparedKey_t *bjson_keyPrepare(
+                                   const char *text,
+                                   size_t textLen,
+                                   bjson_memoryFunctions_t *memoryFunctions,
+                                   void *callerCtx);
+
+BJSON_API void bjson_keyFree(bjson_preparedKey_t *key);
+
+BJSON_API bjson_status_t bjson_encodeKeyPrepared(bjson_encodeCtx_t *ctx,
+                                                 const bjson_preparedKey_t *key);
+
+/*
+ * Message templates. Document shape is recorded once with slots in place
+ * of changing values and compiled into constant bytes. Rendering copies
+ * constant bytes, fills slots and fixes up only container sizes, which
+ * depend on slot values.
+ *
+ * TIP#1: Each call to bjson_templateCreate() *MUST* be followed by
+ *        bjson_templateDestroy() call.
+ *
+ * TIP#2: Basic usage looks like:
+ *
+ *        tpl = bjson_templateCreate(NULL, NULL)
+ *          bjson_templateMapOpen(tpl)
+ *            bjson_templateString(tpl, "id", 2)
+ *            bjson_templateSlot(tpl, bjson_templateSlot_integer)
+ *          bjson_templateMapClose(tpl)
+ *        bjson_templateCompile(tpl)
+ *
+ *        bjson_templateRender(ctx, tpl, values)
+ *        bjson_templateRender(ctx, tpl, values)
+ *        ...
+ *
+ *        bjson_templateDestroy(tpl)
+ *
+ * TIP#3: Double slots are always written as float64, so
+ *        bjson_encoderOption_compactNumbers doesn't apply to them.
+ *
+ * TIP#4: Compiled template is read only, so the same template can be
+ *        rendered by many encoders, also from many threads.
+ */
+
+BJSON_API bjson_template_t *bjson_templateCreate(
+                                bjson_memoryFunctions_t *memoryFunctions,
+                                void *callerCtx);
+
+BJSON_API void bjson_templateDestroy(bjson_template_t *tpl);
+
+BJSON_API bjson_status_t bjson_templateMapOpen(bjson_template_t *tpl);
+BJSON_API bjson_status_t bjson_templateMapClose(bjson_template_t *tpl);
+BJSON_API bjson_status_t bjson_templateArrayOpen(bjson_template_t *tpl);
+BJSON_API bjson_status_t bjson_templateArrayClose(bjson_template_t *tpl);
+
+BJSON_API bjson_status_t bjson_templateString(bjson_template_t *tpl,
+                                              const char *text,
+                                              size_t textLen);
+
+BJSON_API bjson_status_t bjson_templateRaw(bjson_template_t *tpl,
+                                           const void *bytes,
+                                           size_t len);
+
+BJSON_API bjson_status_t bjson_templateSlot(bjson_template_t *tpl,
+                                            bjson_templateSlot_t slotType);
+
+BJSON_API bjson_status_t bjson_templateCompile(bjson_template_t *tpl);
+
+BJSON_API bjson_status_t
+  bjson_templateRender(bjson_encodeCtx_t *ctx,
+                       const bjson_template_t *tpl,
+                       const bjson_templateValue_t *values);
+
 /*
  * Error handling.
  *
@@ -131,6 +599,15 @@ BJSON_API char *
 BJSON_API void
   bjson_encoderFreeErrorMessage(bjson_encodeCtx_t *ctx, char *errorMsg);
 
+/*
+ * Statistics useful to choose initial capacity and to find document
+ * shapes, which are expensive to encode. Compiled in unless library was
+ * built with BJSON_STATS_ENABLED set to 0.
+ */
+
+BJSON_API bjson_status_t
+  bjson_encoderGetStats(bjson_encodeCtx_t *ctx, bjson_encoderStats_t *stats);
+
 #ifdef __cplusplus
 }
 #endif
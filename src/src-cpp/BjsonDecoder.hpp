@@ -178,9 +178,11 @@ private:
 
   virtual void reset()
   {
-    // Possible improvement: Optimize it.
-    _clear();
-    _init();
+    // Reuse decoder context and its internal cache buffer.
+    if (_ctx != nullptr)
+    {
+      bjson_decoderReset(_ctx);
+    }
   }
 
   // ---------------------------------------------------------------------------
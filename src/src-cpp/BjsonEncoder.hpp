@@ -26,6 +26,10 @@
 #include <bjson/bjson-common.h>
 #include <bjson/bjson-encode.h>
 
+#include <cstdint>
+#include <string>
+#include <vector>
+
 // -----------------------------------------------------------------------------
 //        Helper macros to wrap pure C calbacks into C++ member calls
 // -----------------------------------------------------------------------------
@@ -45,6 +49,13 @@
   {                                               \
     encodeCString(key);                           \
     return encode##NAME();                        \
+  }                                               \
+                                                  \
+  inline bjson_status_t encodeKeyAndValue##NAME(  \
+                          const BjsonKey &key)    \
+  {                                               \
+    encodeKey(key);                               \
+    return encode##NAME();                        \
   }
 
 // Wrap C call bjson_encodeXxx(thiz, x) into C++ methods:
@@ -63,6 +74,14 @@
   {                                               \
     encodeCString(key);                           \
     return encode##NAME(x);                       \
+  }                                               \
+                                                  \
+  inline bjson_status_t encodeKeyAndValue##NAME(  \
+                           const BjsonKey &key,   \
+                                        TYPE1 x)  \
+  {                                               \
+    encodeKey(key);                               \
+    return encode##NAME(x);                       \
   }
 
 // Wrap C call bjson_encodeXxx(thiz, x, y) into:
@@ -82,8 +101,65 @@
   {                                               \
     encodeCString(key);                           \
     return encode##NAME(x, y);                    \
+  }                                               \
+                                                  \
+  inline bjson_status_t encodeKeyAndValue##NAME(  \
+                           const BjsonKey &key,   \
+                                       TYPE1 x,   \
+                                       TYPE2 y)   \
+  {                                               \
+    encodeKey(key);                               \
+    return encode##NAME(x, y);                    \
   }
 
+// -----------------------------------------------------------------------------
+//             Map key encoded once, e.g. static const BjsonKey kId("id")
+// -----------------------------------------------------------------------------
+
+class BjsonKey
+{
+
+private:
+
+  bjson_preparedKey_t *_key = nullptr;
+
+public:
+
+  // Key from string literal or char array. Text ends at the first zero
+  // byte, but never goes past the array, so half filled buffer gives
+  // the same key as its C string.
+  template <size_t N>
+  BjsonKey(const char (&text)[N]) {
+    const char *end = std::char_traits<char>::find(text, N, '\0');
+
+    _key = bjson_keyPrepare(text, end ? size_t(end - text) : N,
+                            nullptr, nullptr);
+  }
+
+  BjsonKey(const char *text, size_t textLen) {
+    _key = bjson_keyPrepare(text, textLen, nullptr, nullptr);
+  }
+
+  BjsonKey(const std::string &text) {
+    _key = bjson_keyPrepare(text.data(), text.size(), nullptr, nullptr);
+  }
+
+  BjsonKey(BjsonKey const&)             = delete;
+  BjsonKey& operator =(BjsonKey const&) = delete;
+
+  BjsonKey(BjsonKey &&other) {
+    _key       = other._key;
+    other._key = nullptr;
+  }
+
+  virtual ~BjsonKey()
+  {
+    bjson_keyFree(_key);
+  }
+
+  const bjson_preparedKey_t *get() const { return _key; }
+};
+
 class BjsonEncoder
 {
 
@@ -103,6 +179,19 @@ public:
     _ctx      = bjson_encoderCreate(nullptr, nullptr);
   }
 
+  // Encode into caller owned, fixed size buffer (no allocations).
+  BjsonEncoder(void *buf, size_t capacity) {
+    _errorMsg = nullptr;
+    _ctx      = bjson_encoderCreateStatic(buf, capacity);
+  }
+
+  // Spill output into memory mapped temporary file created in spillDir
+  // (nullptr for default one). Use finish() to write final document.
+  explicit BjsonEncoder(const char *spillDir) {
+    _errorMsg = nullptr;
+    _ctx      = bjson_encoderCreateSpill(spillDir);
+  }
+
   BjsonEncoder(BjsonEncoder const&)             = default;
   BjsonEncoder& operator =(BjsonEncoder const&) = default;
   BjsonEncoder(BjsonEncoder&&)                  = default;
@@ -132,7 +221,106 @@ public:
 
   bjson_status_t getResult(void **buf, size_t *bufSize) { return bjson_encoderGetResult(_ctx, buf, bufSize); }
   bjson_status_t clear()                                { return bjson_encoderClear(_ctx);                   }
-  bjson_status_t reset(const char *sepText)             { return bjson_encoderReset(_ctx, sepText);          }
+  bjson_status_t reserve(size_t bytes)                  { return bjson_encoderReserve(_ctx, bytes);          }
+  bjson_status_t shrinkToFit()                          { return bjson_encoderShrinkToFit(_ctx);             }
+  bjson_status_t reset(const char *sepText = nullptr)   { return bjson_encoderReset(_ctx, sepText);          }
+
+  bjson_status_t detachResult(void **buf, size_t *bufSize) { return bjson_encoderDetachResult(_ctx, buf, bufSize); }
+  bjson_status_t finish(const char *fileName)              { return bjson_encoderFinish(_ctx, fileName);          }
+  void           freeResult(void *buf)                    { bjson_encoderFreeResult(_ctx, buf);                  }
+
+  // Move encoded document out into std container and clear encoder.
+  // Standard containers can't adopt foreign allocation, so bytes are
+  // copied once, but output buffer is kept for next document.
+  // Empty container is returned if error.
+
+  std::vector<uint8_t> detachVector()
+  {
+    std::vector<uint8_t> rv;
+
+    void  *buf     = nullptr;
+    size_t bufSize = 0;
+
+    if (bjson_encoderGetResult(_ctx, &buf, &bufSize) == bjson_status_ok && buf)
+    {
+      rv.assign((const uint8_t *) buf, (const uint8_t *) buf + bufSize);
+      bjson_encoderClear(_ctx);
+    }
+
+    return rv;
+  }
+
+  std::string detachString()
+  {
+    std::string rv;
+
+    void  *buf     = nullptr;
+    size_t bufSize = 0;
+
+    if (bjson_encoderGetResult(_ctx, &buf, &bufSize) == bjson_status_ok && buf)
+    {
+      rv.assign((const char *) buf, bufSize);
+      bjson_encoderClear(_ctx);
+    }
+
+    return rv;
+  }
+
+  bjson_status_t setTrimCapacity(size_t capacity)
+  {
+    return bjson_encoderConfig(_ctx, bjson_encoderOption_trimCapacity, capacity);
+  }
+
+  bjson_status_t setCompactNumbers(int enabled)
+  {
+    return bjson_encoderConfig(_ctx, bjson_encoderOption_compactNumbers, enabled);
+  }
+
+  bjson_status_t setValidateRaw(int enabled)
+  {
+    return bjson_encoderConfig(_ctx, bjson_encoderOption_validateRaw, enabled);
+  }
+
+  bjson_status_t setReferenceThreshold(size_t threshold)
+  {
+    return bjson_encoderConfig(_ctx, bjson_encoderOption_referenceThreshold, threshold);
+  }
+
+  bjson_status_t getChunks(const bjson_encoderChunk_t **chunks, size_t *numChunks)
+  {
+    return bjson_encoderGetChunks(_ctx, chunks, numChunks);
+  }
+
+  bjson_status_t setSink(bjson_encoderSink_t sink, void *sinkCtx = nullptr)
+  {
+    return bjson_encoderSetSink(_ctx, sink, sinkCtx);
+  }
+
+  bjson_status_t savepoint(bjson_encoderSavepoint_t &sp)
+  {
+    return bjson_encoderSavepoint(_ctx, &sp);
+  }
+
+  bjson_status_t rollback(const bjson_encoderSavepoint_t &sp)
+  {
+    return bjson_encoderRollback(_ctx, &sp);
+  }
+
+  bjson_status_t getStats(bjson_encoderStats_t &stats)
+  {
+    return bjson_encoderGetStats(_ctx, &stats);
+  }
+
+  bjson_status_t encodeKey(const BjsonKey &key)
+  {
+    return bjson_encodeKeyPrepared(_ctx, key.get());
+  }
+
+  bjson_status_t renderTemplate(const bjson_template_t *tpl,
+                                const bjson_templateValue_t *values)
+  {
+    return bjson_templateRender(_ctx, tpl, values);
+  }
 
   // ---------------------------------------------------------------------------
   //               Wrappers for zero-args encode functions
@@ -143,6 +331,8 @@ public:
   BJSON_CPP_ENCODE0(MapClose)
   BJSON_CPP_ENCODE0(ArrayOpen)
   BJSON_CPP_ENCODE0(ArrayClose)
+  BJSON_CPP_ENCODE0(StringBegin)
+  BJSON_CPP_ENCODE0(BinaryBegin)
 
   // ---------------------------------------------------------------------------
   //                Wrappers for one-arg encode functions
@@ -150,8 +340,11 @@ public:
 
   BJSON_CPP_ENCODE1(Integer, int64_t)
   BJSON_CPP_ENCODE1(Double, double)
+  BJSON_CPP_ENCODE1(Float, float)
   BJSON_CPP_ENCODE1(Bool, int)
   BJSON_CPP_ENCODE1(CString, const char *)
+  BJSON_CPP_ENCODE1(MapOpenSized, size_t)
+  BJSON_CPP_ENCODE1(ArrayOpenSized, size_t)
 
   // ---------------------------------------------------------------------------
   //                Wrappers for two-args encode functions
@@ -160,6 +353,19 @@ public:
   BJSON_CPP_ENCODE2(NumberFromText, const char *, size_t)
   BJSON_CPP_ENCODE2(String, const char *, size_t)
   BJSON_CPP_ENCODE2(Binary, void *, size_t)
+  BJSON_CPP_ENCODE2(Raw, const void *, size_t)
+  BJSON_CPP_ENCODE2(Int64Array, const int64_t *, size_t)
+  BJSON_CPP_ENCODE2(DoubleArray, const double *, size_t)
+  BJSON_CPP_ENCODE2(FloatArray, const float *, size_t)
+
+  // ---------------------------------------------------------------------------
+  //      Streamed values, open by encode[KeyAndValue]StringBegin/BinaryBegin
+  // ---------------------------------------------------------------------------
+
+  bjson_status_t encodeStringAppend(const char *text, size_t textLen)  { return bjson_encodeStringAppend(_ctx, text, textLen);  }
+  bjson_status_t encodeStringEnd()                                     { return bjson_encodeStringEnd(_ctx);                    }
+  bjson_status_t encodeBinaryAppend(const void *blob, size_t blobSize) { return bjson_encodeBinaryAppend(_ctx, blob, blobSize); }
+  bjson_status_t encodeBinaryEnd()                                     { return bjson_encodeBinaryEnd(_ctx);                    }
 
   // ---------------------------------------------------------------------------
   //              Wrappers for status management functions
@@ -0,0 +1,568 @@
+/*
+ * Copyright (c) 2017 by Kemu Studio (visit ke.mu)
+ *
+ * Author(s): Sylwester Wysocki <sw@ke.mu>,
+ *            Roman Pietrzak <rp@ke.mu>
+ *
+ * This file is a part of the KEMU Binary JSON library.
+ * See http://bjson.org for more.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Encoder benchmarks. Not a part of test suite, run it by hand:
+ *
+ *   bjson-bench [--messages <number-of-messages>] [file.bjson ...]
+ *
+ * Each file given is decoded once into events list, then the events are
+ * encoded back over and over. Output is verified against input file.
+ */
+
+/* ----------------------------------------------------------------------------
+ *                                    Includes
+ * ---------------------------------------------------------------------------*/
+
+#include <bjson/bjson-decode.h>
+#include <bjson/bjson-encode.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* ----------------------------------------------------------------------------
+ *                           Defines and helper macros.
+ * ---------------------------------------------------------------------------*/
+
+#define DEFAULT_NUMBER_OF_MESSAGES 1000000
+
+/* Repeat round trips of one file at least such long. */
+#define MIN_ROUND_TRIP_TIME (CLOCKS_PER_SEC / 4)
+
+#define DIE(...) {fprintf(stderr, __VA_ARGS__); exit(-1);}
+
+/* ----------------------------------------------------------------------------
+ *                                 Global data.
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * Decoder events recorded from one input file.
+ */
+
+static bjson_decoderEvent_t *g_events = NULL;
+static size_t g_numEvents             = 0;
+static size_t g_eventsCapacity        = 0;
+
+/* ----------------------------------------------------------------------------
+ *                               Helper functions.
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * Encode one small RPC-like message e.g.:
+ * {"id": 1234, "method": "getStatus", "params": [1, 2.5, true, null]}
+ */
+
+static void bench_encodeMessage(bjson_encodeCtx_t *ctx, int64_t id)
+{
+  bjson_encodeMapOpen(ctx);
+    bjson_encodeCString(ctx, "id");
+    bjson_encodeInteger(ctx, id);
+    bjson_encodeCString(ctx, "method");
+    bjson_encodeCString(ctx, "getStatus");
+    bjson_encodeCString(ctx, "params");
+    bjson_encodeArrayOpen(ctx);
+      bjson_encodeInteger(ctx, 1);
+      bjson_encodeDouble(ctx, 2.5);
+      bjson_encodeBool(ctx, 1);
+      bjson_encodeNull(ctx);
+    bjson_encodeArrayClose(ctx);
+  bjson_encodeMapClose(ctx);
+}
+
+/*
+ * Batch callback to collect all decoded events. Strings point into input
+ * buffer, which is kept alive while benchmark runs.
+ */
+
+static bjson_decoderCallbackResult_t bench_recordEvents(
+                                        void *ctx,
+                                        const bjson_decoderEvent_t *events,
+                                        size_t numEvents)
+{
+  (void)ctx;
+
+  if (g_numEvents + numEvents > g_eventsCapacity)
+  {
+    g_eventsCapacity = (g_numEvents + numEvents) * 2;
+    g_events         = realloc(g_events,
+                               g_eventsCapacity * sizeof(bjson_decoderEvent_t));
+
+    if (g_events == NULL)
+    {
+      DIE("ERROR: Out of memory.\n");
+    }
+  }
+
+  memcpy(g_events + g_numEvents, events, numEvents * sizeof(bjson_decoderEvent_t));
+
+  g_numEvents += numEvents;
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+/*
+ * Encode recorded events back into BJSON.
+ */
+
+static void bench_replayEvents(bjson_encodeCtx_t *ctx)
+{
+  size_t i = 0;
+
+  for (i = 0; i < g_numEvents; i++)
+  {
+    const bjson_decoderEvent_t *event = &g_events[i];
+
+    switch (event->type)
+    {
+      case bjson_decoderEvent_null:
+        bjson_encodeNull(ctx);
+        break;
+
+      case bjson_decoderEvent_boolean:
+        bjson_encodeBool(ctx, event->value.valueBoolean);
+        break;
+
+      case bjson_decoderEvent_integer:
+        bjson_encodeInteger(ctx, event->value.valueInteger);
+        break;
+
+      case bjson_decoderEvent_double:
+        bjson_encodeDouble(ctx, event->value.valueDouble);
+        break;
+
+      case bjson_decoderEvent_string:
+      case bjson_decoderEvent_mapKey:
+        bjson_encodeString(ctx, event->value.span.buf, event->value.span.bufLen);
+        break;
+
+      case bjson_decoderEvent_binary:
+        bjson_encodeBinary(ctx, (void *) event->value.span.buf,
+                           event->value.span.bufLen);
+        break;
+
+      case bjson_decoderEvent_startMap:
+        bjson_encodeMapOpen(ctx);
+        break;
+
+      case bjson_decoderEvent_endMap:
+        bjson_encodeMapClose(ctx);
+        break;
+
+      case bjson_decoderEvent_startArray:
+        bjson_encodeArrayOpen(ctx);
+        break;
+
+      case bjson_decoderEvent_endArray:
+        bjson_encodeArrayClose(ctx);
+        break;
+
+      default:
+        break;
+    }
+  }
+}
+
+/*
+ * The same message, but map keys are prepared once.
+ */
+
+static bjson_preparedKey_t *g_keyId     = NULL;
+static bjson_preparedKey_t *g_keyMethod = NULL;
+static bjson_preparedKey_t *g_keyParams = NULL;
+
+static void bench_encodeMessagePrepared(bjson_encodeCtx_t *ctx, int64_t id)
+{
+  bjson_encodeMapOpen(ctx);
+    bjson_encodeKeyPrepared(ctx, g_keyId);
+    bjson_encodeInteger(ctx, id);
+    bjson_encodeKeyPrepared(ctx, g_keyMethod);
+    bjson_encodeCString(ctx, "getStatus");
+    bjson_encodeKeyPrepared(ctx, g_keyParams);
+    bjson_encodeArrayOpen(ctx);
+      bjson_encodeInteger(ctx, 1);
+      bjson_encodeDouble(ctx, 2.5);
+      bjson_encodeBool(ctx, 1);
+      bjson_encodeNull(ctx);
+    bjson_encodeArrayClose(ctx);
+  bjson_encodeMapClose(ctx);
+}
+
+static void bench_report(const char *name, clock_t elapsed,
+                         size_t numMessages, size_t numBytes)
+{
+  double seconds = (double) elapsed / CLOCKS_PER_SEC;
+
+  printf("%-32s %10.1f ns/message %10.1f MB/s\n", name,
+         seconds * 1e9 / numMessages,
+         numBytes / seconds / 1e6);
+}
+
+/* ----------------------------------------------------------------------------
+ *                                 Benchmarks.
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * Create new encoder for each message.
+ */
+
+static void bench_createPerMessage(size_t numMessages)
+{
+  clock_t start   = clock();
+  size_t numBytes = 0;
+  size_t i        = 0;
+
+  for (i = 0; i < numMessages; i++)
+  {
+    bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
+
+    void *buf      = NULL;
+    size_t bufSize = 0;
+
+    bench_encodeMessage(ctx, i);
+
+    if (bjson_encoderGetResult(ctx, &buf, &bufSize) != bjson_status_ok)
+    {
+      DIE("ERROR: Can't encode message.\n");
+    }
+
+    numBytes += bufSize;
+
+    bjson_encoderDestroy(ctx);
+  }
+
+  bench_report("create per message", clock() - start, numMessages, numBytes);
+}
+
+/*
+ * Reuse one encoder, call bjson_encoderClear() after each message.
+ */
+
+static void bench_clearPerMessage(size_t numMessages)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
+
+  clock_t start   = clock();
+  size_t numBytes = 0;
+  size_t i        = 0;
+
+  for (i = 0; i < numMessages; i++)
+  {
+    void *buf      = NULL;
+    size_t bufSize = 0;
+
+    bench_encodeMessage(ctx, i);
+
+    if (bjson_encoderGetResult(ctx, &buf, &bufSize) != bjson_status_ok)
+    {
+      DIE("ERROR: Can't encode message.\n");
+    }
+
+    numBytes += bufSize;
+
+    bjson_encoderClear(ctx);
+  }
+
+  bench_report("clear per message", clock() - start, numMessages, numBytes);
+
+  bjson_encoderDestroy(ctx);
+}
+
+/*
+ * Reuse one encoder and prepared map keys.
+ */
+
+static void bench_preparedKeysPerMessage(size_t numMessages)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
+
+  clock_t start   = 0;
+  size_t numBytes = 0;
+  size_t i        = 0;
+
+  g_keyId     = bjson_keyPrepare("id", 2, NULL, NULL);
+  g_keyMethod = bjson_keyPrepare("method", 6, NULL, NULL);
+  g_keyParams = bjson_keyPrepare("params", 6, NULL, NULL);
+
+  start = clock();
+
+  for (i = 0; i < numMessages; i++)
+  {
+    void *buf      = NULL;
+    size_t bufSize = 0;
+
+    bench_encodeMessagePrepared(ctx, i);
+
+    if (bjson_encoderGetResult(ctx, &buf, &bufSize) != bjson_status_ok)
+    {
+      DIE("ERROR: Can't encode message.\n");
+    }
+
+    numBytes += bufSize;
+
+    bjson_encoderClear(ctx);
+  }
+
+  bench_report("prepared keys per message", clock() - start, numMessages, numBytes);
+
+  bjson_keyFree(g_keyId);
+  bjson_keyFree(g_keyMethod);
+  bjson_keyFree(g_keyParams);
+
+  bjson_encoderDestroy(ctx);
+}
+
+/*
+ * Reuse one encoder and render the same message from compiled template.
+ */
+
+static void bench_templatePerMessage(size_t numMessages)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
+  bjson_template_t *tpl  = bjson_templateCreate(NULL, NULL);
+
+  clock_t start   = 0;
+  size_t numBytes = 0;
+  size_t i        = 0;
+
+  uint8_t nullValue = 0;
+
+  bjson_templateMapOpen(tpl);
+    bjson_templateString(tpl, "id", 2);
+    bjson_templateSlot(tpl, bjson_templateSlot_integer);
+    bjson_templateString(tpl, "method", 6);
+    bjson_templateString(tpl, "getStatus", 9);
+    bjson_templateString(tpl, "params", 6);
+    bjson_templateArrayOpen(tpl);
+      bjson_templateSlot(tpl, bjson_templateSlot_integer);
+      bjson_templateSlot(tpl, bjson_templateSlot_double);
+      bjson_templateSlot(tpl, bjson_templateSlot_bool);
+      bjson_templateRaw(tpl, &nullValue, 1);
+    bjson_templateArrayClose(tpl);
+  bjson_templateMapClose(tpl);
+
+  if (bjson_templateCompile(tpl) != bjson_status_ok)
+  {
+    DIE("ERROR: Can't compile template.\n");
+  }
+
+  start = clock();
+
+  for (i = 0; i < numMessages; i++)
+  {
+    bjson_templateValue_t values[4];
+
+    void *buf      = NULL;
+    size_t bufSize = 0;
+
+    values[0].valueInteger = i;
+    values[1].valueInteger = 1;
+    values[2].valueDouble  = 2.5;
+    values[3].valueBoolean = 1;
+
+    bjson_templateRender(ctx, tpl, values);
+
+    if (bjson_encoderGetResult(ctx, &buf, &bufSize) != bjson_status_ok)
+    {
+      DIE("ERROR: Can't render message.\n");
+    }
+
+    numBytes += bufSize;
+
+    bjson_encoderClear(ctx);
+  }
+
+  bench_report("template per message", clock() - start, numMessages, numBytes);
+
+  bjson_templateDestroy(tpl);
+  bjson_encoderDestroy(ctx);
+}
+
+/*
+ * Decode given file once, then encode it back many times using one,
+ * cleared encoder. Output must be equal to input.
+ */
+
+static void bench_roundTrip(const char *fileName)
+{
+  bjson_decoderCallbacks_t callbacks = {0};
+
+  bjson_decodeCtx_t *decodeCtx = NULL;
+  bjson_encodeCtx_t *encodeCtx = NULL;
+
+  const char *shortName = strrchr(fileName, '/');
+
+  unsigned char *input = NULL;
+  size_t inputSize     = 0;
+  size_t numRounds     = 0;
+
+  clock_t start = 0;
+
+  FILE *file = fopen(fileName, "rb");
+
+  if (file == NULL)
+  {
+    DIE("ERROR: Can't open '%s'.\n", fileName);
+  }
+
+  fseek(file, 0, SEEK_END);
+  inputSize = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  input = malloc(inputSize + 1);
+
+  if (input == NULL || fread(input, 1, inputSize, file) != inputSize)
+  {
+    DIE("ERROR: Can't read '%s'.\n", fileName);
+  }
+
+  fclose(file);
+
+  /*
+   * Record decoder events once.
+   */
+
+  g_numEvents = 0;
+
+  decodeCtx = bjson_decoderCreate(&callbacks, NULL, NULL);
+
+  bjson_decoderConfig(decodeCtx, bjson_decoderOption_batchCallback,
+                      bench_recordEvents);
+
+  if (bjson_decoderParse(decodeCtx, input, inputSize) != bjson_status_ok ||
+      bjson_decoderComplete(decodeCtx) != bjson_status_ok ||
+      g_numEvents == 0)
+  {
+    /* Not a valid document. Nothing to benchmark. */
+    bjson_decoderDestroy(decodeCtx);
+    free(input);
+
+    return;
+  }
+
+  /*
+   * Encode recorded events back until minimal time elapsed.
+   */
+
+  encodeCtx = bjson_encoderCreate(NULL, NULL);
+
+  /*
+   * Double number of rounds until it takes long enough to measure.
+   */
+
+  for (numRounds = 1; ; numRounds *= 2)
+  {
+    size_t i = 0;
+
+    start = clock();
+
+    for (i = 0; i < numRounds; i++)
+    {
+      void *output      = NULL;
+      size_t outputSize = 0;
+
+      bench_replayEvents(encodeCtx);
+
+      if (bjson_encoderGetResult(encodeCtx, &output, &outputSize) != bjson_status_ok ||
+          outputSize != inputSize ||
+          memcmp(output, input, inputSize) != 0)
+      {
+        DIE("ERROR: Round trip of '%s' differs from input.\n", fileName);
+      }
+
+      bjson_encoderClear(encodeCtx);
+    }
+
+    if (clock() - start >= MIN_ROUND_TRIP_TIME)
+    {
+      break;
+    }
+  }
+
+  bench_report(shortName ? shortName + 1 : fileName, clock() - start,
+               numRounds, numRounds * inputSize);
+
+  bjson_encoderDestroy(encodeCtx);
+  bjson_decoderDestroy(decodeCtx);
+
+  free(input);
+}
+
+/* ----------------------------------------------------------------------------
+ *                                Entry point.
+ * ---------------------------------------------------------------------------*/
+
+int main(int argc, char **argv)
+{
+  size_t numMessages = DEFAULT_NUMBER_OF_MESSAGES;
+
+  int firstFileIdx = argc;
+  int i            = 0;
+
+  /*
+   * Parse command line parameters.
+   */
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--messages") == 0 && i < argc - 1)
+    {
+      numMessages = atoi(argv[i+1]);
+
+      i++;
+    }
+    else if (argv[i][0] == '-')
+    {
+      DIE("ERROR: Unknown parameter [%s].\n", argv[i]);
+    }
+    else
+    {
+      /* Rest of parameters are files to round trip. */
+      firstFileIdx = i;
+
+      break;
+    }
+  }
+
+  /*
+   * Per message encode benchmarks.
+   */
+
+  bench_createPerMessage(numMessages);
+  bench_clearPerMessage(numMessages);
+  bench_preparedKeysPerMessage(numMessages);
+  bench_templatePerMessage(numMessages);
+
+  /*
+   * Encode round trips of given files.
+   */
+
+  for (i = firstFileIdx; i < argc; i++)
+  {
+    bench_roundTrip(argv[i]);
+  }
+
+  free(g_events);
+
+  return 0;
+}
@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2017 by Kemu Studio (visit ke.mu)
+ *
+ * Author(s): Sylwester Wysocki <sw@ke.mu>,
+ *            Roman Pietrzak <rp@ke.mu>
+ *
+ * This file is a part of the KEMU Binary JSON library.
+ * See http://bjson.org for more.
+ *
+ * Permission to use, copy, modify, and/or distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Huge documents test. Not a part of test suite (it needs a few GB of
+ * free disk space and a few minutes), run it by hand:
+ *
+ *   bjson-huge [--size <megabytes>] [--part <megabytes>]
+ *
+ * Document like below is generated with total size over given one
+ * (4200 MB by default, so root map and parts array are over 4GB):
+ *
+ *   {"name": "huge", "parts": [{"id": 0, "data": <binary>}, ...],
+ *    "tail": [1, 2, {"x": 3}]}
+ *
+ * Binary payloads come from sparse memory mapping, so they need no RAM.
+ * Encoders allocate memory through mmap-backed allocator using temporary
+ * files, so output can be paged out to disk on ordinary box.
+ *
+ * The same document is encoded in a few ways and output of each one is
+ * hashed. All hashes must be the same:
+ *
+ * - one pass, output compacted in memory (bjson_encoderGetResult()),
+ * - two passes, headers written up front (nothing compacted),
+ * - spilled into temporary file (bjson_encoderFinish()),
+ * - into static buffer (headers completed in place),
+ * - payloads referenced in place (bjson_encoderGetChunks()),
+ * - streamed into sink with payloads referenced in place.
+ */
+
+/* ----------------------------------------------------------------------------
+ *                                    Includes
+ * ---------------------------------------------------------------------------*/
+
+#include <bjson/bjson-encode.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* ----------------------------------------------------------------------------
+ *                           Defines and helper macros.
+ * ---------------------------------------------------------------------------*/
+
+#define DEFAULT_SIZE_MB 4200
+#define DEFAULT_PART_MB 256
+
+#define MEGABYTE ((size_t) 1024 * 1024)
+
+/* Payloads at least such big are referenced in place. */
+#define REFERENCE_THRESHOLD MEGABYTE
+
+#define DIE(...) {fprintf(stderr, __VA_ARGS__); exit(-1);}
+
+/* ----------------------------------------------------------------------------
+ *                      mmap-backed allocator for encoder
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * Each block is a temporary file mapped into memory. Block header is put
+ * in front of caller data.
+ */
+
+typedef struct
+{
+  size_t size;
+  int fd;
+}
+huge_blockHeader_t;
+
+#define HUGE_BLOCK_HEADER_SIZE 64
+
+static void *huge_mapBlock(int fd, size_t size)
+{
+  void *block = NULL;
+
+  if (ftruncate(fd, (off_t) (HUGE_BLOCK_HEADER_SIZE + size)) != 0)
+  {
+    return NULL;
+  }
+
+  block = mmap(NULL, HUGE_BLOCK_HEADER_SIZE + size,
+               PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+  if (block == MAP_FAILED)
+  {
+    return NULL;
+  }
+
+  ((huge_blockHeader_t *) block)->size = size;
+  ((huge_blockHeader_t *) block)->fd   = fd;
+
+  return (uint8_t *) block + HUGE_BLOCK_HEADER_SIZE;
+}
+
+static void *huge_malloc(void *ctx, size_t size)
+{
+  char path[] = "/tmp/bjson-huge-XXXXXX";
+
+  void *rv = NULL;
+  int fd   = mkstemp(path);
+
+  (void) ctx;
+
+  if (fd == -1)
+  {
+    return NULL;
+  }
+
+  unlink(path);
+
+  rv = huge_mapBlock(fd, size);
+
+  if (rv == NULL)
+  {
+    close(fd);
+  }
+
+  return rv;
+}
+
+static void huge_free(void *ctx, void *ptr)
+{
+  (void) ctx;
+
+  if (ptr)
+  {
+    huge_blockHeader_t *header = (huge_blockHeader_t *)
+                                   ((uint8_t *) ptr - HUGE_BLOCK_HEADER_SIZE);
+    int fd = header->fd;
+
+    munmap(header, HUGE_BLOCK_HEADER_SIZE + header->size);
+    close(fd);
+  }
+}
+
+static void *huge_realloc(void *ctx, void *ptr, size_t newSize)
+{
+  huge_blockHeader_t *header = NULL;
+
+  int fd = -1;
+
+  if (ptr == NULL)
+  {
+    return huge_malloc(ctx, newSize);
+  }
+
+  /*
+   * Data stays in the file. Just resize it and map once again.
+   */
+
+  header = (huge_blockHeader_t *) ((uint8_t *) ptr - HUGE_BLOCK_HEADER_SIZE);
+  fd     = header->fd;
+
+  munmap(header, HUGE_BLOCK_HEADER_SIZE + header->size);
+
+  return huge_mapBlock(fd, newSize);
+}
+
+static bjson_memoryFunctions_t g_hugeMemoryFunctions =
+{
+  huge_malloc,
+  huge_free,
+  huge_realloc,
+  NULL
+};
+
+/* ----------------------------------------------------------------------------
+ *                                Output hashing
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * FNV-1a over 64-bit words. Output comes in pieces of any size, so
+ * bytes are collected into words first.
+ */
+
+typedef struct
+{
+  uint64_t hash;
+  uint64_t size;
+
+  uint8_t pending[8];
+  size_t numPending;
+}
+huge_hash_t;
+
+static void huge_hashInit(huge_hash_t *h)
+{
+  memset(h, 0, sizeof(*h));
+
+  h->hash = 14695981039346656037ULL;
+}
+
+static void huge_hashWord(huge_hash_t *h, uint64_t word)
+{
+  h->hash ^= word;
+  h->hash *= 1099511628211ULL;
+}
+
+static void huge_hashUpdate(huge_hash_t *h, const void *buf, size_t bufLen)
+{
+  const uint8_t *data = buf;
+
+  uint64_t word = 0;
+
+  h->size += bufLen;
+
+  while (bufLen > 0 && h->numPending > 0 && h->numPending < 8)
+  {
+    h->pending[h->numPending++] = *data++;
+    bufLen--;
+
+    if (h->numPending == 8)
+    {
+      memcpy(&word, h->pending, 8);
+      huge_hashWord(h, word);
+      h->numPending = 0;
+    }
+  }
+
+  while (bufLen >= 8)
+  {
+    memcpy(&word, data, 8);
+    huge_hashWord(h, word);
+
+    data   += 8;
+    bufLen -= 8;
+  }
+
+  while (bufLen > 0)
+  {
+    h->pending[h->numPending++] = *data++;
+    bufLen--;
+  }
+}
+
+static uint64_t huge_hashFinish(huge_hash_t *h)
+{
+  size_t i = 0;
+
+  for (i = 0; i < h->numPending; i++)
+  {
+    huge_hashWord(h, h->pending[i]);
+  }
+
+  h->numPending = 0;
+
+  return h->hash;
+}
+
+static int huge_hashSink(void *sinkCtx, const void *buf, size_t bufLen)
+{
+  huge_hashUpdate((huge_hash_t *) sinkCtx, buf, bufLen);
+
+  return 0;
+}
+
+/* ----------------------------------------------------------------------------
+ *                              Document generator
+ * ---------------------------------------------------------------------------*/
+
+static uint8_t *g_payload = NULL;
+
+static size_t g_partSize = 0;
+static size_t g_numParts = 0;
+
+/* Output size known from the first way. */
+static size_t g_outputSize = 0;
+
+static void huge_encodeDocument(bjson_encodeCtx_t *ctx)
+{
+  size_t i = 0;
+
+  bjson_encodeMapOpen(ctx);
+    bjson_encodeCString(ctx, "name");
+    bjson_encodeCString(ctx, "huge");
+
+    bjson_encodeCString(ctx, "parts");
+    bjson_encodeArrayOpen(ctx);
+
+    for (i = 0; i < g_numParts; i++)
+    {
+      bjson_encodeMapOpen(ctx);
+        bjson_encodeCString(ctx, "id");
+        bjson_encodeInteger(ctx, (int64_t) i);
+        bjson_encodeCString(ctx, "data");
+        bjson_encodeBinary(ctx, g_payload, g_partSize);
+      bjson_encodeMapClose(ctx);
+    }
+
+    bjson_encodeArrayClose(ctx);
+
+    bjson_encodeCString(ctx, "tail");
+    bjson_encodeArrayOpen(ctx);
+      bjson_encodeInteger(ctx, 1);
+      bjson_encodeInteger(ctx, 2);
+      bjson_encodeMapOpen(ctx);
+        bjson_encodeCString(ctx, "x");
+        bjson_encodeInteger(ctx, 3);
+      bjson_encodeMapClose(ctx);
+    bjson_encodeArrayClose(ctx);
+  bjson_encodeMapClose(ctx);
+}
+
+/* ----------------------------------------------------------------------------
+ *                            Encode ways to compare
+ * ---------------------------------------------------------------------------*/
+
+static bjson_status_t huge_onePass(huge_hash_t *h)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(&g_hugeMemoryFunctions, NULL);
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  void *buf      = NULL;
+  size_t bufSize = 0;
+
+  huge_encodeDocument(ctx);
+
+  statusCode = bjson_encoderGetResult(ctx, &buf, &bufSize);
+
+  if (statusCode == bjson_status_ok)
+  {
+    huge_hashUpdate(h, buf, bufSize);
+  }
+
+  bjson_encoderDestroy(ctx);
+
+  return statusCode;
+}
+
+static bjson_status_t huge_twoPass(huge_hash_t *h)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(&g_hugeMemoryFunctions, NULL);
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  void *buf      = NULL;
+  size_t bufSize = 0;
+
+  bjson_encoderBeginMeasure(ctx);
+  huge_encodeDocument(ctx);
+  bjson_encoderBeginWrite(ctx, NULL);
+  huge_encodeDocument(ctx);
+
+  statusCode = bjson_encoderGetResult(ctx, &buf, &bufSize);
+
+  if (statusCode == bjson_status_ok)
+  {
+    huge_hashUpdate(h, buf, bufSize);
+  }
+
+  bjson_encoderDestroy(ctx);
+
+  return statusCode;
+}
+
+static bjson_status_t huge_spill(huge_hash_t *h)
+{
+  char path[] = "/tmp/bjson-huge-out-XXXXXX";
+
+  bjson_encodeCtx_t *ctx = bjson_encoderCreateSpill(NULL);
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  int fd = mkstemp(path);
+
+  if (ctx == NULL || fd == -1)
+  {
+    DIE("ERROR: Can't create temporary files.\n");
+  }
+
+  huge_encodeDocument(ctx);
+
+  statusCode = bjson_encoderFinish(ctx, path);
+
+  bjson_encoderDestroy(ctx);
+
+  if (statusCode == bjson_status_ok)
+  {
+    off_t fileSize = lseek(fd, 0, SEEK_END);
+
+    void *data = mmap(NULL, (size_t) fileSize, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (data == MAP_FAILED)
+    {
+      DIE("ERROR: Can't map '%s'.\n", path);
+    }
+
+    huge_hashUpdate(h, data, (size_t) fileSize);
+
+    munmap(data, (size_t) fileSize);
+  }
+
+  close(fd);
+  unlink(path);
+
+  return statusCode;
+}
+
+static bjson_status_t huge_static(huge_hash_t *h)
+{
+  bjson_encodeCtx_t *ctx = NULL;
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  void *staticBuf = NULL;
+  void *buf       = NULL;
+  size_t bufSize  = g_outputSize;
+  int tryIdx      = 0;
+
+  /*
+   * Placeholders of open containers need a few bytes more than final
+   * output. Retry with size reported by encoder if needed.
+   */
+
+  for (tryIdx = 0; tryIdx < 2; tryIdx++)
+  {
+    size_t capacity = bufSize;
+
+    staticBuf = huge_malloc(NULL, capacity);
+
+    if (staticBuf == NULL)
+    {
+      DIE("ERROR: Can't allocate static buffer.\n");
+    }
+
+    ctx = bjson_encoderCreateStatic(staticBuf, capacity);
+
+    huge_encodeDocument(ctx);
+
+    statusCode = bjson_encoderGetResult(ctx, &buf, &bufSize);
+
+    if (statusCode != bjson_status_error_bufferFull)
+    {
+      break;
+    }
+
+    bjson_encoderDestroy(ctx);
+    huge_free(NULL, staticBuf);
+  }
+
+  if (statusCode == bjson_status_ok)
+  {
+    huge_hashUpdate(h, buf, bufSize);
+  }
+
+  bjson_encoderDestroy(ctx);
+  huge_free(NULL, staticBuf);
+
+  return statusCode;
+}
+
+static bjson_status_t huge_chunks(huge_hash_t *h)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(&g_hugeMemoryFunctions, NULL);
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  const bjson_encoderChunk_t *chunks = NULL;
+
+  size_t numChunks = 0;
+  size_t i         = 0;
+
+  bjson_encoderConfig(ctx, bjson_encoderOption_referenceThreshold,
+                      REFERENCE_THRESHOLD);
+
+  huge_encodeDocument(ctx);
+
+  statusCode = bjson_encoderGetChunks(ctx, &chunks, &numChunks);
+
+  for (i = 0; i < numChunks; i++)
+  {
+    huge_hashUpdate(h, chunks[i].buf, chunks[i].bufLen);
+  }
+
+  bjson_encoderDestroy(ctx);
+
+  return statusCode;
+}
+
+static bjson_status_t huge_sink(huge_hash_t *h)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(&g_hugeMemoryFunctions, NULL);
+
+  bjson_status_t statusCode = bjson_status_ok;
+
+  bjson_encoderConfig(ctx, bjson_encoderOption_referenceThreshold,
+                      REFERENCE_THRESHOLD);
+
+  bjson_encoderSetSink(ctx, huge_hashSink, h);
+
+  huge_encodeDocument(ctx);
+
+  statusCode = bjson_encoderGetStatus(ctx);
+
+  bjson_encoderDestroy(ctx);
+
+  return statusCode;
+}
+
+/* ----------------------------------------------------------------------------
+ *                                 Entry point
+ * ---------------------------------------------------------------------------*/
+
+typedef struct
+{
+  const char *name;
+
+  bjson_status_t (*run)(huge_hash_t *h);
+}
+huge_way_t;
+
+int main(int argc, char **argv)
+{
+  static const huge_way_t ways[] =
+  {
+    {"one-pass", huge_onePass},
+    {"two-pass", huge_twoPass},
+    {"spill",    huge_spill},
+    {"static",   huge_static},
+    {"chunks",   huge_chunks},
+    {"sink",     huge_sink}
+  };
+
+  size_t sizeMB = DEFAULT_SIZE_MB;
+  size_t partMB = DEFAULT_PART_MB;
+
+  uint64_t firstHash = 0;
+  uint64_t firstSize = 0;
+
+  int failed = 0;
+  int i      = 0;
+
+  uint8_t *payload = NULL;
+
+  for (i = 1; i < argc; i++)
+  {
+    if (strcmp(argv[i], "--size") == 0 && i < argc - 1)
+    {
+      sizeMB = strtoul(argv[++i], NULL, 10);
+    }
+    else if (strcmp(argv[i], "--part") == 0 && i < argc - 1)
+    {
+      partMB = strtoul(argv[++i], NULL, 10);
+    }
+    else
+    {
+      DIE("Usage: bjson-huge [--size <megabytes>] [--part <megabytes>]\n");
+    }
+  }
+
+  if (partMB == 0)
+  {
+    DIE("ERROR: Part size must be at least 1 MB.\n");
+  }
+
+  g_partSize = partMB * MEGABYTE;
+  g_numParts = (sizeMB + partMB - 1) / partMB;
+
+  /*
+   * Sparse payload. Only the first page is touched, so it's different
+   * from zero filled gaps.
+   */
+
+  payload = mmap(NULL, g_partSize, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+
+  if (payload == MAP_FAILED)
+  {
+    DIE("ERROR: Can't map payload of [%zu] bytes.\n", g_partSize);
+  }
+
+  memcpy(payload, "bjson-huge-payload", 18);
+
+  g_payload = payload;
+
+  printf("document: %zu parts of %zu MB\n", g_numParts, partMB);
+
+  for (i = 0; i < (int) (sizeof(ways) / sizeof(ways[0])); i++)
+  {
+    huge_hash_t h;
+
+    bjson_status_t statusCode = bjson_status_ok;
+
+    uint64_t hash = 0;
+
+    huge_hashInit(&h);
+
+    statusCode = ways[i].run(&h);
+    hash       = huge_hashFinish(&h);
+
+    printf("%-10s size [%" PRIu64 "] hash [%016" PRIx64 "] %s\n",
+           ways[i].name, h.size, hash, bjson_getStatusAsText(statusCode));
+
+    fflush(stdout);
+
+    if (i == 0)
+    {
+      firstHash = hash;
+      firstSize = h.size;
+
+      g_outputSize = (size_t) h.size;
+    }
+
+    if (statusCode != bjson_status_ok || hash != firstHash || h.size != firstSize)
+    {
+      failed = 1;
+    }
+  }
+
+  munmap(payload, g_partSize);
+
+  printf("%s\n", failed ? "FAIL" : "OK");
+
+  return failed;
+}
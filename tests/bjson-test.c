@@ -24,6 +24,7 @@
  *                                    Includes
  * ---------------------------------------------------------------------------*/
 
+#include <bjson/bjson-batch.h>
 #include <bjson/bjson-decode.h>
 #include <bjson/bjson-encode.h>
 
@@ -40,6 +41,10 @@
 # include <fcntl.h>
 #endif /* WIN32 */
 
+#ifdef __GLIBC__
+# include <malloc.h>
+#endif /* __GLIBC__ */
+
 /* ----------------------------------------------------------------------------
  *                           Defines and helper macros.
  * ---------------------------------------------------------------------------*/
@@ -60,6 +65,91 @@ static int g_bjson_testMode = TEST_MODE_DECODE;
 static bjson_decodeCtx_t *g_decodeCtx = NULL;
 static bjson_encodeCtx_t *g_encodeCtx = NULL;
 
+/*
+ * Bulk arrays test (--bulk). Numbers of innermost open array are
+ * collected and written by one bjson_encodeXxxArray() call when array
+ * is closed. Array is opened in usual way if anything else comes.
+ */
+
+#define TEST_BULK_NONE    0
+#define TEST_BULK_INTEGER 1
+#define TEST_BULK_DOUBLE  2
+
+static int g_bulkArrays  = 0;
+static int g_bulkPending = 0;
+static int g_bulkType    = TEST_BULK_NONE;
+
+static int64_t *g_bulkIntegers = NULL;
+static double  *g_bulkDoubles  = NULL;
+
+static size_t g_bulkCount    = 0;
+static size_t g_bulkCapacity = 0;
+
+/*
+ * Prepared keys test (--prepared-keys). Map keys are prepared once
+ * and encoded by bjson_encodeKeyPrepared() next times.
+ */
+
+#define TEST_MAX_PREPARED_KEYS 256
+
+typedef struct
+{
+  char *text;
+  size_t textLen;
+
+  bjson_preparedKey_t *key;
+}
+testPreparedKey_t;
+
+static int g_preparedKeys = 0;
+
+/* Test memory functions, so prepared keys are tracked too. */
+static bjson_memoryFunctions_t *g_memoryFunctions = NULL;
+static void *g_memCtx = NULL;
+
+static testPreparedKey_t g_keys[TEST_MAX_PREPARED_KEYS];
+static int g_numKeys = 0;
+
+/*
+ * Template test (--template). Whole input is recorded as template with
+ * slot for each scalar value, then rendered once with decoded values.
+ * Decoded strings are copied, because they live only inside callback.
+ */
+
+static bjson_template_t *g_template = NULL;
+
+static bjson_templateValue_t *g_templateValues = NULL;
+static char **g_templateCopies                 = NULL;
+
+static size_t g_templateNumValues = 0;
+static size_t g_templateCapacity  = 0;
+
+/*
+ * Referenced payloads test (--reference). Long strings are referenced
+ * in place by encoder, so decoded strings are copied and kept alive
+ * until output is written.
+ */
+
+static int g_keepStrings = 0;
+
+static char **g_keptStrings     = NULL;
+static size_t g_numKeptStrings  = 0;
+static size_t g_keptCapacity    = 0;
+
+/*
+ * Streamed strings test (--streamed-strings). Strings and map keys are
+ * pushed piece by piece with bjson_encodeStringBegin/Append/End().
+ */
+
+static size_t g_streamedPieceSize = 0;
+
+/*
+ * Rollback test (--rollback). Before each map a half-finished junk
+ * sub-object is encoded and then dropped by bjson_encoderRollback().
+ */
+
+static int g_rollback = 0;
+
 /* ----------------------------------------------------------------------------
  *                             Structs and typedefs.
  * ---------------------------------------------------------------------------*/
@@ -68,6 +158,9 @@ typedef struct
 {
   unsigned int numFrees;
   unsigned int numMallocs;
+
+  /* Set to 1 to make all allocations fail (out of memory test). */
+  int failAllocs;
 }
 bjsonTestMemoryContext_t;
 
@@ -90,7 +183,7 @@ static void *bjsonTestMalloc(void *ctx, size_t sz)
 {
   assert(sz != 0);
 
-  void *rv = malloc(sz);
+  void *rv = TEST_CTX(ctx) -> failAllocs ? NULL : malloc(sz);
 
   if (rv)
   {
@@ -102,7 +195,14 @@ static void *bjsonTestMalloc(void *ctx, size_t sz)
 
 static void *bjsonTestRealloc(void *ctx, void *ptr, size_t sz)
 {
-  void *rv = realloc(ptr, sz);
+  void *rv = NULL;
+
+  if (TEST_CTX(ctx) -> failAllocs && sz != 0)
+  {
+    return NULL;
+  }
+
+  rv = realloc(ptr, sz);
 
   if (ptr == NULL && rv)
   {
@@ -119,192 +219,1008 @@ static void *bjsonTestRealloc(void *ctx, void *ptr, size_t sz)
 }
 
 /* ----------------------------------------------------------------------------
- * Callback functions called when next token was successfuly decoded.
- * We use these functions to tracks what is going on while deciding.
+ * Helpers for bulk arrays test (--bulk).
  * ---------------------------------------------------------------------------*/
 
-static bjson_decoderCallbackResult_t test_bjson_null(void *ctx)
+/*
+ * Array open was deferred, but its items can't be written at once.
+ * Open it in usual way and write collected items one by one.
+ */
+
+static void test_bulkFlush(void)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
-  {
-    bjson_encodeNull(g_encodeCtx);
-  }
-  else
+  size_t i = 0;
+
+  if (g_bulkPending)
   {
-    printf("null\n");
-  }
+    bjson_encodeArrayOpen(g_encodeCtx);
 
-  return bjson_decoderCallbackResult_Continue;
+    for (i = 0; i < g_bulkCount; i++)
+    {
+      if (g_bulkType == TEST_BULK_INTEGER)
+      {
+        bjson_encodeInteger(g_encodeCtx, g_bulkIntegers[i]);
+      }
+      else
+      {
+        bjson_encodeDouble(g_encodeCtx, g_bulkDoubles[i]);
+      }
+    }
+
+    g_bulkPending = 0;
+  }
 }
 
-static bjson_decoderCallbackResult_t test_bjson_boolean(void *ctx, int value)
+/*
+ * Collect next number of deferred array.
+ *
+ * RETURNS: 1 if value collected,
+ *          0 if caller should encode it in usual way.
+ */
+
+static int test_bulkPush(int type, int64_t valueInteger, double valueDouble)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  if (g_bulkPending && g_bulkType != TEST_BULK_NONE && g_bulkType != type)
   {
-    bjson_encodeBool(g_encodeCtx, value);
+    test_bulkFlush();
   }
-  else
+
+  if (g_bulkPending == 0)
   {
-    printf("bool: %s\n", value ? "true" : "false");
+    return 0;
   }
 
-  return bjson_decoderCallbackResult_Continue;
+  if (g_bulkCount == g_bulkCapacity)
+  {
+    g_bulkCapacity = g_bulkCapacity * 2 + 16;
+    g_bulkIntegers = realloc(g_bulkIntegers, g_bulkCapacity * sizeof(int64_t));
+    g_bulkDoubles  = realloc(g_bulkDoubles, g_bulkCapacity * sizeof(double));
+  }
+
+  g_bulkType = type;
+
+  g_bulkIntegers[g_bulkCount] = valueInteger;
+  g_bulkDoubles[g_bulkCount]  = valueDouble;
+
+  g_bulkCount++;
+
+  return 1;
 }
 
-static bjson_decoderCallbackResult_t test_bjson_integer(void *ctx, int64_t value)
+/*
+ * Find prepared key with given text. Prepare new one if not found.
+ *
+ * RETURNS: Prepared key or NULL if cache is full.
+ */
+
+static bjson_preparedKey_t *test_findPreparedKey(const unsigned char *text,
+                                                 size_t textLen)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  int i = 0;
+
+  unsigned int numMallocs = 0;
+
+  for (i = 0; i < g_numKeys; i++)
   {
-    bjson_encodeInteger(g_encodeCtx, value);
+    if (g_keys[i].textLen == textLen &&
+        memcmp(g_keys[i].text, text, textLen) == 0)
+    {
+      return g_keys[i].key;
+    }
   }
-  else
+
+  if (g_numKeys == TEST_MAX_PREPARED_KEYS)
   {
-    printf("integer: %" PRId64 "\n", value);
+    return NULL;
   }
 
-  return bjson_decoderCallbackResult_Continue;
-}
+  numMallocs = TEST_CTX(g_memCtx) -> numMallocs;
 
-static bjson_decoderCallbackResult_t test_bjson_double(void *ctx, double value)
-{
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  g_keys[g_numKeys].text    = malloc(textLen + 1);
+  g_keys[g_numKeys].textLen = textLen;
+  g_keys[g_numKeys].key     = bjson_keyPrepare((const char *) text, textLen,
+                                               g_memoryFunctions, g_memCtx);
+
+  if (TEST_CTX(g_memCtx) -> numMallocs == numMallocs)
   {
-    bjson_encodeDouble(g_encodeCtx, value);
+    fprintf(stderr, "ERROR: Prepared key not allocated by memory functions.\n");
   }
-  else
-  {
-    /*
-     * %g gives 1e+009 on MinGW, but 1e+09 on Linux.
-     * We normalize exponent digits by own to make output platform
-     * independend.
-     */
-
-    char valueText[32] = {0};
-    char *expText      = NULL;
 
-    int valueTextCapacity = sizeof(valueText) - 1;
+  memcpy(g_keys[g_numKeys].text, text, textLen);
 
-    snprintf(valueText, valueTextCapacity, "%.15g", value);
+  return g_keys[g_numKeys++].key;
+}
 
-    expText = strchr(valueText, 'e');
+/*
+ * Prepared key pushed while streamed value is open must be reported as
+ * streamedValueOpen like any other value.
+ */
 
-    if (expText)
-    {
-      /*
-       * Exponent notation detected. Reprint exponent part
-       * once again, but using fixed number of digits.
-       */
+static void test_keyWhileStreaming(void)
+{
+  bjson_encodeCtx_t *ctx = bjson_encoderCreate(NULL, NULL);
 
-      expText++;
+  bjson_preparedKey_t *key = bjson_keyPrepare("key", 3, NULL, NULL);
 
-      int baseTextSize    = expText - valueText;
-      int expTextCapacity = valueTextCapacity - baseTextSize;
-      snprintf(expText, expTextCapacity, "%+04d", atoi(expText));
-    }
+  bjson_encodeMapOpen(ctx);
+  bjson_encodeCString(ctx, "value");
+  bjson_encodeStringBegin(ctx);
 
-    printf("double: %s\n", valueText);
+  if (bjson_encodeKeyPrepared(ctx, key) != bjson_status_error_streamedValueOpen)
+  {
+    fprintf(stderr, "ERROR: Prepared key accepted inside streamed string.\n");
   }
 
-  return bjson_decoderCallbackResult_Continue;
+  bjson_keyFree(key);
+  bjson_encoderDestroy(ctx);
 }
 
-static bjson_decoderCallbackResult_t
-  test_bjson_string(void *ctx,
-                    const unsigned char *text,
-                    size_t textLen)
-{
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
-  {
-    bjson_encodeString(g_encodeCtx, text, textLen);
-  }
-  else
-  {
-    printf("string: '");
-    fwrite(text, 1, textLen, stdout);
-    printf("'\n");
-  }
+/*
+ * Encoder sink used by --sink test. Write each record to stdout.
+ */
 
-  return bjson_decoderCallbackResult_Continue;
+static int test_sinkToStdout(void *sinkCtx, const void *buf, size_t bufLen)
+{
+  return (fwrite(buf, 1, bufLen, stdout) == bufLen) ? 0 : -1;
 }
 
-static bjson_decoderCallbackResult_t
-  test_bjson_map_key(void *ctx,
-                     const unsigned char *text,
-                     size_t textLen)
+/*
+ * Copy decoded string if encoder may reference it after callback returns.
+ */
+
+static const unsigned char *test_keepAlive(const unsigned char *text,
+                                           size_t textLen)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  char *copy = NULL;
+
+  if (!g_keepStrings)
   {
-    bjson_encodeString(g_encodeCtx, text, textLen);
+    return text;
   }
-  else
+
+  if (g_numKeptStrings == g_keptCapacity)
   {
-    printf("key: '");
-    fwrite(text, 1, textLen, stdout);
-    printf("'\n");
+    g_keptCapacity = g_keptCapacity * 2 + 16;
+    g_keptStrings  = realloc(g_keptStrings, g_keptCapacity * sizeof(char *));
   }
 
-  return bjson_decoderCallbackResult_Continue;
+  copy = malloc(textLen + 1);
+
+  memcpy(copy, text, textLen);
+
+  g_keptStrings[g_numKeptStrings++] = copy;
+
+  return (const unsigned char *) copy;
 }
 
-static bjson_decoderCallbackResult_t test_bjson_start_map(void *ctx)
+/*
+ * Encode junk map with nested array long enough to leave header gap,
+ * then roll it back while map is still open. Output must not change.
+ * Reset in the middle of junk map must be rejected without any change.
+ */
+
+static void test_encodeJunkAndRollback(void)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  static char junk[300];
+
+  bjson_encoderSavepoint_t sp;
+
+  memset(junk, 'j', sizeof(junk));
+
+  bjson_encoderSavepoint(g_encodeCtx, &sp);
+
+  bjson_encodeMapOpen(g_encodeCtx);
+  bjson_encodeCString(g_encodeCtx, "junk");
+  bjson_encodeArrayOpen(g_encodeCtx);
+  bjson_encodeString(g_encodeCtx, junk, sizeof(junk));
+  bjson_encodeArrayClose(g_encodeCtx);
+  bjson_encodeCString(g_encodeCtx, "more");
+  bjson_encodeInteger(g_encodeCtx, 1);
+
+  if (bjson_encoderGetStatus(g_encodeCtx) == bjson_status_ok &&
+      bjson_encoderReset(g_encodeCtx, NULL) != bjson_status_error_unclosedMap)
   {
-    bjson_encodeMapOpen(g_encodeCtx);
+    fprintf(stderr, "ERROR: Reset accepted unclosed map.\n");
   }
-  else
+
+  if (bjson_encoderRollback(g_encodeCtx, &sp) == bjson_status_error_invalidSavepoint)
   {
-    printf("map open '{'\n");
+    fprintf(stderr, "ERROR: Rollback failed.\n");
   }
-
-  return bjson_decoderCallbackResult_Continue;
 }
 
-static bjson_decoderCallbackResult_t test_bjson_end_map(void *ctx)
+/*
+ * Encode the deepest possible document twice into static buffer and
+ * check heap usage didn't change. Heap usage is taken from glibc, so
+ * check is skipped elsewhere.
+ */
+
+static void test_staticNoAlloc(void)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  static char buf[16384];
+
+  bjson_encodeCtx_t *ctx = bjson_encoderCreateStatic(buf, sizeof(buf));
+
+  size_t heapUsed = mallinfo2().uordblks;
+
+  int round = 0;
+  int i     = 0;
+
+  for (round = 0; round < 2; round++)
   {
-    bjson_encodeMapClose(g_encodeCtx);
+    for (i = 0; i < BJSON_MAX_DEPTH; i++)
+    {
+      bjson_encodeArrayOpen(ctx);
+    }
+
+    bjson_encodeStringBegin(ctx);
+    bjson_encodeStringAppend(ctx, "deep", 4);
+    bjson_encodeStringEnd(ctx);
+
+    for (i = 0; i < BJSON_MAX_DEPTH; i++)
+    {
+      bjson_encodeArrayClose(ctx);
+    }
+
+    if (bjson_encoderGetStatus(ctx) != bjson_status_ok)
+    {
+      fprintf(stderr, "ERROR: Static encoder failed on deep document.\n");
+    }
+
+    bjson_encoderClear(ctx);
   }
-  else
+
+  if (mallinfo2().uordblks != heapUsed)
   {
-    printf("map close '}'\n");
+    fprintf(stderr, "ERROR: Static encoder allocated heap while encoding.\n");
   }
 
-  return bjson_decoderCallbackResult_Continue;
+  bjson_encoderDestroy(ctx);
+#endif
 }
 
-static bjson_decoderCallbackResult_t test_bjson_start_array(void *ctx)
+/*
+ * Encode string at once or in pieces if --streamed-strings is set.
+ */
+
+static void test_encodeString(const unsigned char *text, size_t textLen)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  size_t pieceIdx = 0;
+
+  text = test_keepAlive(text, textLen);
+
+  if (g_streamedPieceSize == 0)
   {
-    bjson_encodeArrayOpen(g_encodeCtx);
+    bjson_encodeString(g_encodeCtx, text, textLen);
+
+    return;
   }
-  else
+
+  bjson_encodeStringBegin(g_encodeCtx);
+
+  for (pieceIdx = 0; pieceIdx < textLen; pieceIdx += g_streamedPieceSize)
   {
-    printf("array open '['\n");
+    size_t pieceSize = textLen - pieceIdx;
+
+    if (pieceSize > g_streamedPieceSize)
+    {
+      pieceSize = g_streamedPieceSize;
+    }
+
+    bjson_encodeStringAppend(g_encodeCtx, (const char *) text + pieceIdx,
+                             pieceSize);
   }
 
-  return bjson_decoderCallbackResult_Continue;
+  bjson_encodeStringEnd(g_encodeCtx);
 }
 
-static bjson_decoderCallbackResult_t test_bjson_end_array(void *ctx)
+/*
+ * Record decoded token into template. Scalar values go as slots, map keys
+ * and nulls as constants.
+ */
+
+static void test_templateRecord(bjson_decoderEventType_t type,
+                                int64_t valueInteger, double valueDouble,
+                                const unsigned char *text, size_t textLen)
 {
-  if (g_bjson_testMode == TEST_MODE_ENCODE)
+  bjson_templateValue_t *value = NULL;
+  bjson_templateSlot_t slotType = bjson_templateSlot_integer;
+
+  switch (type)
   {
-    bjson_encodeArrayClose(g_encodeCtx);
+    case bjson_decoderEvent_null:
+    {
+      uint8_t nullValue = 0;
+
+      bjson_templateRaw(g_template, &nullValue, 1);
+
+      return;
+    }
+
+    case bjson_decoderEvent_mapKey:     bjson_templateString(g_template, (const char *) text, textLen); return;
+    case bjson_decoderEvent_startMap:   bjson_templateMapOpen(g_template); return;
+    case bjson_decoderEvent_endMap:     bjson_templateMapClose(g_template); return;
+    case bjson_decoderEvent_startArray: bjson_templateArrayOpen(g_template); return;
+    case bjson_decoderEvent_endArray:   bjson_templateArrayClose(g_template); return;
+
+    default:
+    {
+      break;
+    }
   }
-  else
+
+  if (g_templateNumValues == g_templateCapacity)
   {
-    printf("array close ']'\n");
+    g_templateCapacity = g_templateCapacity * 2 + 16;
+    g_templateValues   = realloc(g_templateValues, g_templateCapacity * sizeof(bjson_templateValue_t));
+    g_templateCopies   = realloc(g_templateCopies, g_templateCapacity * sizeof(char *));
   }
 
-  return bjson_decoderCallbackResult_Continue;
-}
+  value = &g_templateValues[g_templateNumValues];
 
-/* ----------------------------------------------------------------------------
- *                                Entry point.
- * ---------------------------------------------------------------------------*/
+  g_templateCopies[g_templateNumValues] = NULL;
+
+  switch (type)
+  {
+    case bjson_decoderEvent_boolean:
+    {
+      slotType            = bjson_templateSlot_bool;
+      value->valueBoolean = (int) valueInteger;
+
+      break;
+    }
+
+    case bjson_decoderEvent_double:
+    {
+      slotType           = bjson_templateSlot_double;
+      value->valueDouble = valueDouble;
+
+      break;
+    }
+
+    case bjson_decoderEvent_string:
+    {
+      char *copy = malloc(textLen + 1);
+
+      memcpy(copy, text, textLen);
+
+      slotType            = bjson_templateSlot_string;
+      value->span.buf     = copy;
+      value->span.bufLen  = textLen;
+
+      g_templateCopies[g_templateNumValues] = copy;
+
+      break;
+    }
+
+    default:
+    {
+      value->valueInteger = valueInteger;
+    }
+  }
+
+  g_templateNumValues++;
+
+  bjson_templateSlot(g_template, slotType);
+}
+
+/* ----------------------------------------------------------------------------
+ * Callback functions called when next token was successfuly decoded.
+ * We use these functions to tracks what is going on while deciding.
+ * ---------------------------------------------------------------------------*/
+
+static bjson_decoderCallbackResult_t test_bjson_null(void *ctx)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_null, 0, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+    bjson_encodeNull(g_encodeCtx);
+  }
+  else
+  {
+    printf("null\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_boolean(void *ctx, int value)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_boolean, value, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+    bjson_encodeBool(g_encodeCtx, value);
+  }
+  else
+  {
+    printf("bool: %s\n", value ? "true" : "false");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_integer(void *ctx, int64_t value)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_integer, value, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    if (!test_bulkPush(TEST_BULK_INTEGER, value, 0))
+    {
+      bjson_encodeInteger(g_encodeCtx, value);
+    }
+  }
+  else
+  {
+    printf("integer: %" PRId64 "\n", value);
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_double(void *ctx, double value)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_double, 0, value, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    if (!test_bulkPush(TEST_BULK_DOUBLE, 0, value))
+    {
+      bjson_encodeDouble(g_encodeCtx, value);
+    }
+  }
+  else
+  {
+    /*
+     * %g gives 1e+009 on MinGW, but 1e+09 on Linux.
+     * We normalize exponent digits by own to make output platform
+     * independend.
+     */
+
+    char valueText[32] = {0};
+    char *expText      = NULL;
+
+    int valueTextCapacity = sizeof(valueText) - 1;
+
+    snprintf(valueText, valueTextCapacity, "%.15g", value);
+
+    expText = strchr(valueText, 'e');
+
+    if (expText)
+    {
+      /*
+       * Exponent notation detected. Reprint exponent part
+       * once again, but using fixed number of digits.
+       */
+
+      expText++;
+
+      int baseTextSize    = expText - valueText;
+      int expTextCapacity = valueTextCapacity - baseTextSize;
+      snprintf(expText, expTextCapacity, "%+04d", atoi(expText));
+    }
+
+    printf("double: %s\n", valueText);
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t
+  test_bjson_string(void *ctx,
+                    const unsigned char *text,
+                    size_t textLen)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_string, 0, 0, text, textLen);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+    test_encodeString(text, textLen);
+  }
+  else
+  {
+    printf("string: '");
+    fwrite(text, 1, textLen, stdout);
+    printf("'\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t
+  test_bjson_map_key(void *ctx,
+                     const unsigned char *text,
+                     size_t textLen)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_mapKey, 0, 0, text, textLen);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    bjson_preparedKey_t *key = NULL;
+
+    test_bulkFlush();
+
+    if (g_preparedKeys)
+    {
+      key = test_findPreparedKey(text, textLen);
+    }
+
+    if (key)
+    {
+      bjson_encodeKeyPrepared(g_encodeCtx, key);
+    }
+    else
+    {
+      test_encodeString(text, textLen);
+    }
+  }
+  else
+  {
+    printf("key: '");
+    fwrite(text, 1, textLen, stdout);
+    printf("'\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_start_map(void *ctx)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_startMap, 0, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+
+    if (g_rollback)
+    {
+      test_encodeJunkAndRollback();
+    }
+
+    bjson_encodeMapOpen(g_encodeCtx);
+  }
+  else
+  {
+    printf("map open '{'\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_end_map(void *ctx)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_endMap, 0, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+    bjson_encodeMapClose(g_encodeCtx);
+  }
+  else
+  {
+    printf("map close '}'\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_start_array(void *ctx)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_startArray, 0, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    test_bulkFlush();
+
+    if (g_bulkArrays)
+    {
+      /* Defer array open until we know what's inside. */
+      g_bulkPending = 1;
+      g_bulkType    = TEST_BULK_NONE;
+      g_bulkCount   = 0;
+    }
+    else
+    {
+      bjson_encodeArrayOpen(g_encodeCtx);
+    }
+  }
+  else
+  {
+    printf("array open '['\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_bjson_end_array(void *ctx)
+{
+  if (g_template)
+  {
+    test_templateRecord(bjson_decoderEvent_endArray, 0, 0, NULL, 0);
+  }
+  else if (g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    if (g_bulkPending && g_bulkType == TEST_BULK_DOUBLE)
+    {
+      bjson_encodeDoubleArray(g_encodeCtx, g_bulkDoubles, g_bulkCount);
+    }
+    else if (g_bulkPending)
+    {
+      bjson_encodeInt64Array(g_encodeCtx, g_bulkIntegers, g_bulkCount);
+    }
+    else
+    {
+      bjson_encodeArrayClose(g_encodeCtx);
+    }
+
+    g_bulkPending = 0;
+  }
+  else
+  {
+    printf("array close ']'\n");
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+/* ----------------------------------------------------------------------------
+ * Batch callback called with many decoded tokens at once. We pass each event
+ * to per-token callbacks above, so output is the same in both modes.
+ * ---------------------------------------------------------------------------*/
+
+static bjson_decoderCallbackResult_t
+  test_bjson_batch(void *ctx,
+                   const bjson_decoderEvent_t *events,
+                   size_t numEvents)
+{
+  size_t i = 0;
+
+  for (i = 0; i < numEvents; i++)
+  {
+    const bjson_decoderEvent_t *event = &events[i];
+
+    switch (event->type)
+    {
+      case bjson_decoderEvent_null:       test_bjson_null(ctx); break;
+      case bjson_decoderEvent_boolean:    test_bjson_boolean(ctx, event->value.valueBoolean); break;
+      case bjson_decoderEvent_integer:    test_bjson_integer(ctx, event->value.valueInteger); break;
+      case bjson_decoderEvent_double:     test_bjson_double(ctx, event->value.valueDouble); break;
+      case bjson_decoderEvent_string:     test_bjson_string(ctx, event->value.span.buf, event->value.span.bufLen); break;
+      case bjson_decoderEvent_mapKey:     test_bjson_map_key(ctx, event->value.span.buf, event->value.span.bufLen); break;
+      case bjson_decoderEvent_startMap:   test_bjson_start_map(ctx); break;
+      case bjson_decoderEvent_endMap:     test_bjson_end_map(ctx); break;
+      case bjson_decoderEvent_startArray: test_bjson_start_array(ctx); break;
+      case bjson_decoderEvent_endArray:   test_bjson_end_array(ctx); break;
+      default: break;
+    }
+  }
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+/* ----------------------------------------------------------------------------
+ * Many documents batch test (--threads with --batch-docs). Documents are
+ * decoded in parallel, so callbacks don't print anything, but fold tokens
+ * into digest passed as caller context of each document. Digests and
+ * statuses must be the same as from ordinary decoder.
+ * ---------------------------------------------------------------------------*/
+
+#define TEST_BATCH_ROUNDS 3
+
+typedef struct
+{
+  uint64_t hash;
+  uint64_t numTokens;
+}
+test_digest_t;
+
+static void test_digestUpdate(void *ctx, int tag, const void *buf, size_t bufLen)
+{
+  test_digest_t *digest = (test_digest_t *) ctx;
+
+  const unsigned char *p = (const unsigned char *) buf;
+
+  size_t i = 0;
+
+  digest->hash = (digest->hash ^ (uint64_t) tag) * 0x100000001b3ULL;
+
+  for (i = 0; i < bufLen; i++)
+  {
+    digest->hash = (digest->hash ^ p[i]) * 0x100000001b3ULL;
+  }
+
+  digest->numTokens++;
+}
+
+static bjson_decoderCallbackResult_t test_digest_null(void *ctx)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_null, NULL, 0);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_boolean(void *ctx, int value)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_boolean, &value, sizeof(value));
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_integer(void *ctx, int64_t value)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_integer, &value, sizeof(value));
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_double(void *ctx, double value)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_double, &value, sizeof(value));
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t
+  test_digest_string(void *ctx, const unsigned char *text, size_t textLen)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_string, text, textLen);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t
+  test_digest_map_key(void *ctx, const unsigned char *text, size_t textLen)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_mapKey, text, textLen);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t
+  test_digest_binary(void *ctx, const void *buf, size_t bufLen)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_binary, buf, bufLen);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_start_map(void *ctx)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_startMap, NULL, 0);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_end_map(void *ctx)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_endMap, NULL, 0);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_start_array(void *ctx)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_startArray, NULL, 0);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+static bjson_decoderCallbackResult_t test_digest_end_array(void *ctx)
+{
+  test_digestUpdate(ctx, bjson_decoderEvent_endArray, NULL, 0);
+
+  return bjson_decoderCallbackResult_Continue;
+}
+
+/*
+ * Decode numDocs documents made of given input in a few rounds on the
+ * same batch decoder. Every 4th document is cut in half and every 4th
+ * one starts with invalid data type, so some of them must fail.
+ *
+ * RETURNS: 0 if all documents match ordinary decoder, -1 otherwise.
+ */
+
+static int test_batchDocs(int numThreads, size_t numDocs,
+                          const unsigned char *input, size_t inputSize)
+{
+  static const unsigned char invalidDoc[] = {0xff};
+
+  bjson_decoderCallbacks_t digestCallbacks =
+  {
+    test_digest_null,
+    test_digest_boolean,
+    test_digest_integer,
+    test_digest_double,
+    NULL,
+    test_digest_string,
+    test_digest_start_map,
+    test_digest_map_key,
+    test_digest_end_map,
+    test_digest_start_array,
+    test_digest_end_array,
+    test_digest_binary
+  };
+
+  bjson_batchDecodeCtx_t *batchCtx = NULL;
+  bjson_decodeCtx_t *decodeCtx     = NULL;
+
+  bjson_batchDocument_t *docs   = calloc(numDocs, sizeof(bjson_batchDocument_t));
+  bjson_batchResult_t *results  = calloc(numDocs, sizeof(bjson_batchResult_t));
+  bjson_status_t *goldStatuses  = calloc(numDocs, sizeof(bjson_status_t));
+  test_digest_t *digests        = calloc(numDocs, sizeof(test_digest_t));
+  test_digest_t *goldDigests    = calloc(numDocs, sizeof(test_digest_t));
+
+  size_t numFailed = 0;
+  size_t i         = 0;
+
+  int round = 0;
+  int rv    = 0;
+
+  if (!docs || !results || !goldStatuses || !digests || !goldDigests)
+  {
+    DIE("ERROR: Can't allocate batch documents.\n");
+  }
+
+  /*
+   * Prepare documents and decode each one by ordinary decoder first.
+   */
+
+  decodeCtx = bjson_decoderCreate(&digestCallbacks, NULL, NULL);
+
+  for (i = 0; i < numDocs; i++)
+  {
+    docs[i].data      = input;
+    docs[i].size      = inputSize;
+    docs[i].callerCtx = &digests[i];
+
+    if (i % 4 == 1)
+    {
+      docs[i].size = inputSize / 2;
+    }
+    else if (i % 4 == 3)
+    {
+      docs[i].data = invalidDoc;
+      docs[i].size = sizeof(invalidDoc);
+    }
+
+    bjson_decoderReset(decodeCtx);
+    bjson_decoderSetCallerCtx(decodeCtx, &goldDigests[i]);
+
+    goldStatuses[i] = bjson_decoderParse(decodeCtx, docs[i].data, docs[i].size);
+
+    if (goldStatuses[i] == bjson_status_ok)
+    {
+      goldStatuses[i] = bjson_decoderComplete(decodeCtx);
+    }
+
+    if (goldStatuses[i] != bjson_status_ok)
+    {
+      numFailed++;
+    }
+  }
+
+  bjson_decoderDestroy(decodeCtx);
+
+  if (numFailed == 0)
+  {
+    DIE("ERROR: No broken document in batch.\n");
+  }
+
+  /*
+   * Decode the same documents a few times reusing worker threads pool.
+   */
+
+  batchCtx = bjson_batchDecoderCreate(numThreads, &digestCallbacks, NULL, NULL);
+
+  if (batchCtx == NULL)
+  {
+    DIE("ERROR: Can't create batch decoder.\n");
+  }
+
+  for (round = 0; round < TEST_BATCH_ROUNDS && rv == 0; round++)
+  {
+    memset(digests, 0, numDocs * sizeof(test_digest_t));
+
+    for (i = 0; i < numDocs; i++)
+    {
+      results[i].statusCode = bjson_status_error_notImplemented;
+    }
+
+    bjson_batchDecode(batchCtx, docs, numDocs, results);
+
+    for (i = 0; i < numDocs; i++)
+    {
+      if (results[i].statusCode != goldStatuses[i] ||
+          digests[i].hash != goldDigests[i].hash ||
+          digests[i].numTokens != goldDigests[i].numTokens)
+      {
+        printf("batch error: round %d, document %u: %s, [%" PRIu64 "] tokens,"
+               " expected %s, [%" PRIu64 "] tokens\n",
+               round, (unsigned int) i,
+               bjson_getStatusAsText(results[i].statusCode),
+               digests[i].numTokens,
+               bjson_getStatusAsText(goldStatuses[i]),
+               goldDigests[i].numTokens);
+
+        rv = -1;
+
+        break;
+      }
+    }
+  }
+
+  bjson_batchDecoderDestroy(batchCtx);
+
+  if (rv == 0)
+  {
+    printf("batch ok: %u documents, %u failed, %d rounds\n",
+           (unsigned int) numDocs, (unsigned int) numFailed, TEST_BATCH_ROUNDS);
+  }
+
+  free(docs);
+  free(results);
+  free(goldStatuses);
+  free(digests);
+  free(goldDigests);
+
+  return rv;
+}
+
+/* ----------------------------------------------------------------------------
+ *                                Entry point.
+ * ---------------------------------------------------------------------------*/
+
+/*
+ * Read whole input into working buffer. Buffer is grown if needed.
+ */
+
+static size_t test_readWholeInput(FILE *file, unsigned char **buf, size_t *bufSize)
+{
+  size_t bytesReaded = 0;
+  size_t size        = 0;
+
+  while ((bytesReaded = fread(*buf + size, 1, *bufSize - size, file)) > 0)
+  {
+    size += bytesReaded;
+
+    if (size == *bufSize)
+    {
+      *bufSize *= 2;
+      *buf      = realloc(*buf, *bufSize);
+
+      if (*buf == NULL)
+      {
+        DIE("ERROR: Can't allocate working buffer.\n");
+      }
+    }
+  }
+
+  return size;
+}
 
 int main(int argc, char ** argv)
 {
@@ -340,7 +1256,7 @@ int main(int argc, char ** argv)
     bjsonTestRealloc
   };
 
-  bjsonTestMemoryContext_t memCtx = {0, 0};
+  bjsonTestMemoryContext_t memCtx = {0, 0, 0};
 
   /* Input BJSON file or stdin if not specified. */
   const char *fileName = NULL;
@@ -354,39 +1270,333 @@ int main(int argc, char ** argv)
   /* BJSON decoder specified. */
   bjson_status_t statusCode = bjson_status_ok;
 
+  /* Number of batch decoder threads or 0 to use ordinary decoder. */
+  int numThreads = 0;
+
+  /* Number of documents decoded at once by batch decoder. */
+  size_t numBatchDocs = 0;
+
+  /* Set to 1 to get decoded tokens via batched events. */
+  int useEvents = 0;
+
+  /* Set to 1 to fail event buffer allocation (out of memory test). */
+  int failEventsAlloc = 0;
+
+  /* Set to 1 to print decoder statistics to stderr. */
+  int printStats = 0;
+
+  /* Set to 1 to encode in two passes (measure, then write). */
+  int twoPass = 0;
+
+  /* Set to 1 to encode twice using the same, cleared encoder. */
+  int reuseEncoder = 0;
+
+  /* Set to 1 to take output away from encoder instead of borrowing it. */
+  int detachResult = 0;
+
+  /* Set to 1 to write doubles in the smallest exact form. */
+  int compactNumbers = 0;
+
+  /* Set to 1 to splice whole input into encoder as one raw value. */
+  int spliceRaw = 0;
+
+  /* Set to 1 to record input as template and render it. */
+  int useTemplate = 0;
+
+  /* Minimal size of string referenced by encoder or 0 to copy all. */
+  size_t referenceThreshold = 0;
+
+  /* Bytes reserved in encoder output up front or 0 to grow on demand. */
+  size_t reserveSize = 0;
+
+  /* Encoder output growth in percent or 0 to use default. */
+  size_t growthPercent = 0;
+
+  /* Set to 1 to shrink encoder output buffer before writing it. */
+  int shrinkToFit = 0;
+
+  /* Number of records streamed into encoder sink or 0 if sink not used. */
+  int numSinkRecords = 0;
+
+  /* Output file written by spilled encoder or NULL to use heap encoder. */
+  const char *spillPath = NULL;
+
+  /* Size of caller owned encoder output buffer or 0 to use heap. */
+  size_t staticBufferSize = 0;
+  void *staticBuffer      = NULL;
+
+  /* Size of caller owned decoder cache arena or 0 to use heap only. */
+  size_t cacheArenaSize = 0;
+  void *cacheArena      = NULL;
+
+  /* Allocations held by decoder before input, when arena is used. */
+  unsigned int arenaBaseAllocs = 0;
+
   /* Runtime helpers. */
   int goOn = 1;
   int i = 0;
 
+  /*
+   * Prepared keys are created inside callbacks, but use the same tracked
+   * memory functions.
+   */
+
+  g_memoryFunctions = &memoryFunctions;
+  g_memCtx          = &memCtx;
+
   /*
    * Parse command line parameters.
    */
 
-  for (i = 1; i < argc; i++)
-  {
-    /*
-     * -x like: treat as option
-     */
+  for (i = 1; i < argc; i++)
+  {
+    /*
+     * -x like: treat as option
+     */
+
+    if (argv[i][0] == '-')
+    {
+      if (strcmp(argv[i], "-b") == 0)
+      {
+        /*
+         * -b <buffer-size>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after -b parameter.\n");
+        }
+        else
+        {
+          bufSize = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--threads") == 0)
+      {
+        /*
+         * --threads <number-of-threads>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --threads parameter.\n");
+        }
+        else
+        {
+          numThreads = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--batch-docs") == 0)
+      {
+        /*
+         * --batch-docs <number-of-documents>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --batch-docs parameter.\n");
+        }
+        else
+        {
+          numBatchDocs = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--cache-arena") == 0)
+      {
+        /*
+         * --cache-arena <arena-size>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --cache-arena parameter.\n");
+        }
+        else
+        {
+          cacheArenaSize = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--events") == 0)
+      {
+        useEvents = 1;
+      }
+      else if (strcmp(argv[i], "--events-oom") == 0)
+      {
+        useEvents       = 1;
+        failEventsAlloc = 1;
+      }
+      else if (strcmp(argv[i], "--two-pass") == 0)
+      {
+        twoPass = 1;
+      }
+      else if (strcmp(argv[i], "--reuse") == 0)
+      {
+        reuseEncoder = 1;
+      }
+      else if (strcmp(argv[i], "--detach") == 0)
+      {
+        detachResult = 1;
+      }
+      else if (strcmp(argv[i], "--compact-numbers") == 0)
+      {
+        compactNumbers = 1;
+      }
+      else if (strcmp(argv[i], "--bulk") == 0)
+      {
+        g_bulkArrays = 1;
+      }
+      else if (strcmp(argv[i], "--prepared-keys") == 0)
+      {
+        g_preparedKeys = 1;
+      }
+      else if (strcmp(argv[i], "--raw") == 0)
+      {
+        spliceRaw = 1;
+      }
+      else if (strcmp(argv[i], "--template") == 0)
+      {
+        useTemplate = 1;
+      }
+      else if (strcmp(argv[i], "--reference") == 0)
+      {
+        /*
+         * --reference <minimal-referenced-size>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --reference parameter.\n");
+        }
+        else
+        {
+          referenceThreshold = atoi(argv[i+1]);
+          g_keepStrings      = 1;
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--rollback") == 0)
+      {
+        g_rollback = 1;
+      }
+      else if (strcmp(argv[i], "--reserve") == 0)
+      {
+        /*
+         * --reserve <number-of-bytes>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --reserve parameter.\n");
+        }
+        else
+        {
+          reserveSize = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--growth") == 0)
+      {
+        /*
+         * --growth <percent>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --growth parameter.\n");
+        }
+        else
+        {
+          growthPercent = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--shrink") == 0)
+      {
+        shrinkToFit = 1;
+      }
+      else if (strcmp(argv[i], "--streamed-strings") == 0)
+      {
+        /*
+         * --streamed-strings <piece-size>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --streamed-strings parameter.\n");
+        }
+        else
+        {
+          g_streamedPieceSize = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--sink") == 0)
+      {
+        /*
+         * --sink <number-of-records>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --sink parameter.\n");
+        }
+        else
+        {
+          numSinkRecords = atoi(argv[i+1]);
+
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--spill") == 0)
+      {
+        /*
+         * --spill <output-file>
+         */
+
+        if (i == argc - 1)
+        {
+          DIE("ERROR: Missing value after --spill parameter.\n");
+        }
+        else
+        {
+          spillPath = argv[i+1];
 
-    if (argv[i][0] == '-')
-    {
-      if (strcmp(argv[i], "-b") == 0)
+          i++;
+        }
+      }
+      else if (strcmp(argv[i], "--static") == 0)
       {
         /*
-         * -b <buffer-size>
+         * --static <output-buffer-size>
          */
 
         if (i == argc - 1)
         {
-          DIE("ERROR: Missing value after -b parameter.\n");
+          DIE("ERROR: Missing value after --static parameter.\n");
         }
         else
         {
-          bufSize = atoi(argv[i+1]);
+          staticBufferSize = atoi(argv[i+1]);
 
           i++;
         }
       }
+      else if (strcmp(argv[i], "--stats") == 0)
+      {
+        printStats = 1;
+      }
       else if (strcmp(argv[i], "--decode") == 0)
       {
         g_bjson_testMode = TEST_MODE_DECODE;
@@ -451,15 +1661,301 @@ int main(int argc, char ** argv)
     DIE("ERROR: Can't allocate working buffer.\n");
   }
 
+  /*
+   * Batch decoder test. Read whole input as one document and decode it
+   * using the worker threads pool.
+   */
+
+  if (numThreads > 0 && numBatchDocs > 0 && g_bjson_testMode == TEST_MODE_DECODE)
+  {
+    /*
+     * Many documents batch test. Decode copies of input, some of them
+     * broken, and compare each one with ordinary decoder.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    int rv = test_batchDocs(numThreads, numBatchDocs, buf, docSize);
+
+    if (fileName)
+    {
+      fclose(file);
+    }
+
+    free(buf);
+
+    return rv;
+  }
+  else if (numThreads > 0 && g_bjson_testMode == TEST_MODE_DECODE)
+  {
+    bjson_batchDecodeCtx_t *batchCtx = NULL;
+    bjson_batchDocument_t doc        = {NULL, 0, NULL};
+    bjson_batchResult_t result       = {bjson_status_ok};
+
+    doc.size = test_readWholeInput(file, &buf, &bufSize);
+    doc.data = buf;
+
+    batchCtx = bjson_batchDecoderCreate(numThreads, &callbacks,
+                                        &memoryFunctions, &memCtx);
+
+    if (batchCtx == NULL)
+    {
+      DIE("ERROR: Can't create batch decoder.\n");
+    }
+
+    bjson_batchDecode(batchCtx, &doc, 1, &result);
+
+    if (result.statusCode != bjson_status_ok)
+    {
+      printf("parse error: %s\n", bjson_getStatusAsText(result.statusCode));
+    }
+
+    bjson_batchDecoderDestroy(batchCtx);
+
+    if (fileName)
+    {
+      fclose(file);
+    }
+
+    free(buf);
+
+    printf("memory leaks:\t%u\n", memCtx.numMallocs - memCtx.numFrees);
+
+    fflush(stderr);
+    fflush(stdout);
+
+    return 0;
+  }
+
   /*
    * Create new decoder/encoder contexts.
    */
 
   g_decodeCtx = bjson_decoderCreate(&callbacks, &memoryFunctions, &memCtx);
 
+  if (useEvents)
+  {
+    /*
+     * Out of memory test. Event buffer can't be allocated, so decoder
+     * must stay on ordinary callbacks and give the same output.
+     */
+
+    memCtx.failAllocs = failEventsAlloc;
+
+    statusCode = bjson_decoderConfig(g_decodeCtx, bjson_decoderOption_batchCallback,
+                                     test_bjson_batch);
+
+    memCtx.failAllocs = 0;
+
+    if (failEventsAlloc && statusCode != bjson_status_error_outOfMemory)
+    {
+      DIE("ERROR: Event buffer allocated despite out of memory.\n");
+    }
+
+    statusCode = bjson_status_ok;
+  }
+
+  if (cacheArenaSize > 0)
+  {
+    /*
+     * Use caller owned arena to exercise cache grow/shrink paths. Heap
+     * cache taken for tokens bigger than arena must be freed after each
+     * one, so nothing more is allocated at the end.
+     */
+
+    cacheArena = malloc(cacheArenaSize);
+
+    if (cacheArena == NULL)
+    {
+      DIE("ERROR: Can't allocate cache arena.\n");
+    }
+
+    bjson_decoderConfig(g_decodeCtx, bjson_decoderOption_cacheArena,
+                        cacheArena, cacheArenaSize);
+
+    arenaBaseAllocs = memCtx.numMallocs - memCtx.numFrees;
+  }
+
   if (g_bjson_testMode == TEST_MODE_ENCODE)
   {
-    g_encodeCtx = bjson_encoderCreate(&memoryFunctions, &memCtx);
+    if (spillPath)
+    {
+      g_encodeCtx = bjson_encoderCreateSpill(NULL);
+
+      if (g_encodeCtx == NULL)
+      {
+        DIE("ERROR: Can't create spill file.\n");
+      }
+    }
+    else
+    {
+      g_encodeCtx = bjson_encoderCreate(&memoryFunctions, &memCtx);
+    }
+
+    bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_compactNumbers, compactNumbers);
+
+    if (useTemplate)
+    {
+      unsigned int numMallocs = memCtx.numMallocs;
+
+      g_template = bjson_templateCreate(&memoryFunctions, &memCtx);
+
+      if (memCtx.numMallocs == numMallocs)
+      {
+        fprintf(stderr, "ERROR: Template not allocated by memory functions.\n");
+      }
+    }
+
+    if (g_preparedKeys)
+    {
+      test_keyWhileStreaming();
+    }
+
+    if (referenceThreshold > 0)
+    {
+      bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_referenceThreshold,
+                          referenceThreshold);
+    }
+
+    if (growthPercent > 0)
+    {
+      bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_growthPercent,
+                          growthPercent);
+    }
+
+    if (reserveSize > 0)
+    {
+      bjson_encoderReserve(g_encodeCtx, reserveSize);
+    }
+  }
+
+  if (spliceRaw && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    /*
+     * Raw splice test. Pass whole input to encoder as one pre-encoded
+     * value with structure validation on. Decoder is not used at all.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_validateRaw, 1);
+
+    statusCode = bjson_encodeRaw(g_encodeCtx, buf, docSize);
+
+    if (statusCode != bjson_status_ok)
+    {
+      printf("raw error: %s\n", bjson_getStatusAsText(statusCode));
+    }
+
+    goOn = 0;
+  }
+  else if (twoPass && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    /*
+     * Two-pass encode test. Decode whole input twice: first time to
+     * measure encoded sizes, second time to write them.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    bjson_encoderBeginMeasure(g_encodeCtx);
+    bjson_decoderParse(g_decodeCtx, buf, docSize);
+    bjson_decoderComplete(g_decodeCtx);
+    bjson_decoderReset(g_decodeCtx);
+
+    bjson_encoderBeginWrite(g_encodeCtx, NULL);
+    statusCode = bjson_decoderParse(g_decodeCtx, buf, docSize);
+
+    goOn = 0;
+  }
+  else if (staticBufferSize > 0 && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    /*
+     * Static buffer test. Encode into caller buffer. If it's too small,
+     * encode once again into buffer as big as reported by encoder.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    void *output      = NULL;
+    size_t outputSize = 0;
+
+    bjson_encoderDestroy(g_encodeCtx);
+
+    test_staticNoAlloc();
+
+    staticBuffer = malloc(staticBufferSize);
+    g_encodeCtx  = bjson_encoderCreateStatic(staticBuffer, staticBufferSize);
+
+    bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_compactNumbers, compactNumbers);
+
+    bjson_decoderParse(g_decodeCtx, buf, docSize);
+    bjson_decoderComplete(g_decodeCtx);
+    bjson_decoderReset(g_decodeCtx);
+
+    if (bjson_encoderGetResult(g_encodeCtx, &output, &outputSize) == bjson_status_error_bufferFull)
+    {
+      bjson_encoderDestroy(g_encodeCtx);
+
+      staticBufferSize = outputSize;
+      staticBuffer     = realloc(staticBuffer, staticBufferSize);
+      g_encodeCtx      = bjson_encoderCreateStatic(staticBuffer, staticBufferSize);
+
+      bjson_encoderConfig(g_encodeCtx, bjson_encoderOption_compactNumbers, compactNumbers);
+    }
+    else
+    {
+      bjson_encoderClear(g_encodeCtx);
+    }
+
+    statusCode = bjson_decoderParse(g_decodeCtx, buf, docSize);
+
+    goOn = 0;
+  }
+  else if (numSinkRecords > 0 && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    /*
+     * Streaming test. Encode whole input as many records one after
+     * another. Each one goes to stdout as soon as it's complete.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    #ifdef WIN32
+    _setmode(1, _O_BINARY);
+    freopen(NULL, "wb", stdout);
+    #endif
+
+    bjson_encoderSetSink(g_encodeCtx, test_sinkToStdout, NULL);
+
+    for (i = 1; i < numSinkRecords; i++)
+    {
+      bjson_decoderParse(g_decodeCtx, buf, docSize);
+      bjson_decoderComplete(g_decodeCtx);
+      bjson_decoderReset(g_decodeCtx);
+    }
+
+    statusCode = bjson_decoderParse(g_decodeCtx, buf, docSize);
+
+    goOn = 0;
+  }
+  else if (reuseEncoder && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    /*
+     * Encoder reuse test. Encode whole input, clear encoder and encode
+     * it once again.
+     */
+
+    size_t docSize = test_readWholeInput(file, &buf, &bufSize);
+
+    bjson_decoderParse(g_decodeCtx, buf, docSize);
+    bjson_decoderComplete(g_decodeCtx);
+    bjson_decoderReset(g_decodeCtx);
+
+    bjson_encoderClear(g_encodeCtx);
+    statusCode = bjson_decoderParse(g_decodeCtx, buf, docSize);
+
+    goOn = 0;
   }
 
   /*
@@ -494,9 +1990,18 @@ int main(int argc, char ** argv)
     }
   }
 
-  statusCode = bjson_decoderComplete(g_decodeCtx);
+  if (!spliceRaw)
+  {
+    statusCode = bjson_decoderComplete(g_decodeCtx);
+  }
+
+  if (cacheArenaSize > 0 && statusCode == bjson_status_ok &&
+      memCtx.numMallocs - memCtx.numFrees != arenaBaseAllocs)
+  {
+    printf("heap cache kept after oversized token\n");
+  }
 
-  if (statusCode != bjson_status_ok)
+  if (statusCode != bjson_status_ok && !spliceRaw)
   {
     char *errorMsg = bjson_decoderFormatErrorMessage(g_decodeCtx, 0);
 
@@ -505,6 +2010,50 @@ int main(int argc, char ** argv)
     bjson_decoderFreeErrorMessage(g_decodeCtx, errorMsg);
   }
 
+  /*
+   * Compile recorded template and render it with decoded values.
+   */
+
+  if (g_template && statusCode == bjson_status_ok)
+  {
+    statusCode = bjson_templateCompile(g_template);
+
+    if (statusCode == bjson_status_ok)
+    {
+      statusCode = bjson_templateRender(g_encodeCtx, g_template, g_templateValues);
+    }
+
+    if (statusCode != bjson_status_ok)
+    {
+      printf("template error: %s\n", bjson_getStatusAsText(statusCode));
+    }
+  }
+
+  /*
+   * Print decoder statistics if requested.
+   */
+
+  if (printStats)
+  {
+    bjson_decoderStats_t stats;
+
+    bjson_decoderGetStats(g_decodeCtx, &stats);
+
+    fprintf(stderr, "bytes consumed:\t%" PRIu64 "\n", stats.bytesConsumed);
+    fprintf(stderr, "callbacks:\t%" PRIu64 "\n", stats.callbacksInvoked);
+    fprintf(stderr, "cache used:\t%" PRIu64 " times\n", stats.cacheActivations);
+    fprintf(stderr, "cache copied:\t%" PRIu64 " bytes\n", stats.cacheBytesCopied);
+    fprintf(stderr, "cache reallocs:\t%" PRIu64 "\n", stats.cacheReallocs);
+    fprintf(stderr, "header frags:\t%" PRIu64 "\n", stats.headerFragments);
+    fprintf(stderr, "cache peak:\t%zu bytes\n", stats.peakCacheCapacity);
+    fprintf(stderr, "max depth:\t%d\n", stats.maxDepth);
+
+    for (i = 0; i < bjson_decoderEvent_count; i++)
+    {
+      fprintf(stderr, "tokens[%d]:\t%" PRIu64 "\n", i, stats.tokens[i]);
+    }
+  }
+
   /*
    * Output re-encoded BJSON for encode test.
    */
@@ -514,17 +2063,97 @@ int main(int argc, char ** argv)
     void *output      = NULL;
     size_t outputSize = 0;
 
-    bjson_encoderGetResult(g_encodeCtx, &output, &outputSize);
+    const bjson_encoderChunk_t *chunks = NULL;
+    size_t numChunks                   = 0;
+
+    #ifdef WIN32
+    _setmode(1, _O_BINARY);
+    freopen(NULL, "wb", stdout);
+    #endif
+
+    if (shrinkToFit)
+    {
+      bjson_encoderShrinkToFit(g_encodeCtx);
+    }
+
+    if (detachResult)
+    {
+      bjson_encoderDetachResult(g_encodeCtx, &output, &outputSize);
+    }
+    else if (spillPath)
+    {
+      /*
+       * Write final document into file, then copy it to stdout.
+       */
+
+      FILE *spillFile = NULL;
+
+      if (bjson_encoderFinish(g_encodeCtx, spillPath) == bjson_status_ok &&
+          (spillFile = fopen(spillPath, "rb")) != NULL)
+      {
+        size_t spillSize = test_readWholeInput(spillFile, &buf, &bufSize);
+
+        fwrite(buf, 1, spillSize, stdout);
+        fclose(spillFile);
+      }
+
+      remove(spillPath);
+    }
+    else if (referenceThreshold > 0)
+    {
+      /*
+       * Write output chunk by chunk like writev() would do.
+       */
+
+      bjson_encoderGetChunks(g_encodeCtx, &chunks, &numChunks);
 
-    if (outputSize > 0)
+      for (i = 0; i < (int) numChunks; i++)
+      {
+        fwrite(chunks[i].buf, 1, chunks[i].bufLen, stdout);
+      }
+    }
+    else
     {
-      #ifdef WIN32
-      _setmode(1, _O_BINARY);
-      freopen(NULL, "wb", stdout);
-      #endif
+      bjson_encoderGetResult(g_encodeCtx, &output, &outputSize);
+    }
 
+    if (output && outputSize > 0)
+    {
       fwrite(output, 1, outputSize, stdout);
     }
+
+    if (detachResult)
+    {
+      bjson_encoderFreeResult(g_encodeCtx, output);
+    }
+  }
+
+  /*
+   * Print encoder statistics if requested.
+   */
+
+  if (printStats && g_bjson_testMode == TEST_MODE_ENCODE)
+  {
+    bjson_encoderStats_t stats;
+
+    bjson_encoderGetStats(g_encodeCtx, &stats);
+
+    fprintf(stderr, "bytes written:\t%" PRIu64 "\n", stats.bytesWritten);
+    fprintf(stderr, "nulls:\t%" PRIu64 "\n", stats.numNulls);
+    fprintf(stderr, "bools:\t%" PRIu64 "\n", stats.numBools);
+    fprintf(stderr, "integers:\t%" PRIu64 "\n", stats.numIntegers);
+    fprintf(stderr, "doubles:\t%" PRIu64 "\n", stats.numDoubles);
+    fprintf(stderr, "strings:\t%" PRIu64 "\n", stats.numStrings);
+    fprintf(stderr, "keys:\t%" PRIu64 "\n", stats.numKeys);
+    fprintf(stderr, "binaries:\t%" PRIu64 "\n", stats.numBinaries);
+    fprintf(stderr, "arrays:\t%" PRIu64 "\n", stats.numArrays);
+    fprintf(stderr, "maps:\t%" PRIu64 "\n", stats.numMaps);
+    fprintf(stderr, "raws:\t%" PRIu64 "\n", stats.numRaws);
+    fprintf(stderr, "out reallocs:\t%" PRIu64 "\n", stats.numReallocs);
+    fprintf(stderr, "out copied:\t%" PRIu64 " bytes\n", stats.reallocBytesCopied);
+    fprintf(stderr, "out moved:\t%" PRIu64 " bytes\n", stats.bytesMoved);
+    fprintf(stderr, "header waste:\t%" PRIu64 " bytes\n", stats.headerBytesWasted);
+    fprintf(stderr, "out max depth:\t%d\n", stats.maxDepth);
   }
 
   /*
@@ -534,6 +2163,34 @@ int main(int argc, char ** argv)
   bjson_decoderDestroy(g_decodeCtx);
   bjson_encoderDestroy(g_encodeCtx);
 
+  free(cacheArena);
+  free(staticBuffer);
+  free(g_bulkIntegers);
+  free(g_bulkDoubles);
+
+  for (i = 0; i < g_numKeys; i++)
+  {
+    free(g_keys[i].text);
+    bjson_keyFree(g_keys[i].key);
+  }
+
+  for (i = 0; i < (int) g_templateNumValues; i++)
+  {
+    free(g_templateCopies[i]);
+  }
+
+  free(g_templateValues);
+  free(g_templateCopies);
+
+  for (i = 0; i < (int) g_numKeptStrings; i++)
+  {
+    free(g_keptStrings[i]);
+  }
+
+  free(g_keptStrings);
+
+  bjson_templateDestroy(g_template);
+
   if (fileName)
   {
     fclose(file);
@@ -552,6 +2209,11 @@ int main(int argc, char ** argv)
   {
     printf("memory leaks:\t%u\n", memCtx.numMallocs - memCtx.numFrees);
   }
+  else if (memCtx.numMallocs != memCtx.numFrees)
+  {
+    fprintf(stderr, "ERROR: [%u] encoder allocations not freed.\n",
+            memCtx.numMallocs - memCtx.numFrees);
+  }
 
   fflush(stderr);
   fflush(stdout);
@@ -67,12 +67,20 @@ for mode in "encode" "decode"; do
     corruptedTest=0
     skipTest=0
     status="OK"
+    encodeArgs=""
+    encodeGold=$file
 
     # if the filename starts with dc_, we disallow comments for this test
+    # compact-* files are encoded with compact numbers policy and compared
+    # to .compact file
     case $(basename $file) in
       corrupted-*)
         corruptedTest=1;
         ;;
+      compact-*)
+        encodeArgs="--compact-numbers"
+        encodeGold=${file}.compact
+        ;;
     esac
     fileShort=`basename $file`
     testName=`echo $fileShort | sed -e 's/\.bjson$//'`
@@ -87,19 +95,86 @@ for mode in "encode" "decode"; do
       #
 
       if [ "$corruptedTest" -eq "1" ]; then
-        skipTest=1
-        status="SKIPPED"
+        # corrupted input must be rejected when spliced as raw value
+        # with validation on.
+        $testBin "--encode" "--raw" < $file > ${file}.test 2>&1
+        grep -q "^raw error: " ${file}.test
+        if [ $? -ne 0 ] ; then
+          status="FAIL"
+          ${ECHO} "$status (--raw)"
+          exit 1
+        fi
+        testsSucceeded=$(( $testsSucceeded + 1 ))
 
       else
-        $testBin "--encode" < $file > ${file}.test 2>&1
-        diff ${DIFF_FLAGS} ${file} ${file}.test > ${file}.out
-        if [ $? -eq 0 ] ; then
-          testsSucceeded=$(( $testsSucceeded + 1 ))
-        else
+        # encode with default one pass mode, with two passes
+        # (measure, then write), with cleared encoder, into too small
+        # static buffer (retried with reported size), with detached
+        # output buffer, with numeric arrays written at once, with
+        # prepared map keys, with long strings referenced in place,
+        # with output spilled into temporary file, with strings
+        # streamed in pieces and with junk sub-objects rolled back.
+        for extraArgs in "" "--two-pass" "--reuse" "--static 16" "--detach" "--static 16 --detach" "--bulk" "--bulk --two-pass" "--bulk --static 16" "--prepared-keys" "--prepared-keys --static 16" "--reference 8" "--reference 8 --two-pass" "--reference 8 --reuse" "--reference 8 --detach" "--spill ${file}.spill" "--spill ${file}.spill --reference 8" "--spill ${file}.spill --two-pass" "--streamed-strings 3" "--streamed-strings 3 --two-pass" "--streamed-strings 3 --static 16" "--streamed-strings 3 --reference 2" "--streamed-strings 100 --spill ${file}.spill" "--rollback" "--rollback --two-pass" "--rollback --static 16" "--rollback --reference 8" "--rollback --spill ${file}.spill" "--reserve 100000" "--reserve 16 --two-pass" "--growth 10" "--growth 1 --shrink" "--shrink --detach" "--shrink --reference 8" "--growth 10 --spill ${file}.spill --shrink" ; do
+          $testBin "--encode" $encodeArgs $extraArgs < $file > ${file}.test 2>&1
+          diff ${DIFF_FLAGS} ${encodeGold} ${file}.test > ${file}.out
+          if [ $? -ne 0 ] ; then
+            status="FAIL"
+            ${ECHO} "$status ($extraArgs)"
+            exit 1
+          fi
+        done
+
+        # stream input three times as separate records into encoder
+        # sink. Output must be three plain outputs one after another.
+        for extraArgs in "" "--reference 8" "--rollback" ; do
+          $testBin "--encode" $encodeArgs $extraArgs < $file > ${file}.plain 2>&1
+          cat ${file}.plain ${file}.plain ${file}.plain > ${file}.gold3
+          $testBin "--encode" $encodeArgs $extraArgs "--sink" "3" < $file > ${file}.test 2>&1
+          cmp -s ${file}.gold3 ${file}.test
+          if [ $? -ne 0 ] ; then
+            status="FAIL"
+            ${ECHO} "$status (--sink 3 $extraArgs)"
+            exit 1
+          fi
+          rm ${file}.plain ${file}.gold3
+        done
+
+        # encoder statistics must count all output bytes, including
+        # records already passed to sink.
+        for extraArgs in "" "--two-pass" "--detach" "--reference 8" "--sink 3" ; do
+          $testBin "--encode" $encodeArgs $extraArgs "--stats" < $file > ${file}.test 2> ${file}.stats
+          outSize=`wc -c < ${file}.test | tr -d ' '`
+          statsSize=`grep "^bytes written:" ${file}.stats | cut -f 2`
+          if [ "$outSize" != "$statsSize" ] ; then
+            status="FAIL"
+            ${ECHO} "$status (--stats $extraArgs)"
+            exit 1
+          fi
+          rm ${file}.stats
+        done
+
+        # record whole input as template with slot for each value and
+        # render it. Output must be the same as from plain encoder.
+        $testBin "--encode" < $file > ${file}.plain 2>&1
+        $testBin "--encode" "--template" < $file > ${file}.test 2>&1
+        cmp -s ${file}.plain ${file}.test
+        if [ $? -ne 0 ] ; then
           status="FAIL"
-          ${ECHO} $status
+          ${ECHO} "$status (--template)"
+          exit 1
+        fi
+        rm ${file}.plain
+
+        # splice whole input as one raw value. Output must be the same
+        # as input.
+        $testBin "--encode" "--raw" < $file > ${file}.test 2>&1
+        cmp -s ${file} ${file}.test
+        if [ $? -ne 0 ] ; then
+          status="FAIL"
+          ${ECHO} "$status (--raw)"
           exit 1
         fi
+        testsSucceeded=$(( $testsSucceeded + 1 ))
       fi
 
     else
@@ -125,6 +200,76 @@ for mode in "encode" "decode"; do
         iter=$(( iter + 1 ))
         rm ${file}.test ${file}.out
       done
+
+      # decode once again using alternative decoder modes:
+      # - single document decoded by worker threads pool,
+      # - batched events delivery with a few read buffer sizes,
+      # - batched events requested, but event buffer allocation failed,
+      # - small caller owned cache arena.
+      for extraArgs in "--threads 2" "--events -b 1" "--events -b 7" "--events" "--events-oom -b 7" "--cache-arena 16 -b 3" ; do
+        if [ $status = "OK" ] ; then
+          ${ECHO} -n "+"
+          $testBin $extraArgs < $file > ${file}.test  2>&1
+          diff ${DIFF_FLAGS} ${file}.gold ${file}.test > ${file}.out
+          if [ $? -ne 0 ] ; then
+            status="FAIL"
+            ${ECHO} "$status ($extraArgs)"
+            cat ${file}.out
+            exit 1
+          fi
+          rm ${file}.test ${file}.out
+        fi
+      done
+
+      # decoder statistics must match input: all bytes consumed, one
+      # callback per token and, with one byte reads, each string or key
+      # longer than one byte went through cache and each number wider
+      # than one byte was joined from header fragments.
+      if [ $status = "OK" ] && ! grep -q "^parse error" ${file}.gold ; then
+        ${ECHO} -n "+"
+        $testBin -b 1 --stats < $file > /dev/null 2> ${file}.stats
+        fileSize=`wc -c < $file | tr -d ' '`
+        statsError=`awk -F '\t' -v fileSize=$fileSize '
+          NR == FNR {
+            stats[$1] = $2 + 0
+            if ($1 ~ /^tokens/) { numTokens += $2 }
+            next
+          }
+          /^(null$|bool: |integer: |double: |string: |key: |map open|map close|array open|array close)/ { goldTokens++ }
+          /^integer: / { v = substr($0, 10) + 0; if (v > 255 || v < -255) { numWide++ } }
+          /^double: / { numWide++ }
+          /^string: / && length($0) > 11 { numLong++ }
+          /^key: / && length($0) > 8 { numLong++ }
+          END {
+            if (stats["bytes consumed:"] != fileSize) { print "bytes consumed" }
+            else if (numTokens != goldTokens) { print "tokens" }
+            else if (stats["callbacks:"] != goldTokens) { print "callbacks" }
+            else if (stats["cache used:"] < numLong) { print "cache used" }
+            else if (stats["header frags:"] < numWide) { print "header frags" }
+          }' ${file}.stats ${file}.gold`
+        if [ -n "$statsError" ] ; then
+          status="FAIL"
+          ${ECHO} "$status (-b 1 --stats: $statsError)"
+          cat ${file}.stats
+          exit 1
+        fi
+        rm ${file}.stats
+      fi
+
+      # decode many copies of input, some of them cut or broken, in a
+      # few rounds on the same worker threads pool. Each document must
+      # give the same status and tokens as ordinary decoder.
+      if [ $status = "OK" ] ; then
+        ${ECHO} -n "+"
+        $testBin --threads 4 --batch-docs 64 < $file > ${file}.test 2>&1
+        if [ $? -ne 0 ] ; then
+          status="FAIL"
+          ${ECHO} "$status (--threads 4 --batch-docs 64)"
+          cat ${file}.test
+          exit 1
+        fi
+        rm ${file}.test
+      fi
     fi
 
     # Report test result.